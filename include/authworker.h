@@ -0,0 +1,34 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Worker threads for CPU-heavy authentication steps.
+ */
+
+/*
+ * How many jobs can wait for a worker.  When the queue is full the work is
+ * done inline on the main thread instead.
+ */
+#define AUTH_WORKER_QUEUE_SIZE 64
+
+void auth_worker_setup(void);
+bool auth_worker_check_passwd(PgSocket *client, const char *passwd) _MUSTCHECK;
+bool auth_worker_build_scram_secret(PgSocket *client) _MUSTCHECK;
+void auth_worker_forget(PgSocket *client);
+int auth_worker_poll(void);
+uint64_t auth_worker_job_count(void);
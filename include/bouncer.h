@@ -145,10 +145,14 @@ enum PacketCallbackFlag {
 
 typedef struct PgSocket PgSocket;
 typedef struct PgCredentials PgCredentials;
+typedef struct PgScramKeys PgScramKeys;
 typedef struct PgGlobalUser PgGlobalUser;
 typedef struct PgDatabase PgDatabase;
 typedef struct PgPool PgPool;
 typedef struct PgStats PgStats;
+typedef struct PgLatencyHist PgLatencyHist;
+typedef struct PgLatency PgLatency;
+typedef enum LatencyKind LatencyKind;
 typedef union PgAddr PgAddr;
 typedef enum SocketState SocketState;
 typedef enum PacketCallbackFlag PacketCallbackFlag;
@@ -157,11 +161,13 @@ typedef struct PktBuf PktBuf;
 typedef struct ScramState ScramState;
 typedef struct PgPreparedStatement PgPreparedStatement;
 typedef enum ResponseAction ResponseAction;
+typedef struct OutstandingRequest OutstandingRequest;
 typedef enum ReplicationType ReplicationType;
 
 extern int cf_sbuf_len;
 
 #include "util.h"
+#include "probes.h"
 #include "iobuf.h"
 #include "sbuf.h"
 #include "pktbuf.h"
@@ -176,11 +182,13 @@ extern int cf_sbuf_len;
 #include "proto.h"
 #include "objects.h"
 #include "stats.h"
+#include "recorder.h"
 #include "takeover.h"
 #include "janitor.h"
 #include "hba.h"
 #include "messages.h"
 #include "pam.h"
+#include "authworker.h"
 #include "prepare.h"
 
 #ifndef WIN32
@@ -331,6 +339,43 @@ struct PgStats {
 	uint64_t ps_server_parse_count;
 	uint64_t ps_client_parse_count;
 	uint64_t ps_bind_count;
+
+	/* TLS handshakes that resumed a session vs. full handshakes */
+	uint64_t client_tls_session_hits;
+	uint64_t client_tls_session_misses;
+};
+
+/*
+ * Latency histogram in microseconds.  Values below LATENCY_SUB_BUCKETS get
+ * a bucket each, above that every power of two is split into
+ * LATENCY_SUB_BUCKETS equal steps, so a bucket is never wider than 1/8 of
+ * its lower bound.  272 buckets cover everything below 2^36 us (19 hours),
+ * longer values land in the last bucket.
+ */
+#define LATENCY_SUB_BITS	3
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS		272
+
+enum LatencyKind {
+	LATENCY_QUERY,
+	LATENCY_XACT,
+	LATENCY_WAIT,
+	LATENCY_KINDS
+};
+
+struct PgLatencyHist {
+	uint64_t count;
+	usec_t max;
+	uint32_t buckets[LATENCY_BUCKETS];
+};
+
+/*
+ * Per-pool latency histograms, allocated on the first sample.
+ * ->cur is updated online, each stats_period it is moved to ->last.
+ */
+struct PgLatency {
+	PgLatencyHist cur[LATENCY_KINDS];
+	PgLatencyHist last[LATENCY_KINDS];
 };
 
 /*
@@ -345,6 +390,7 @@ struct PgStats {
 struct PgPool {
 	struct List head;			/* entry in global pool_list */
 	struct List map_head;			/* entry in user->pool_list */
+	struct List maint_head;			/* entry in per-loop maintenance list, if queued */
 
 	PgDatabase *db;			/* corresponding database */
 	/*
@@ -451,12 +497,16 @@ struct PgPool {
 	PgStats newer_stats;
 	PgStats older_stats;
 
+	PgLatency *latency;		/* query/xact/wait histograms, NULL until first sample */
+	struct PoolEventLog *events;	/* flight recorder, NULL until first event */
+
 	/* database info to be sent to client */
 	struct PktBuf *welcome_msg;	/* ServerParams without VarCache ones */
 
 	VarCache orig_vars;		/* default params from server */
 
 	usec_t last_lifetime_disconnect;/* last time when server_lifetime was applied */
+	usec_t idle_since;		/* since when the pool has no clients or servers, 0 if it has */
 
 	/* if last connect to server failed, there should be delay before next */
 	usec_t last_connect_time;
@@ -466,6 +516,14 @@ struct PgPool {
 	bool welcome_msg_ready : 1;
 
 	uint16_t rrcounter;		/* round-robin counter */
+
+	/*
+	 * Bytes of buffers held on behalf of this pool: socket I/O buffers,
+	 * queued and spooled packets, buffered complete packets, outstanding
+	 * requests and prepared statement cache entries.
+	 */
+	size_t mem_used;
+	int mem_throttled_count;	/* clients paused by pool_mem_limit */
 };
 
 /*
@@ -517,13 +575,18 @@ struct PgPool {
 struct PgCredentials {
 	struct List pool_list;		/* list of pools where pool->user == this user */
 	struct AANode tree_node;	/* used to attach user to tree */
-	char name[MAX_USERNAME];
-	char passwd[MAX_PASSWORD];
-	uint8_t scram_ClientKey[32];
-	uint8_t scram_ServerKey[32];
-	bool has_scram_keys;		/* true if the above two are valid */
+	/*
+	 * Name and secret point into a shared string pool and are changed
+	 * only with set_credentials_name() and set_credentials_passwd().
+	 */
+	const char *name;
+	const char *passwd;		/* "" if not known */
+	struct PStr *name_str;		/* storage of ->name */
+	struct PStr *passwd_str;	/* storage of ->passwd, NULL if empty */
+	PgScramKeys *scram_keys;	/* SCRAM keys learned from a client, NULL if none */
 	bool mock_auth;			/* not a real user, only for mock auth */
 	bool dynamic_passwd;		/* does the password need to be refreshed every use */
+	usec_t auth_query_time;		/* when passwd was fetched by auth_query, 0 if not cached */
 
 	/*
 	 * global_user points at the global user which is used for configuration
@@ -532,6 +595,12 @@ struct PgCredentials {
 	PgGlobalUser *global_user;
 };
 
+/* SCRAM keys of a user, to log in to the server without the password */
+struct PgScramKeys {
+	uint8_t ClientKey[32];
+	uint8_t ServerKey[32];
+};
+
 /*
  * The global user is used for configuration settings and connection count. It
  * includes credentials, but these are empty if the user is not configured in
@@ -572,6 +641,8 @@ struct PgDatabase {
 	int pool_mode;		/* pool mode for this database */
 	int max_db_connections;	/* max server connections between all pools */
 	usec_t server_lifetime;	/* max lifetime of server connection */
+	int result_spool_size;	/* max bytes of a result spooled for a slow client */
+	int pool_mem_limit;	/* max bytes of buffers one pool may hold before throttling */
 	char *connect_query;	/* startup commands to send to server after connect */
 
 	struct PktBuf *startup_params;	/* partial StartupMessage (without user) be sent to server */
@@ -614,7 +685,10 @@ enum ResponseAction {
 	RA_FAKE,
 };
 
-typedef struct OutstandingRequest {
+/* number of request_slots per server, bounded by the width of request_slots_used */
+#define OUTSTANDING_REQUEST_SLOTS 8
+
+struct OutstandingRequest {
 	struct List node;
 	char type;	/* The single character type of the request */
 	ResponseAction action;	/* What action to take (see comments on ResponseAction) */
@@ -626,7 +700,7 @@ typedef struct OutstandingRequest {
 	PgServerPreparedStatement *server_ps;
 
 	uint64_t server_ps_query_id;
-} OutstandingRequest;
+};
 
 enum ReplicationType {
 	REPLICATION_NONE = 0,
@@ -642,18 +716,16 @@ extern const char *replication_type_parameters[3];
  * ->state corresponds to various lists the struct can be at.
  */
 struct PgSocket {
+	/*
+	 * Fields used for every packet and on every walk of the pool
+	 * lists come first, the stream buffer included, so the forwarding
+	 * path touches one contiguous block.  Login-time and janitor state
+	 * is further down or not allocated at all after login.
+	 */
 	struct List head;		/* list header for pool list */
-	struct List cancel_head;	/* list header for server->canceling_clients */
 	PgSocket *link;		/* the dest of packets */
 	PgPool *pool;		/* parent pool, if NULL not yet assigned */
 
-	PgCredentials *login_user_credentials;	/* presented login, for client it may differ from pool->user */
-
-	int client_auth_type;	/* auth method decided by hba */
-
-	/* the queue of requests that we still expect a server response for */
-	struct StatList outstanding_requests;
-
 	SocketState state : 8;		/* this also specifies socket location */
 
 	bool ready : 1;			/* server: accepts new query */
@@ -663,11 +735,21 @@ struct PgSocket {
 	bool exec_on_connect : 1;	/* server: executing connect_query */
 	bool resetting : 1;		/* server: executing reset query from auth login; don't release on flush */
 	bool copy_mode : 1;		/* server: in copy stream, ignores any Sync packets until CopyDone or CopyFail */
+	bool session_dirty : 1;		/* server: client did something server_reset_query has to undo */
+	bool prepared_dirty : 1;	/* server: client created named prepared statements */
+	bool session_held : 1;		/* server: session may hold advisory locks, LISTEN or temp tables */
+	bool params_changed : 1;	/* server: reported parameters changed since last reset */
+	bool reset_pending : 1;		/* server: reset query goes out ahead of the next client's queries */
+	bool reset_inflight : 1;	/* server: response to a pipelined reset query not yet seen */
+	bool query_canceled : 1;	/* server: query_timeout sent a cancel request for the running query */
+	bool salvaging : 1;		/* server: client went away, bringing the server back to idle */
 
 	bool wait_for_welcome : 1;	/* client: no server yet in pool, cannot send welcome msg */
 	bool wait_for_user_conn : 1;	/* client: waiting for auth_conn server connection */
 	bool wait_for_user : 1;		/* client: waiting for auth_conn query results */
 	bool wait_for_auth : 1;		/* client: waiting for external auth (PAM) to be completed */
+	bool pinned : 1;		/* client: created session state, keeps its server in transaction pooling */
+	bool mem_throttled : 1;		/* client: reads paused because its pool is over pool_mem_limit */
 
 	bool suspended : 1;		/* client/server: if the socket is suspended */
 
@@ -681,42 +763,17 @@ struct PgSocket {
 	bool query_failed : 1;
 
 	ReplicationType replication;	/* If this is a replication connection */
-	char *startup_options;	/* only tracked for replication connections */
 
-	usec_t connect_time;	/* when connection was made */
+	SBuf sbuf;		/* stream buffer */
+
+	/* the queue of requests that we still expect a server response for */
+	struct StatList outstanding_requests;
+
 	usec_t request_time;	/* last activity time */
 	usec_t query_start;	/* client: query start moment */
 	usec_t xact_start;	/* client: xact start moment */
 	usec_t wait_start;	/* client: waiting start moment */
 
-	uint8_t cancel_key[BACKENDKEY_LEN];	/* client: generated, server: remote */
-	struct StatList canceling_clients;	/* clients trying to cancel the query on this connection */
-	PgSocket *canceled_server;	/* server that is being canceled by this request */
-
-	PgAddr remote_addr;	/* ip:port for remote endpoint */
-	PgAddr local_addr;	/* ip:port for local endpoint */
-
-	union {
-		struct DNSToken *dns_token;	/* ongoing request */
-		PgDatabase *db;			/* cache db while doing auth query */
-	};
-
-	struct ScramState {
-		char *client_nonce;
-		char *client_first_message_bare;
-		char *client_final_message_without_proof;
-		char *server_nonce;
-		char *server_first_message;
-		uint8_t *SaltedPassword;
-		char cbind_flag;
-		bool adhoc;	/* SCRAM data made up from plain-text password */
-		int iterations;
-		char *salt;	/* base64-encoded */
-		uint8_t ClientKey[32];	/* SHA256_DIGEST_LENGTH */
-		uint8_t StoredKey[32];
-		uint8_t ServerKey[32];
-	} scram_state;
-
 	VarCache vars;		/* state of interesting server parameters */
 
 	/* client: prepared statements prepared by this client */
@@ -738,8 +795,47 @@ struct PgSocket {
 		PktHdr pkt;
 	} packet_cb_state;
 
+	/*
+	 * Fields below are used at login, by the janitor or only in rare
+	 * cases.
+	 */
+
+	/* server: preallocated entries for outstanding_requests, see alloc_outstanding_request() */
+	OutstandingRequest *request_slots;
+	uint8_t request_slots_used;	/* bitmap of request_slots in use */
+	uint16_t timer_slot;		/* wheel slot the timer is in */
+	uint64_t timer_tick;		/* wheel tick the timer is due, 0 if not armed */
+	struct List timer_head;		/* list header for janitor timer wheel slot */
+
+	/* bytes charged to the pool besides sbuf, see charge_socket_mem() */
+	size_t mem_charged;
+
+	usec_t salvage_start;	/* server: when salvaging started */
+	unsigned salvage_bytes;	/* server: bytes discarded while salvaging */
+
+	PgCredentials *login_user_credentials;	/* presented login, for client it may differ from pool->user */
+
+	int client_auth_type;	/* auth method decided by hba */
+
+	usec_t connect_time;	/* when connection was made */
+
+	uint8_t cancel_key[BACKENDKEY_LEN];	/* client: generated, server: remote */
+	struct List cancel_head;	/* list header for server->canceling_clients */
+	struct StatList canceling_clients;	/* clients trying to cancel the query on this connection */
+	PgSocket *canceled_server;	/* server that is being canceled by this request */
+
+	PgAddr remote_addr;	/* ip:port for remote endpoint */
+	PgAddr local_addr;	/* ip:port for local endpoint */
+
+	char *startup_options;	/* only tracked for replication connections */
+
+	union {
+		struct DNSToken *dns_token;	/* ongoing request */
+		PgDatabase *db;			/* cache db while doing auth query */
+	};
+	uint64_t auth_query_key;	/* client: negative cache key of the running auth query */
 
-	SBuf sbuf;		/* stream buffer, must be last */
+	ScramState *scram_state;	/* only allocated during a SCRAM exchange */
 };
 
 #define RAW_IOBUF_SIZE  offsetof(IOBuf, buf)
@@ -778,24 +874,32 @@ extern int cf_max_user_connections;
 
 extern char *cf_autodb_connstr;
 extern usec_t cf_autodb_idle_timeout;
+extern int cf_pool_event_history;
+extern usec_t cf_pool_idle_timeout;
 
 extern usec_t cf_suspend_timeout;
 extern usec_t cf_server_lifetime;
 extern usec_t cf_server_idle_timeout;
 extern char *cf_server_reset_query;
 extern int cf_server_reset_query_always;
+extern int cf_server_reset_query_skip_clean;
+extern int cf_transaction_pin_session_state;
 extern char *cf_server_check_query;
 extern usec_t cf_server_check_delay;
 extern int cf_server_fast_close;
 extern usec_t cf_server_connect_timeout;
 extern usec_t cf_server_login_retry;
 extern usec_t cf_query_timeout;
+extern int cf_query_timeout_cancel;
 extern usec_t cf_query_wait_timeout;
 extern usec_t cf_cancel_wait_timeout;
 extern usec_t cf_client_idle_timeout;
 extern usec_t cf_client_login_timeout;
 extern usec_t cf_idle_transaction_timeout;
 extern int cf_server_round_robin;
+extern int cf_server_check_socket;
+extern usec_t cf_server_salvage_timeout;
+extern int cf_server_salvage_max_bytes;
 extern int cf_disable_pqexec;
 extern usec_t cf_dns_max_ttl;
 extern usec_t cf_dns_nxdomain_ttl;
@@ -803,8 +907,10 @@ extern usec_t cf_dns_zone_check_period;
 extern char *cf_resolv_conf;
 
 extern int cf_auth_type;
+extern int cf_auth_workers;
 extern char *cf_auth_file;
 extern char *cf_auth_query;
+extern usec_t cf_auth_query_cache_ttl;
 extern char *cf_auth_user;
 extern char *cf_auth_hba_file;
 extern char *cf_auth_dbname;
@@ -817,6 +923,7 @@ extern char *cf_admin_users;
 extern char *cf_stats_users;
 extern int cf_stats_period;
 extern int cf_log_stats;
+extern usec_t cf_loop_warn_time;
 
 extern int cf_pause_mode;
 extern int cf_shutdown;
@@ -825,6 +932,8 @@ extern int cf_reboot;
 extern unsigned int cf_max_packet_size;
 
 extern int cf_sbuf_loopcnt;
+extern int cf_result_spool_size;
+extern int cf_pool_mem_limit;
 extern int cf_so_reuseport;
 extern int cf_tcp_keepalive;
 extern int cf_tcp_keepcnt;
@@ -847,6 +956,7 @@ extern char *cf_client_tls_key_file;
 extern char *cf_client_tls_ciphers;
 extern char *cf_client_tls_dheparams;
 extern char *cf_client_tls_ecdhecurve;
+extern usec_t cf_client_tls_session_lifetime;
 
 extern int cf_server_tls_sslmode;
 extern char *cf_server_tls_protocols;
@@ -19,5 +19,9 @@
 bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *pkt)  _MUSTCHECK;
 bool set_pool(PgSocket *client, const char *dbname, const char *username, const char *password, bool takeover) _MUSTCHECK;
 bool handle_auth_query_response(PgSocket *client, PktHdr *pkt);
+void forget_cached_auth_query(PgSocket *client);
+bool check_passwd_secret(PgSocket *client, int auth_type, const char *username,
+			 const char *stored_passwd, const uint8_t *login_salt,
+			 const char *passwd);
 
 PgDatabase *prepare_auth_database(PgSocket *client) _MUSTCHECK;
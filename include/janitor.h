@@ -20,6 +20,11 @@ void janitor_setup(void);
 void config_postprocess(void);
 void resume_all(void);
 void per_loop_maint(void);
+void queue_pool_maint(PgPool *pool);
+void update_socket_timer(PgSocket *sk);
+void rearm_socket_timers(void);
+void set_db_paused(PgDatabase *db, bool paused);
+void set_db_wait_close(PgDatabase *db);
 bool suspend_socket(PgSocket *sk, bool force)  _MUSTCHECK;
 void kill_pool(PgPool *pool);
 void kill_peer_pool(PgPool *pool);
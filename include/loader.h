@@ -25,3 +25,4 @@ bool parse_user(void *base, const char *name, const char *params) _MUSTCHECK;
 /* user file parsing */
 bool load_auth_file(const char *fn) /* _MUSTCHECK */;
 bool loader_users_check(void) /* _MUSTCHECK */;
+void loader_cleanup(void);
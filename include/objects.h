@@ -35,6 +35,7 @@ extern struct Slab *iobuf_cache;
 extern struct Slab *outstanding_request_cache;
 extern struct Slab *var_list_cache;
 extern struct Slab *server_prepared_statement_cache;
+extern struct Slab *scram_state_cache;
 extern PgPreparedStatement *prepared_statements;
 
 PgDatabase *find_peer(int peer_id);
@@ -51,6 +52,7 @@ bool evict_user_connection(PgCredentials *user_credentials)        _MUSTCHECK;
 bool find_server(PgSocket *client)              _MUSTCHECK;
 bool life_over(PgSocket *server);
 bool release_server(PgSocket *server) /* _MUSTCHECK */;
+void reset_idle_server(PgSocket *server);
 bool finish_client_login(PgSocket *client)      _MUSTCHECK;
 bool check_fast_fail(PgSocket *client)          _MUSTCHECK;
 
@@ -67,14 +69,33 @@ PgCredentials *add_global_credentials(const char *name, const char *passwd) _MUS
 PgCredentials * add_dynamic_credentials(PgDatabase *db, const char *name, const char *passwd) _MUSTCHECK;
 PgCredentials * force_user_credentials(PgDatabase *db, const char *username, const char *passwd) _MUSTCHECK;
 bool add_outstanding_request(PgSocket *client, char type, ResponseAction action) _MUSTCHECK;
+bool add_server_outstanding_request(PgSocket *server, char type, ResponseAction action) _MUSTCHECK;
 bool pop_outstanding_request(PgSocket *client, char *types, bool *skip);
 bool clear_outstanding_requests_until(PgSocket *server, char *types) _MUSTCHECK;
 bool queue_fake_response(PgSocket *client, char request_type) _MUSTCHECK;
+void free_outstanding_request(PgSocket *server, OutstandingRequest *request);
+
+void set_socket_mem_pool(PgSocket *sk, PgPool *pool);
+void charge_socket_mem(PgSocket *sk, ssize_t delta);
+void pool_mem_released(size_t *account);
+void free_buffered_packet(PgSocket *client);
+int pool_mem_limit(PgPool *pool);
+bool pool_over_mem_limit(PgPool *pool);
+void resume_mem_throttled_clients(PgPool *pool);
 
 PgCredentials * add_pam_credentials(const char *name, const char *passwd) _MUSTCHECK;
+bool set_credentials_name(PgCredentials *credentials, const char *name) _MUSTCHECK;
+bool set_credentials_passwd(PgCredentials *credentials, const char *passwd) _MUSTCHECK;
+bool set_credentials_scram_keys(PgCredentials *credentials, const uint8_t *client_key, const uint8_t *server_key) _MUSTCHECK;
+void clear_credentials(PgCredentials *credentials);
+void free_credentials(PgCredentials *credentials);
 
 void accept_cancel_request(PgSocket *req);
 bool forward_cancel_request(PgSocket *server);
+bool cancel_server_query(PgSocket *server) _MUSTCHECK;
+
+bool alloc_scram_state(PgSocket *sk) _MUSTCHECK;
+void release_scram_state(PgSocket *sk);
 
 void launch_new_connection(PgPool *pool, bool evict_if_needed);
 
@@ -0,0 +1,43 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Static USDT probes, provider "pgbouncer".  A probe is a single nop
+ * in the code until a tracer attaches to it, e.g.:
+ *
+ *   bpftrace -e 'usdt:./pgbouncer:pgbouncer:find_server_miss { @[arg1] = count(); }'
+ *
+ * Without <sys/sdt.h> they compile to nothing.
+ */
+
+#ifdef USE_USDT
+
+#include <sys/sdt.h>
+
+#define PGB_PROBE1(name, a)		DTRACE_PROBE1(pgbouncer, name, a)
+#define PGB_PROBE2(name, a, b)		DTRACE_PROBE2(pgbouncer, name, a, b)
+#define PGB_PROBE3(name, a, b, c)	DTRACE_PROBE3(pgbouncer, name, a, b, c)
+
+#else
+
+/* still evaluate the arguments, so they don't look unused */
+#define PGB_PROBE1(name, a)		do { (void)(a); } while (0)
+#define PGB_PROBE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+#define PGB_PROBE3(name, a, b, c)	do { (void)(a); (void)(b); (void)(c); } while (0)
+
+#endif
@@ -38,6 +38,7 @@ struct PktHdr {
 };
 
 bool get_header(struct MBuf *data, PktHdr *pkt) _MUSTCHECK;
+unsigned pkt_run_len(const struct MBuf *data, const char *types);
 
 bool send_pooler_error(PgSocket *client, bool send_ready, const char *sqlstate, bool level_fatal, const char *msg) /*_MUSTCHECK*/;
 void log_server_error(const char *note, PktHdr *pkt);
@@ -0,0 +1,53 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Flight recorder: the last pool_event_history events of each pool,
+ * kept in memory so they can be looked at after an incident.
+ */
+
+enum PoolEventType {
+	PEV_CLIENT_STATE,	/* client moved from ->from to ->to */
+	PEV_SERVER_STATE,	/* same for a server; free -> login is a connect attempt */
+	PEV_EVICT,		/* idle server closed to make room, ->what says for whom */
+	PEV_TIMEOUT,		/* ->what is the timeout */
+};
+
+struct PoolEvent {
+	usec_t time;
+	const PgSocket *sk;	/* only for matching with log lines */
+	const char *what;	/* static string */
+	uint8_t type;
+	uint8_t from;
+	uint8_t to;
+};
+
+/* ring buffer, ->next is overwritten first */
+struct PoolEventLog {
+	uint32_t size;
+	uint32_t next;
+	uint64_t count;		/* events recorded since allocation */
+	struct PoolEvent ev[FLEX_ARRAY];
+};
+
+void record_state_change(PgSocket *sk, SocketState newstate);
+void record_pool_event(PgPool *pool, enum PoolEventType type, const PgSocket *sk, const char *what);
+void free_pool_events(PgPool *pool);
+void log_pool_events(void);
+
+bool admin_pool_events(PgSocket *admin, const char *dbname)  _MUSTCHECK;
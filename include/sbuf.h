@@ -29,7 +29,8 @@ typedef enum {
 	SBUF_EV_CONNECT_OK,	/* got connection */
 	SBUF_EV_FLUSH,		/* data is sent, buffer empty */
 	SBUF_EV_PKT_CALLBACK,	/* next part of pkt data */
-	SBUF_EV_TLS_READY	/* TLS was established */
+	SBUF_EV_TLS_READY,	/* TLS was established */
+	SBUF_EV_SPOOL		/* dst is full, may pending data be spooled? */
 } SBufEvent;
 
 /*
@@ -85,8 +86,13 @@ struct SBuf {
 
 	SBuf *dst;		/* target SBuf for current packet */
 
+	struct SBufSpool *spool;	/* data spooled for this socket, lazily allocated */
+
 	IOBuf *io;		/* data buffer, lazily allocated */
 
+	size_t *mem_account;	/* counter that buffer memory is charged to */
+	size_t mem_charged;	/* bytes currently charged to mem_account */
+
 	const SBufIO *ops;	/* normal vs. TLS */
 	struct tls *tls;	/* TLS context */
 	const char *tls_host;	/* target hostname */
@@ -116,6 +122,7 @@ extern int server_connect_sslmode;
 bool sbuf_tls_setup(void);
 bool sbuf_tls_accept(SBuf *sbuf)  _MUSTCHECK;
 bool sbuf_tls_connect(SBuf *sbuf, const char *hostname)  _MUSTCHECK;
+bool sbuf_tls_session_resumed(SBuf *sbuf);
 
 bool sbuf_pause(SBuf *sbuf) _MUSTCHECK;
 void sbuf_continue(SBuf *sbuf);
@@ -125,6 +132,7 @@ bool sbuf_flush(SBuf *sbuf) _MUSTCHECK;
 
 /* proto_fn can use those functions to order behaviour */
 void sbuf_prepare_send(SBuf *sbuf, SBuf *dst, unsigned amount);
+void sbuf_extend_send(SBuf *sbuf, unsigned amount);
 void sbuf_prepare_skip(SBuf *sbuf, unsigned amount);
 void sbuf_prepare_skip_then_send_leftover(SBuf *sbuf, SBuf *dst, unsigned skip_amount, unsigned total_amount);
 void sbuf_prepare_fetch(SBuf *sbuf, unsigned amount);
@@ -133,6 +141,11 @@ bool sbuf_queue_full_packet(SBuf *sbuf, SBuf *dst, PktHdr *pkt) _MUSTCHECK;
 
 bool sbuf_answer(SBuf *sbuf, const void *buf, size_t len)  _MUSTCHECK;
 
+unsigned sbuf_spool_len(SBuf *sbuf);
+bool sbuf_spool_write(SBuf *sbuf, const void *data, unsigned len) _MUSTCHECK;
+void sbuf_set_mem_account(SBuf *sbuf, size_t *account);
+bool sbuf_drop_dst(SBuf *sbuf) _MUSTCHECK;
+
 bool sbuf_continue_with_callback(SBuf *sbuf, event_callback_fn cb)  _MUSTCHECK;
 bool sbuf_use_callback_once(SBuf *sbuf, short ev, event_callback_fn user_cb) _MUSTCHECK;
 
@@ -142,7 +155,7 @@ bool sbuf_use_callback_once(SBuf *sbuf, short ev, event_callback_fn user_cb) _MU
  */
 static inline bool sbuf_is_empty(SBuf *sbuf)
 {
-	return iobuf_empty(sbuf->io) && sbuf->pkt_remain == 0;
+	return iobuf_empty(sbuf->io) && sbuf->pkt_remain == 0 && sbuf->spool == NULL;
 }
 
 static inline bool sbuf_is_closed(SBuf *sbuf)
@@ -22,6 +22,23 @@
 
 #include <usual/crypto/sha256.h>
 
+/* state of a SCRAM exchange, lives only as long as the login */
+struct ScramState {
+	char *client_nonce;
+	char *client_first_message_bare;
+	char *client_final_message_without_proof;
+	char *server_nonce;
+	char *server_first_message;
+	uint8_t *SaltedPassword;
+	char cbind_flag;
+	bool adhoc;	/* SCRAM data made up from plain-text password */
+	int iterations;
+	char *salt;	/* base64-encoded */
+	uint8_t ClientKey[32];	/* SHA256_DIGEST_LENGTH */
+	uint8_t StoredKey[32];
+	uint8_t ServerKey[32];
+};
+
 void free_scram_state(ScramState *scram_state);
 
 typedef enum PasswordType {
@@ -76,3 +93,11 @@ bool verify_client_proof(ScramState *state, const char *ClientProof);
 bool scram_verify_plain_password(PgSocket *client,
 				 const char *username, const char *password,
 				 const char *secret);
+
+bool scram_compute_adhoc_keys(const char *plain_password,
+			      const uint8_t *saltbuf, int saltlen, int iterations,
+			      uint8_t *StoredKey, uint8_t *ServerKey);
+
+bool scram_set_adhoc_secret(ScramState *scram_state,
+			    const uint8_t *saltbuf, int saltlen, int iterations,
+			    const uint8_t *StoredKey, const uint8_t *ServerKey);
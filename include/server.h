@@ -17,6 +17,7 @@
  */
 
 bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *pkt)  _MUSTCHECK;
+bool salvage_server(PgSocket *client) _MUSTCHECK;
 void kill_pool_logins(PgPool *pool, const char *sqlstate, const char *msg);
 int connection_pool_mode(PgSocket *server) _MUSTCHECK;
 int probably_wrong_pool_pool_mode(PgPool *pool) _MUSTCHECK;
@@ -25,5 +26,6 @@ int pool_min_pool_size(PgPool *pool) _MUSTCHECK;
 usec_t pool_server_lifetime(PgPool *pool) _MUSTCHECK;
 int database_min_pool_size(PgDatabase *db) _MUSTCHECK;
 int pool_res_pool_size(PgPool *pool) _MUSTCHECK;
+int pool_result_spool_size(PgPool *pool) _MUSTCHECK;
 int database_max_connections(PgDatabase *db) _MUSTCHECK;
 int user_max_connections(PgGlobalUser *user) _MUSTCHECK;
@@ -16,9 +16,31 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* what an event loop callback works on, for SHOW LOOP */
+enum LoopCallback {
+	LOOP_CB_CLIENT,
+	LOOP_CB_SERVER,
+	LOOP_CB_ADMIN,
+	LOOP_CB_ACCEPT,
+	LOOP_CB_JANITOR,
+	LOOP_CB_STATS,
+	LOOP_CB_SIGNAL,
+	LOOP_CB_DNS,
+	LOOP_CB_OTHER,
+	LOOP_CB_MAINT,		/* per-loop maintenance after the callbacks */
+	LOOP_CB_KINDS
+};
+
 void stats_setup(void);
 
 bool admin_database_stats(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
 bool admin_database_stats_totals(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
 bool admin_database_stats_averages(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
 bool show_stat_totals(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
+bool admin_pool_latency(PgSocket *client, struct StatList *pool_list)  _MUSTCHECK;
+
+void latency_record(PgPool *pool, LatencyKind kind, usec_t value);
+
+void loop_callback(enum LoopCallback type);
+void loop_iteration_done(void);
+bool admin_loop_stats(PgSocket *client)  _MUSTCHECK;
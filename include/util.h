@@ -72,3 +72,8 @@ bool cf_set_authdb(struct CfValue *cv, const char *value);
 bool check_reserved_database(const char *value);
 
 bool strings_equal(const char *str_left, const char *str_right) _MUSTCHECK;
+
+#ifdef ENABLE_ALLOC_COUNTERS
+/* heap allocations made so far, see configure --enable-alloc-counters */
+uint64_t get_heap_alloc_count(void);
+#endif
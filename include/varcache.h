@@ -17,6 +17,7 @@ struct VarCache {
 
 void init_var_lookup(const char *cf_track_extra_parameters);
 int get_num_var_cached(void);
+bool varcache_is_tracked(const char *key);
 bool varcache_set(VarCache *cache, const char *key, const char *value) /* _MUSTCHECK */;
 bool varcache_apply(PgSocket *server, PgSocket *client, bool *changes_p) _MUSTCHECK;
 void varcache_apply_startup(PktBuf *pkt, PgSocket *client);
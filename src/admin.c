@@ -41,6 +41,7 @@
 /* group numbers */
 #define CMD_NAME 1
 #define CMD_ARG 4
+#define CMD_ARG2 7
 #define SET_KEY 1
 #define SET_VAL 4
 
@@ -50,9 +51,9 @@ struct cmd_lookup {
 	cmd_func_t func;
 };
 
-/* CMD [arg]; */
+/* CMD [arg [arg2]]; */
 static const char cmd_normal_rx[] =
-	"^" WS0 WORD "(" WS1 WORD ")?" WS0 "(;" WS0 ")?$";
+	"^" WS0 WORD "(" WS1 WORD ")?" "(" WS1 WORD ")?" WS0 "(;" WS0 ")?$";
 
 /* SET with simple value */
 static const char cmd_set_word_rx[] =
@@ -71,6 +72,7 @@ static PgPool *admin_pool;
 
 /* only valid during processing */
 static const char *current_query;
+static const char *current_arg2;
 
 void admin_cleanup(void)
 {
@@ -247,6 +249,8 @@ static bool admin_set(PgSocket *admin, const char *key, const char *val)
 				if (!sbuf_tls_setup())
 					pktbuf_write_Notice(buf, "TLS settings could not be applied, still using old configuration");
 			}
+			/* deadlines of existing connections may have moved */
+			rearm_socket_timers();
 			snprintf(tmp, sizeof(tmp), "SET %s=%s", key, val);
 			return admin_flush(admin, buf, tmp);
 		} else {
@@ -358,7 +362,7 @@ static bool show_one_fd(PgSocket *admin, PgSocket *sk)
 	if (cf_auth_type == AUTH_PAM && !find_global_user(sk->login_user_credentials->name))
 		password = sk->login_user_credentials->passwd;
 
-	if (sk->pool && sk->pool->user_credentials && sk->pool->user_credentials->has_scram_keys)
+	if (sk->pool && sk->pool->user_credentials && sk->pool->user_credentials->scram_keys)
 		send_scram_keys = true;
 
 	return send_one_fd(admin, sbuf_socket(&sk->sbuf),
@@ -374,10 +378,10 @@ static bool show_one_fd(PgSocket *admin, PgSocket *sk)
 			   datestyle ? datestyle->str : NULL,
 			   timezone ? timezone->str : NULL,
 			   password,
-			   send_scram_keys ? sk->pool->user_credentials->scram_ClientKey : NULL,
-			   send_scram_keys ? (int) sizeof(sk->pool->user_credentials->scram_ClientKey) : -1,
-			   send_scram_keys ? sk->pool->user_credentials->scram_ServerKey : NULL,
-			   send_scram_keys ? (int) sizeof(sk->pool->user_credentials->scram_ServerKey) : -1);
+			   send_scram_keys ? sk->pool->user_credentials->scram_keys->ClientKey : NULL,
+			   send_scram_keys ? (int) sizeof(sk->pool->user_credentials->scram_keys->ClientKey) : -1,
+			   send_scram_keys ? sk->pool->user_credentials->scram_keys->ServerKey : NULL,
+			   send_scram_keys ? (int) sizeof(sk->pool->user_credentials->scram_keys->ServerKey) : -1);
 }
 
 static bool show_pooler_cb(void *arg, int fd, const PgAddr *a)
@@ -872,6 +876,21 @@ static bool admin_show_active_sockets(PgSocket *admin, const char *arg)
 	return true;
 }
 
+/* clients holding on to their server because of session state */
+static int count_pinned_clients(PgPool *pool)
+{
+	struct List *item;
+	PgSocket *client;
+	int count = 0;
+
+	statlist_for_each(item, &pool->active_client_list) {
+		client = container_of(item, PgSocket, head);
+		if (client->pinned)
+			count++;
+	}
+	return count;
+}
+
 /* Command: SHOW POOLS */
 static bool admin_show_pools(PgSocket *admin, const char *arg)
 {
@@ -891,7 +910,7 @@ static bool admin_show_pools(PgSocket *admin, const char *arg)
 		admin_error(admin, "no mem");
 		return true;
 	}
-	pktbuf_write_RowDescription(buf, "ssiiiiiiiiiiiiis",
+	pktbuf_write_RowDescription(buf, "ssiiiiiiiiiiiiisiqi",
 				    "database", "user",
 				    "cl_active", "cl_waiting",
 				    "cl_active_cancel_req",
@@ -902,13 +921,14 @@ static bool admin_show_pools(PgSocket *admin, const char *arg)
 				    "sv_idle",
 				    "sv_used", "sv_tested",
 				    "sv_login", "maxwait",
-				    "maxwait_us", "pool_mode");
+				    "maxwait_us", "pool_mode", "cl_pinned",
+				    "mem_used", "cl_mem_throttled");
 	statlist_for_each(item, &pool_list) {
 		pool = container_of(item, PgPool, head);
 		waiter = first_socket(&pool->waiting_client_list);
 		max_wait = (waiter && waiter->query_start) ? now - waiter->query_start : 0;
 		pool_mode = probably_wrong_pool_pool_mode(pool);
-		pktbuf_write_DataRow(buf, "ssiiiiiiiiiiiiis",
+		pktbuf_write_DataRow(buf, "ssiiiiiiiiiiiiisiqi",
 				     pool->db->name, pool->user_credentials->name,
 				     statlist_count(&pool->active_client_list),
 				     statlist_count(&pool->waiting_client_list),
@@ -924,7 +944,10 @@ static bool admin_show_pools(PgSocket *admin, const char *arg)
 					/* how long is the oldest client waited */
 				     (int)(max_wait / USEC),
 				     (int)(max_wait % USEC),
-				     cf_get_lookup(&cv));
+				     cf_get_lookup(&cv),
+				     count_pinned_clients(pool),
+				     (uint64_t)pool->mem_used,
+				     pool->mem_throttled_count);
 	}
 	admin_flush(admin, buf, "SHOW");
 	return true;
@@ -1192,7 +1215,7 @@ static bool admin_cmd_resume(PgSocket *admin, const char *arg)
 			return admin_error(admin, "no such database: %s", arg);
 		if (!db->db_paused)
 			return admin_error(admin, "database %s is not paused", arg);
-		db->db_paused = false;
+		set_db_paused(db, false);
 	}
 	return admin_ready(admin, "RESUME");
 }
@@ -1244,7 +1267,7 @@ static bool admin_cmd_pause(PgSocket *admin, const char *arg)
 			return admin_error(admin, "no such database: %s", arg);
 		if (db == admin->pool->db)
 			return admin_error(admin, "cannot pause admin db: %s", arg);
-		db->db_paused = true;
+		set_db_paused(db, true);
 		if (count_db_active(db) > 0)
 			admin->wait_for_response = true;
 		else
@@ -1353,7 +1376,7 @@ static bool admin_cmd_kill(PgSocket *admin, const char *arg)
 	if (db == admin->pool->db)
 		return admin_error(admin, "cannot kill admin db: %s", arg);
 
-	db->db_paused = true;
+	set_db_paused(db, true);
 	statlist_for_each_safe(item, &pool_list, tmp) {
 		pool = container_of(item, PgPool, head);
 		if (pool->db == db)
@@ -1380,7 +1403,7 @@ static bool admin_cmd_wait_close(PgSocket *admin, const char *arg)
 
 			pool = container_of(item, PgPool, head);
 			db = pool->db;
-			db->db_wait_close = true;
+			set_db_wait_close(db);
 			active += count_db_active(db);
 		}
 		if (active > 0)
@@ -1396,7 +1419,7 @@ static bool admin_cmd_wait_close(PgSocket *admin, const char *arg)
 			return admin_error(admin, "no such database: %s", arg);
 		if (db == admin->pool->db)
 			return admin_error(admin, "cannot wait in admin db: %s", arg);
-		db->db_wait_close = true;
+		set_db_wait_close(db);
 		if (count_db_active(db) > 0)
 			admin->wait_for_response = true;
 		else
@@ -1456,9 +1479,10 @@ static bool admin_show_help(PgSocket *admin, const char *arg)
 		     "D\n\tSHOW HELP|CONFIG|DATABASES"
 		     "|POOLS|CLIENTS|SERVERS|USERS|VERSION\n"
 		     "\tSHOW PEERS|PEER_POOLS\n"
-		     "\tSHOW FDS|SOCKETS|ACTIVE_SOCKETS|LISTS|MEM|STATE\n"
+		     "\tSHOW FDS|SOCKETS|ACTIVE_SOCKETS|LISTS|MEM|STATE|LOOP\n"
+		     "\tSHOW EVENTS [<db>]\n"
 		     "\tSHOW DNS_HOSTS|DNS_ZONES\n"
-		     "\tSHOW STATS|STATS_TOTALS|STATS_AVERAGES|TOTALS\n"
+		     "\tSHOW STATS|STATS_TOTALS|STATS_AVERAGES|TOTALS|LATENCY\n"
 		     "\tSET key = arg\n"
 		     "\tRELOAD\n"
 		     "\tPAUSE [<db>]\n"
@@ -1514,6 +1538,22 @@ static bool admin_show_totals(PgSocket *admin, const char *arg)
 	return show_stat_totals(admin, &pool_list);
 }
 
+static bool admin_show_latency(PgSocket *admin, const char *arg)
+{
+	return admin_pool_latency(admin, &pool_list);
+}
+
+static bool admin_show_loop(PgSocket *admin, const char *arg)
+{
+	return admin_loop_stats(admin);
+}
+
+/* Command: SHOW EVENTS [db] */
+static bool admin_show_events(PgSocket *admin, const char *arg)
+{
+	return admin_pool_events(admin, current_arg2);
+}
+
 
 static struct cmd_lookup show_map [] = {
 	{"clients", admin_show_clients},
@@ -1534,6 +1574,9 @@ static struct cmd_lookup show_map [] = {
 	{"users", admin_show_users},
 	{"version", admin_show_version},
 	{"totals", admin_show_totals},
+	{"latency", admin_show_latency},
+	{"loop", admin_show_loop},
+	{"events", admin_show_events},
 	{"mem", admin_show_mem},
 	{"dns_hosts", admin_show_dns_hosts},
 	{"dns_zones", admin_show_dns_zones},
@@ -1570,6 +1613,7 @@ static bool admin_parse_query(PgSocket *admin, const char *q)
 	regmatch_t grp[MAX_GROUPS];
 	char cmd[16];
 	char arg[64];
+	char arg2[64];
 	char val[256];
 	bool res;
 	bool ok;
@@ -1583,7 +1627,16 @@ static bool admin_parse_query(PgSocket *admin, const char *q)
 		ok = copy_arg(q, grp, CMD_ARG, arg, sizeof(arg), '"');
 		if (!ok)
 			goto failed;
-		res = exec_cmd(cmd_list, admin, cmd, arg);
+		ok = copy_arg(q, grp, CMD_ARG2, arg2, sizeof(arg2), '"');
+		if (!ok)
+			goto failed;
+		/* only SHOW EVENTS takes a second argument */
+		if (arg2[0] && (strcasecmp(cmd, "show") != 0 || strcasecmp(arg, "events") != 0)) {
+			res = syntax_error(admin);
+		} else {
+			current_arg2 = arg2;
+			res = exec_cmd(cmd_list, admin, cmd, arg);
+		}
 	} else if (regexec(&rc_set_str, q, MAX_GROUPS, grp, 0) == 0) {
 		ok = copy_arg(q, grp, SET_KEY, arg, sizeof(arg), '"');
 		if (!ok || !arg[0])
@@ -1605,6 +1658,7 @@ static bool admin_parse_query(PgSocket *admin, const char *q)
 	}
 done:
 	current_query = NULL;
+	current_arg2 = NULL;
 	if (!res)
 		disconnect_client(admin, true, "failure");
 	return res;
@@ -0,0 +1,446 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Auth workers: run CPU-heavy authentication steps off the main thread.
+ *
+ * This follows the PAM worker: the main thread puts a copy of everything the
+ * job needs into a ring buffer, pauses the client and goes on serving other
+ * sockets.  Worker threads pick jobs from the ring and only ever touch the
+ * job itself.  Results are picked up in order by auth_worker_poll(), which
+ * is woken through a pipe, and the client is then resumed from where it was
+ * paused.
+ *
+ * Jobs that are not worth a thread hop are not queued: mock users, empty
+ * passwords, and anything once the queue is full are checked inline as
+ * before.
+ */
+
+#include "bouncer.h"
+#include "scram.h"
+#include "common/scram-common.h"
+
+#include <usual/socket.h>
+
+#if defined(HAVE_PTHREADS) && !defined(WIN32)
+
+#include <pthread.h>
+
+/* The job is waiting in the queue or being worked on */
+#define AUTH_JOB_IN_PROGRESS    1
+/* The job completed successfully */
+#define AUTH_JOB_SUCCESS        2
+/* The job failed, e.g. the password did not match */
+#define AUTH_JOB_FAILED         3
+
+enum AuthJobType {
+	/* check a PasswordMessage against the stored secret */
+	AUTH_JOB_PASSWD,
+	/* build SCRAM keys for a user with a plain-text password */
+	AUTH_JOB_SCRAM_SECRET,
+};
+
+struct AuthJob {
+	/* NULL if the client went away while the job was queued */
+	PgSocket *client;
+
+	enum AuthJobType type;
+
+	/* one of the AUTH_JOB_* constants, protected by auth_queue_mutex */
+	int status;
+
+	/* copies of the client state the job needs */
+	int auth_type;
+	uint8_t login_salt[4];
+	char username[MAX_USERNAME];
+	char stored_passwd[MAX_PASSWORD];
+
+	/* AUTH_JOB_PASSWD: password sent by the client */
+	char passwd[MAX_PASSWORD];
+
+	/* AUTH_JOB_SCRAM_SECRET: salt is input, keys are output */
+	uint8_t scram_salt[SCRAM_DEFAULT_SALT_LEN];
+	uint8_t StoredKey[SCRAM_KEY_LEN];
+	uint8_t ServerKey[SCRAM_KEY_LEN];
+};
+
+/*
+ * Ring buffer of jobs, see pam.c for the general layout.
+ *
+ * first_taken_slot and first_free_slot are only changed by the main thread.
+ * next_job_slot is the first job not yet picked up by a worker and is
+ * shared between the workers.
+ */
+static int first_taken_slot;
+static int first_free_slot;
+static int next_job_slot;
+static struct AuthJob auth_queue[AUTH_WORKER_QUEUE_SIZE];
+
+static pthread_mutex_t auth_queue_mutex;
+static pthread_cond_t auth_job_available;
+
+static bool auth_workers_running;
+
+/* jobs whose result came back from a worker, only used by the main thread */
+static uint64_t auth_worker_jobs_done;
+
+/* workers write a byte here to wake up the main loop */
+static int wakeup_pipe[2];
+static struct event wakeup_ev;
+
+static void *auth_worker_main(void *arg);
+static void auth_worker_wakeup_cb(evutil_socket_t fd, short flags, void *arg);
+
+void auth_worker_setup(void)
+{
+	pthread_t thread;
+	int i, rc;
+
+	if (cf_auth_workers <= 0)
+		return;
+
+	if (pipe(wakeup_pipe) < 0)
+		die("auth_worker_setup: pipe failed: %s", strerror(errno));
+	if (!socket_set_nonblocking(wakeup_pipe[0], true)
+	    || !socket_set_nonblocking(wakeup_pipe[1], true))
+		die("auth_worker_setup: cannot make pipe non-blocking: %s", strerror(errno));
+
+	event_assign(&wakeup_ev, pgb_event_base, wakeup_pipe[0], EV_READ | EV_PERSIST,
+		     auth_worker_wakeup_cb, NULL);
+	if (event_add(&wakeup_ev, NULL) < 0)
+		die("auth_worker_setup: event_add failed: %s", strerror(errno));
+
+	rc = pthread_mutex_init(&auth_queue_mutex, NULL);
+	if (rc != 0)
+		die("failed to initialize a mutex: %s", strerror(rc));
+
+	rc = pthread_cond_init(&auth_job_available, NULL);
+	if (rc != 0)
+		die("failed to initialize a condition variable: %s", strerror(rc));
+
+	for (i = 0; i < cf_auth_workers; i++) {
+		rc = pthread_create(&thread, NULL, &auth_worker_main, NULL);
+		if (rc != 0)
+			die("failed to create an auth worker thread: %s", strerror(rc));
+		pthread_detach(thread);
+	}
+
+	auth_workers_running = true;
+	log_debug("started %d auth worker threads", cf_auth_workers);
+}
+
+/*
+ * Reserve a queue slot for the client and fill in the common fields.
+ * Returns NULL if the job should be done inline instead.
+ */
+static struct AuthJob *reserve_job(PgSocket *client, enum AuthJobType type)
+{
+	PgCredentials *user = client->login_user_credentials;
+	int next_free_slot = (first_free_slot + 1) % AUTH_WORKER_QUEUE_SIZE;
+	struct AuthJob *job;
+
+	if (!auth_workers_running)
+		return NULL;
+
+	/* cheap failures are not worth a thread hop */
+	if (!user || user->mock_auth || !*user->passwd)
+		return NULL;
+
+	/* the packet lives outside the sbuf and cannot be re-parsed later */
+	if (client->packet_cb_state.flag == CB_HANDLE_COMPLETE_PACKET)
+		return NULL;
+
+	if (next_free_slot == first_taken_slot) {
+		slog_debug(client, "auth worker queue is full, authenticating inline");
+		return NULL;
+	}
+
+	/* no worker looks at slots past first_free_slot, no need to lock */
+	job = &auth_queue[first_free_slot];
+	job->client = client;
+	job->type = type;
+	job->status = AUTH_JOB_IN_PROGRESS;
+	job->auth_type = client->client_auth_type;
+	memcpy(job->login_salt, client->tmp_login_salt, sizeof(job->login_salt));
+	safe_strcpy(job->username, user->name, sizeof(job->username));
+	safe_strcpy(job->stored_passwd, user->passwd, sizeof(job->stored_passwd));
+	return job;
+}
+
+/* make the reserved job visible to the workers */
+static bool submit_job(PgSocket *client)
+{
+	/*
+	 * The current packet stays in the buffer, it is parsed again when the
+	 * client is resumed.
+	 */
+	if (!sbuf_pause(&client->sbuf)) {
+		disconnect_client(client, true, "pause failed");
+		return true;
+	}
+
+	pthread_mutex_lock(&auth_queue_mutex);
+	first_free_slot = (first_free_slot + 1) % AUTH_WORKER_QUEUE_SIZE;
+	pthread_mutex_unlock(&auth_queue_mutex);
+	pthread_cond_signal(&auth_job_available);
+	return true;
+}
+
+/*
+ * Check a PasswordMessage in a worker.  Returns true if the client has been
+ * taken care of: it is either paused until the result is in, or
+ * disconnected.  Returns false if the caller should check the password
+ * itself.
+ */
+bool auth_worker_check_passwd(PgSocket *client, const char *passwd)
+{
+	struct AuthJob *job;
+
+	job = reserve_job(client, AUTH_JOB_PASSWD);
+	if (!job)
+		return false;
+
+	safe_strcpy(job->passwd, passwd, sizeof(job->passwd));
+	slog_debug(client, "auth worker: queued password check");
+	return submit_job(client);
+}
+
+/*
+ * Build the ad-hoc SCRAM secret for a user with a plain-text password in a
+ * worker.  The return value has the same meaning as for
+ * auth_worker_check_passwd().  Once the keys are installed in the SCRAM
+ * state, build_server_first_message() uses them instead of computing them.
+ */
+bool auth_worker_build_scram_secret(PgSocket *client)
+{
+	PgCredentials *user = client->login_user_credentials;
+	struct AuthJob *job;
+
+	if (client->scram_state && client->scram_state->adhoc)
+		return false;
+	if (!user || get_password_type(user->passwd) != PASSWORD_TYPE_PLAINTEXT)
+		return false;
+
+	job = reserve_job(client, AUTH_JOB_SCRAM_SECRET);
+	if (!job)
+		return false;
+
+	get_random_bytes(job->scram_salt, sizeof(job->scram_salt));
+	slog_debug(client, "auth worker: queued SCRAM secret");
+	return submit_job(client);
+}
+
+/*
+ * The client is about to be freed, make sure a pending result is not
+ * delivered to whatever reuses the struct.
+ */
+void auth_worker_forget(PgSocket *client)
+{
+	int slot;
+
+	for (slot = first_taken_slot; slot != first_free_slot; slot = (slot + 1) % AUTH_WORKER_QUEUE_SIZE) {
+		if (auth_queue[slot].client == client)
+			auth_queue[slot].client = NULL;
+	}
+}
+
+/* do not leave passwords and keys behind in the slot */
+static void clear_job(struct AuthJob *job)
+{
+	explicit_bzero(job->stored_passwd, sizeof(job->stored_passwd));
+	explicit_bzero(job->passwd, sizeof(job->passwd));
+	explicit_bzero(job->StoredKey, sizeof(job->StoredKey));
+	explicit_bzero(job->ServerKey, sizeof(job->ServerKey));
+}
+
+/* hand the result of a finished job back to the client */
+static void finish_job(struct AuthJob *job, bool success)
+{
+	PgSocket *client = job->client;
+	PgCredentials *user;
+
+	if (!client || client->state != CL_LOGIN)
+		return;
+
+	/*
+	 * A RELOAD might have changed the secret while the job was running.
+	 * Let the client re-parse its packet, which does the work again with
+	 * the current secret.
+	 */
+	user = client->login_user_credentials;
+	if (strcmp(user->passwd, job->stored_passwd) != 0) {
+		slog_debug(client, "auth worker: secret changed, retrying");
+		sbuf_continue(&client->sbuf);
+		return;
+	}
+
+	switch (job->type) {
+	case AUTH_JOB_PASSWD:
+		if (!success) {
+			forget_cached_auth_query(client);
+			disconnect_client(client, true, "password authentication failed");
+			return;
+		}
+		/* same as PAM: the re-parsed packet finishes the login */
+		client->wait_for_auth = true;
+		break;
+	case AUTH_JOB_SCRAM_SECRET:
+		if (!success
+		    || !alloc_scram_state(client)
+		    || !scram_set_adhoc_secret(client->scram_state,
+					       job->scram_salt, sizeof(job->scram_salt),
+					       SCRAM_DEFAULT_ITERATIONS,
+					       job->StoredKey, job->ServerKey)) {
+			disconnect_client(client, true, "SASL authentication failed");
+			return;
+		}
+		break;
+	}
+	sbuf_continue(&client->sbuf);
+}
+
+/*
+ * Checks for finished jobs, returns the number of jobs handled.
+ * The function is called only from the main thread.
+ */
+int auth_worker_poll(void)
+{
+	struct AuthJob *job;
+	int status;
+	int count = 0;
+
+	while (first_taken_slot != first_free_slot) {
+		job = &auth_queue[first_taken_slot];
+
+		pthread_mutex_lock(&auth_queue_mutex);
+		status = job->status;
+		pthread_mutex_unlock(&auth_queue_mutex);
+
+		/* results are delivered in queue order */
+		if (status == AUTH_JOB_IN_PROGRESS)
+			break;
+
+		/* the slot stays taken until the client has been resumed */
+		finish_job(job, status == AUTH_JOB_SUCCESS);
+		clear_job(job);
+		first_taken_slot = (first_taken_slot + 1) % AUTH_WORKER_QUEUE_SIZE;
+		auth_worker_jobs_done++;
+		count++;
+	}
+
+	return count;
+}
+
+uint64_t auth_worker_job_count(void)
+{
+	return auth_worker_jobs_done;
+}
+
+static void auth_worker_wakeup_cb(evutil_socket_t fd, short flags, void *arg)
+{
+	char buf[64];
+
+	loop_callback(LOOP_CB_OTHER);
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		/* drain */
+	}
+	auth_worker_poll();
+}
+
+static bool run_job(struct AuthJob *job)
+{
+	switch (job->type) {
+	case AUTH_JOB_PASSWD:
+		return check_passwd_secret(NULL, job->auth_type, job->username,
+					   job->stored_passwd, job->login_salt,
+					   job->passwd);
+	case AUTH_JOB_SCRAM_SECRET:
+		return scram_compute_adhoc_keys(job->stored_passwd,
+						job->scram_salt, sizeof(job->scram_salt),
+						SCRAM_DEFAULT_ITERATIONS,
+						job->StoredKey, job->ServerKey);
+	}
+	return false;
+}
+
+/*
+ * The worker thread function.  Must not touch anything outside of the job.
+ */
+static void *auth_worker_main(void *arg)
+{
+	struct AuthJob *job;
+	bool ok;
+	ssize_t res;
+
+	while (true) {
+		pthread_mutex_lock(&auth_queue_mutex);
+		while (next_job_slot == first_free_slot)
+			pthread_cond_wait(&auth_job_available, &auth_queue_mutex);
+		job = &auth_queue[next_job_slot];
+		next_job_slot = (next_job_slot + 1) % AUTH_WORKER_QUEUE_SIZE;
+		pthread_mutex_unlock(&auth_queue_mutex);
+
+		ok = run_job(job);
+
+		pthread_mutex_lock(&auth_queue_mutex);
+		job->status = ok ? AUTH_JOB_SUCCESS : AUTH_JOB_FAILED;
+		pthread_mutex_unlock(&auth_queue_mutex);
+
+		/* a full pipe means a wakeup is already pending */
+		res = write(wakeup_pipe[1], "", 1);
+		(void) res;
+	}
+
+	return NULL;
+}
+
+#else /* !HAVE_PTHREADS */
+
+/* Without threads everything is done inline */
+
+void auth_worker_setup(void)
+{
+	if (cf_auth_workers > 0)
+		log_warning("auth_workers is set, but threads are not supported, ignoring");
+}
+
+bool auth_worker_check_passwd(PgSocket *client, const char *passwd)
+{
+	return false;
+}
+
+bool auth_worker_build_scram_secret(PgSocket *client)
+{
+	return false;
+}
+
+void auth_worker_forget(PgSocket *client)
+{
+}
+
+int auth_worker_poll(void)
+{
+	return 0;
+}
+
+uint64_t auth_worker_job_count(void)
+{
+	return 0;
+}
+
+#endif
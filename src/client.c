@@ -81,36 +81,33 @@ PgDatabase *prepare_auth_database(PgSocket *client)
 	return auth_db;
 }
 
-static bool check_client_passwd(PgSocket *client, const char *passwd)
+/*
+ * Check a password sent by the client against the stored secret.  The client
+ * socket is only used for log messages and may be NULL, which is how the
+ * auth workers call this.
+ */
+bool check_passwd_secret(PgSocket *client, int auth_type, const char *username,
+			 const char *stored_passwd, const uint8_t *login_salt,
+			 const char *passwd)
 {
-	PgCredentials *user = client->login_user_credentials;
-	int auth_type = client->client_auth_type;
-
-	if (user->mock_auth)
-		return false;
-
-	/* disallow empty passwords */
-	if (!*user->passwd)
-		return false;
-
 	switch (auth_type) {
 	case AUTH_PLAIN:
-		switch (get_password_type(user->passwd)) {
+		switch (get_password_type(stored_passwd)) {
 		case PASSWORD_TYPE_PLAINTEXT:
-			return strcmp(user->passwd, passwd) == 0;
+			return strcmp(stored_passwd, passwd) == 0;
 		case PASSWORD_TYPE_MD5: {
 			char md5[MD5_PASSWD_LEN + 1];
-			if (!pg_md5_encrypt(passwd, user->name, strlen(user->name), md5))
+			if (!pg_md5_encrypt(passwd, username, strlen(username), md5))
 				return false;
-			return strcmp(user->passwd, md5) == 0;
+			return strcmp(stored_passwd, md5) == 0;
 		}
 		case PASSWORD_TYPE_SCRAM_SHA_256:
-			return scram_verify_plain_password(client, user->name, passwd, user->passwd);
+			return scram_verify_plain_password(client, username, passwd, stored_passwd);
 		default:
 			return false;
 		}
 	case AUTH_MD5: {
-		char *stored_passwd;
+		const char *md5_passwd;
 		char md5[MD5_PASSWD_LEN + 1];
 
 		if (strlen(passwd) != MD5_PASSWD_LEN)
@@ -123,14 +120,14 @@ static bool check_client_passwd(PgSocket *client, const char *passwd)
 		 * plain text.  If the latter, we compute the inner
 		 * md5() call first.
 		 */
-		if (get_password_type(user->passwd) == PASSWORD_TYPE_PLAINTEXT) {
-			if (!pg_md5_encrypt(user->passwd, user->name, strlen(user->name), md5))
+		if (get_password_type(stored_passwd) == PASSWORD_TYPE_PLAINTEXT) {
+			if (!pg_md5_encrypt(stored_passwd, username, strlen(username), md5))
 				return false;
-			stored_passwd = md5;
+			md5_passwd = md5;
 		} else {
-			stored_passwd = user->passwd;
+			md5_passwd = stored_passwd;
 		}
-		if (!pg_md5_encrypt(stored_passwd + 3, (char *)client->tmp_login_salt, 4, md5))
+		if (!pg_md5_encrypt(md5_passwd + 3, (const char *)login_salt, 4, md5))
 			return false;
 		return strcmp(md5, passwd) == 0;
 	}
@@ -138,6 +135,21 @@ static bool check_client_passwd(PgSocket *client, const char *passwd)
 	return false;
 }
 
+static bool check_client_passwd(PgSocket *client, const char *passwd)
+{
+	PgCredentials *user = client->login_user_credentials;
+
+	if (user->mock_auth)
+		return false;
+
+	/* disallow empty passwords */
+	if (!*user->passwd)
+		return false;
+
+	return check_passwd_secret(client, client->client_auth_type, user->name,
+				   user->passwd, client->tmp_login_salt, passwd);
+}
+
 static bool send_client_authreq(PgSocket *client)
 {
 	int res;
@@ -164,6 +176,99 @@ static bool send_client_authreq(PgSocket *client)
 	return res;
 }
 
+/*
+ * auth_query result cache.
+ *
+ * Positive results live in the database's user_tree as dynamic
+ * credentials already, they are reused while younger than
+ * auth_query_cache_ttl.  Users the query did not find are remembered in a
+ * small direct-mapped table of (database, username) hashes, so repeated
+ * logins as an unknown user do not each run a query.
+ */
+#define AUTH_QUERY_NEGATIVE_CACHE_SIZE 4096
+
+struct AuthQueryMiss {
+	uint64_t key;
+	usec_t time;
+};
+
+static struct AuthQueryMiss auth_query_misses[AUTH_QUERY_NEGATIVE_CACHE_SIZE];
+
+/* FNV-1a over database and user name, never 0 */
+static uint64_t auth_query_cache_key(PgDatabase *db, const char *username)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)db->name; *p; p++)
+		h = (h ^ *p) * UINT64_C(1099511628211);
+	h = (h ^ 0) * UINT64_C(1099511628211);
+	for (p = (const unsigned char *)username; *p; p++)
+		h = (h ^ *p) * UINT64_C(1099511628211);
+	return h ? h : 1;
+}
+
+static bool auth_query_cache_fresh(usec_t fetched)
+{
+	return fetched && get_cached_time() - fetched < cf_auth_query_cache_ttl;
+}
+
+/* Use a recent auth_query result for this user, if there is one. */
+static bool use_cached_auth_query(PgSocket *client, const char *username)
+{
+	struct AANode *node;
+	PgCredentials *credentials;
+
+	if (cf_auth_query_cache_ttl <= 0)
+		return false;
+
+	node = aatree_search(&client->db->user_tree, (uintptr_t)username);
+	if (!node)
+		return false;
+	credentials = container_of(node, PgCredentials, tree_node);
+	if (!auth_query_cache_fresh(credentials->auth_query_time))
+		return false;
+
+	slog_debug(client, "using cached auth_query result for user %s", username);
+	client->login_user_credentials = credentials;
+	return true;
+}
+
+static bool auth_query_known_missing(PgSocket *client, const char *username)
+{
+	uint64_t key;
+	struct AuthQueryMiss *miss;
+
+	if (cf_auth_query_cache_ttl <= 0)
+		return false;
+
+	key = auth_query_cache_key(client->db, username);
+	miss = &auth_query_misses[key % AUTH_QUERY_NEGATIVE_CACHE_SIZE];
+	return miss->key == key && auth_query_cache_fresh(miss->time);
+}
+
+static void remember_auth_query_miss(uint64_t key)
+{
+	struct AuthQueryMiss *miss;
+
+	if (cf_auth_query_cache_ttl <= 0 || !key)
+		return;
+
+	miss = &auth_query_misses[key % AUTH_QUERY_NEGATIVE_CACHE_SIZE];
+	miss->key = key;
+	miss->time = get_cached_time();
+}
+
+/*
+ * A failed login may be caused by a password changed since the
+ * auth_query result was cached, so the next login fetches it again.
+ */
+void forget_cached_auth_query(PgSocket *client)
+{
+	if (client->login_user_credentials)
+		client->login_user_credentials->auth_query_time = 0;
+}
+
 static void start_auth_query(PgSocket *client, const char *username)
 {
 	int res;
@@ -175,6 +280,9 @@ static void start_auth_query(PgSocket *client, const char *username)
 	if (!auth_db)
 		return;
 	client->pool = get_pool(auth_db, client->db->auth_user_credentials);
+	if (client->pool)
+		set_socket_mem_pool(client, client->pool);
+	client->auth_query_key = auth_query_cache_key(client->db, username);
 	if (!find_server(client)) {
 		client->wait_for_user_conn = true;
 		return;
@@ -330,6 +438,15 @@ static bool finish_set_pool(PgSocket *client, bool takeover)
 			disconnect_client(client, true, "no memory for pool");
 			return false;
 		}
+		set_socket_mem_pool(client, client->pool);
+
+		/* the handshake happened before the pool was known */
+		if (client->sbuf.tls) {
+			if (sbuf_tls_session_resumed(&client->sbuf))
+				client->pool->stats.client_tls_session_hits++;
+			else
+				client->pool->stats.client_tls_session_misses++;
+		}
 	}
 
 	if (cf_log_connections) {
@@ -493,6 +610,14 @@ bool set_pool(PgSocket *client, const char *dbname, const char *username, const
 						client->login_user_credentials = add_dynamic_credentials(client->db, username, password);
 						return finish_set_pool(client, takeover);
 					}
+					if (use_cached_auth_query(client, username))
+						return finish_set_pool(client, takeover);
+					if (auth_query_known_missing(client, username)) {
+						if (cf_log_connections)
+							slog_info(client, "login failed: db=%s", client->db->name);
+						disconnect_client(client, true, "no such user");
+						return false;
+					}
 					start_auth_query(client, username);
 					return false;
 				}
@@ -500,8 +625,15 @@ bool set_pool(PgSocket *client, const char *dbname, const char *username, const
 
 			slog_info(client, "no such user: %s", username);
 			client->login_user_credentials = calloc(1, sizeof(*client->login_user_credentials));
+			if (!client->login_user_credentials
+			    || !set_credentials_name(client->login_user_credentials, username)) {
+				free(client->login_user_credentials);
+				client->login_user_credentials = NULL;
+				disconnect_client(client, true, "out of memory");
+				return false;
+			}
+			client->login_user_credentials->passwd = "";
 			client->login_user_credentials->mock_auth = true;
-			safe_strcpy(client->login_user_credentials->name, username, sizeof(client->login_user_credentials->name));
 		}
 	}
 
@@ -513,7 +645,8 @@ bool handle_auth_query_response(PgSocket *client, PktHdr *pkt)
 	uint16_t columns;
 	uint32_t length;
 	const char *username, *password;
-	PgCredentials credentials;
+	char name[MAX_USERNAME];
+	char passwd[MAX_PASSWORD];
 	PgSocket *server = client->link;
 
 	switch (pkt->type) {
@@ -528,7 +661,8 @@ bool handle_auth_query_response(PgSocket *client, PktHdr *pkt)
 		}
 		break;
 	case 'D':	/* DataRow */
-		memset(&credentials, 0, sizeof(credentials));
+		memset(name, 0, sizeof(name));
+		memset(passwd, 0, sizeof(passwd));
 		if (!mbuf_get_uint16be(&pkt->data, &columns)) {
 			disconnect_server(server, false, "bad packet");
 			return false;
@@ -549,9 +683,9 @@ bool handle_auth_query_response(PgSocket *client, PktHdr *pkt)
 			disconnect_server(server, false, "bad packet");
 			return false;
 		}
-		if (sizeof(credentials.name) - 1 < length)
-			length = sizeof(credentials.name) - 1;
-		memcpy(credentials.name, username, length);
+		if (sizeof(name) - 1 < length)
+			length = sizeof(name) - 1;
+		memcpy(name, username, length);
 		if (!mbuf_get_uint32be(&pkt->data, &length)) {
 			disconnect_server(server, false, "bad packet");
 			return false;
@@ -569,16 +703,17 @@ bool handle_auth_query_response(PgSocket *client, PktHdr *pkt)
 				return false;
 			}
 		}
-		if (sizeof(credentials.passwd) - 1 < length)
-			length = sizeof(credentials.passwd) - 1;
-		memcpy(credentials.passwd, password, length);
+		if (sizeof(passwd) - 1 < length)
+			length = sizeof(passwd) - 1;
+		memcpy(passwd, password, length);
 
-		slog_debug(client, "successfully parsed auth_query response for user %s", credentials.name);
-		client->login_user_credentials = add_dynamic_credentials(client->db, credentials.name, credentials.passwd);
+		slog_debug(client, "successfully parsed auth_query response for user %s", name);
+		client->login_user_credentials = add_dynamic_credentials(client->db, name, passwd);
 		if (!client->login_user_credentials) {
 			disconnect_server(server, false, "unable to allocate new user for auth");
 			return false;
 		}
+		client->login_user_credentials->auth_query_time = get_cached_time();
 		break;
 	case 'N':	/* NoticeResponse */
 		break;
@@ -593,6 +728,7 @@ bool handle_auth_query_response(PgSocket *client, PktHdr *pkt)
 	case 'Z':	/* ReadyForQuery */
 		sbuf_prepare_skip(&client->link->sbuf, pkt->len);
 		if (!client->login_user_credentials) {
+			remember_auth_query_miss(client->auth_query_key);
 			if (cf_log_connections)
 				slog_info(client, "login failed: db=%s", client->db->name);
 			/*
@@ -920,10 +1056,12 @@ static bool scram_client_first(PgSocket *client, uint32_t datalen, const uint8_t
 
 	input = ibuf;
 	slog_debug(client, "SCRAM client-first-message = \"%s\"", input);
+	if (!alloc_scram_state(client))
+		goto failed;
 	if (!read_client_first_message(client, input,
-				       &client->scram_state.cbind_flag,
-				       &client->scram_state.client_first_message_bare,
-				       &client->scram_state.client_nonce))
+				       &client->scram_state->cbind_flag,
+				       &client->scram_state->client_first_message_bare,
+				       &client->scram_state->client_nonce))
 		goto failed;
 
 	if (!user->mock_auth) {
@@ -938,14 +1076,14 @@ static bool scram_client_first(PgSocket *client, uint32_t datalen, const uint8_t
 		}
 	}
 
-	if (!build_server_first_message(&client->scram_state, user->name, user->mock_auth ? NULL : user->passwd))
+	if (!build_server_first_message(client->scram_state, user->name, user->mock_auth ? NULL : user->passwd))
 		goto failed;
-	slog_debug(client, "SCRAM server-first-message = \"%s\"", client->scram_state.server_first_message);
+	slog_debug(client, "SCRAM server-first-message = \"%s\"", client->scram_state->server_first_message);
 
 	SEND_generic(res, client, 'R', "ib",
 		     AUTH_SASL_CONT,
-		     client->scram_state.server_first_message,
-		     strlen(client->scram_state.server_first_message));
+		     client->scram_state->server_first_message,
+		     strlen(client->scram_state->server_first_message));
 
 	free(ibuf);
 	return res;
@@ -971,25 +1109,27 @@ static bool scram_client_final(PgSocket *client, uint32_t datalen, const uint8_t
 
 	input = ibuf;
 	slog_debug(client, "SCRAM client-final-message = \"%s\"", input);
+	if (!client->scram_state)
+		goto failed;
 	if (!read_client_final_message(client, data, input,
 				       &client_final_nonce,
 				       &proof))
 		goto failed;
 	slog_debug(client, "SCRAM client-final-message-without-proof = \"%s\"",
-		   client->scram_state.client_final_message_without_proof);
+		   client->scram_state->client_final_message_without_proof);
 
-	if (!verify_final_nonce(&client->scram_state, client_final_nonce)) {
+	if (!verify_final_nonce(client->scram_state, client_final_nonce)) {
 		slog_error(client, "invalid SCRAM response (nonce does not match)");
 		goto failed;
 	}
 
-	if (!verify_client_proof(&client->scram_state, proof)
+	if (!verify_client_proof(client->scram_state, proof)
 	    || !client->login_user_credentials) {
 		slog_error(client, "password authentication failed");
 		goto failed;
 	}
 
-	server_final_message = build_server_final_message(&client->scram_state);
+	server_final_message = build_server_final_message(client->scram_state);
 	if (!server_final_message)
 		goto failed;
 	slog_debug(client, "SCRAM server-final-message = \"%s\"", server_final_message);
@@ -1128,7 +1268,7 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 			uint32_t length;
 			const uint8_t *data;
 
-			if (!client->scram_state.server_nonce) {
+			if (!client->scram_state || !client->scram_state->server_nonce) {
 				/* process as SASLInitialResponse */
 				if (!mbuf_get_string(&pkt->data, &mech))
 					return false;
@@ -1141,6 +1281,9 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 					return false;
 				if (!mbuf_get_bytes(&pkt->data, length, &data))
 					return false;
+				/* PBKDF2 for a plain-text secret is done by an auth worker */
+				if (auth_worker_build_scram_secret(client))
+					return false;
 				if (!scram_client_first(client, length, data)) {
 					disconnect_client(client, true, "SASL authentication failed");
 					return false;
@@ -1152,20 +1295,19 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 					return false;
 				if (scram_client_final(client, length, data)) {
 					/* save SCRAM keys for user */
-					if (!client->scram_state.adhoc && !client->db->fake) {
-						memcpy(client->pool->user_credentials->scram_ClientKey,
-						       client->scram_state.ClientKey,
-						       sizeof(client->scram_state.ClientKey));
-						memcpy(client->pool->user_credentials->scram_ServerKey,
-						       client->scram_state.ServerKey,
-						       sizeof(client->scram_state.ServerKey));
-						client->pool->user_credentials->has_scram_keys = true;
+					if (!client->scram_state->adhoc && !client->db->fake) {
+						/* without them the server login just needs the secret */
+						if (!set_credentials_scram_keys(client->pool->user_credentials,
+										client->scram_state->ClientKey,
+										client->scram_state->ServerKey))
+							slog_warning(client, "out of memory, SCRAM keys not saved");
 					}
 
-					free_scram_state(&client->scram_state);
+					release_scram_state(client);
 					if (!finish_client_login(client))
 						return false;
 				} else {
+					forget_cached_auth_query(client);
 					disconnect_client(client, true, "SASL authentication failed");
 					return false;
 				}
@@ -1193,10 +1335,14 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 					return false;
 				}
 
+				if (auth_worker_check_passwd(client, passwd))
+					return false;
+
 				if (check_client_passwd(client, passwd)) {
 					if (!finish_client_login(client))
 						return false;
 				} else {
+					forget_cached_auth_query(client);
 					disconnect_client(client, true, "password authentication failed");
 					return false;
 				}
@@ -1223,6 +1369,357 @@ static bool handle_client_startup(PgSocket *client, PktHdr *pkt)
 	return true;
 }
 
+/*
+ * What a statement does to the server session: nothing the next client
+ * could notice, change it in a way the reset on release undoes, create
+ * state that lives past the transaction, create such state that other
+ * sessions can wait on (advisory locks, LISTEN, temp tables), or throw
+ * all such state away.  This is a textual check; anything that cannot
+ * be checked counts as a change.
+ */
+enum SessionEffect {
+	SESSION_KEEP,
+	SESSION_CHANGE,
+	SESSION_PIN,
+	SESSION_HOLD,
+	SESSION_CLEAR,
+};
+
+/* if a comment starts at p, return the position after it, otherwise p */
+static const char *skip_sql_comment(const char *p, const char *end)
+{
+	int depth = 0;
+
+	if (p + 1 >= end)
+		return p;
+	if (p[0] == '-' && p[1] == '-') {
+		while (p < end && *p != '\n')
+			p++;
+		return p;
+	}
+	if (p[0] != '/' || p[1] != '*')
+		return p;
+	/* block comments nest */
+	while (p < end) {
+		if (p[0] == '/' && p + 1 < end && p[1] == '*') {
+			depth++;
+			p += 2;
+		} else if (p[0] == '*' && p + 1 < end && p[1] == '/') {
+			p += 2;
+			if (--depth == 0)
+				break;
+		} else {
+			p++;
+		}
+	}
+	return p;
+}
+
+/* skip whitespace and comments */
+static const char *skip_sql_space(const char *p, const char *end)
+{
+	const char *next;
+
+	while (p < end) {
+		if (isspace((unsigned char)*p)) {
+			p++;
+			continue;
+		}
+		next = skip_sql_comment(p, end);
+		if (next == p)
+			break;
+		p = next;
+	}
+	return p;
+}
+
+static bool is_sql_ident_char(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+/* end of the quoted text starting at p, 'quote' doubled is an escape */
+static const char *skip_sql_quotes(const char *p, const char *end, char quote, bool backslash)
+{
+	for (p++; p < end; p++) {
+		if (backslash && *p == '\\' && p + 1 < end) {
+			p++;
+		} else if (*p == quote) {
+			if (p + 1 < end && p[1] == quote)
+				p++;
+			else
+				return p + 1;
+		}
+	}
+	return end;
+}
+
+/* end of the dollar-quoted string starting at p, or p if there is none */
+static const char *skip_sql_dollar_quotes(const char *p, const char *end)
+{
+	const char *tag_end = p + 1;
+	size_t tag_len;
+
+	/* $1 is a parameter */
+	if (tag_end < end && isdigit((unsigned char)*tag_end))
+		return p;
+	while (tag_end < end && (isalnum((unsigned char)*tag_end) || *tag_end == '_'))
+		tag_end++;
+	if (tag_end >= end || *tag_end != '$')
+		return p;
+	tag_len = tag_end + 1 - p;
+
+	for (p = tag_end + 1; p + tag_len <= end; p++) {
+		if (*p == '$' && memcmp(p, tag_end + 1 - tag_len, tag_len) == 0)
+			return p + tag_len;
+	}
+	return end;
+}
+
+/*
+ * Position after the token at p: a word, a string, a quoted identifier,
+ * a comment or a single other character.  Words are returned in
+ * word_end, NULL for anything else.
+ */
+static const char *next_sql_token(const char *p, const char *end, const char **word_end)
+{
+	const char *next;
+
+	*word_end = NULL;
+	if ((*p == 'E' || *p == 'e') && p + 1 < end && p[1] == '\'')
+		return skip_sql_quotes(p + 1, end, '\'', true);
+	if (*p == '\'')
+		return skip_sql_quotes(p, end, '\'', false);
+	if (*p == '"')
+		return skip_sql_quotes(p, end, '"', false);
+	if (*p == '$') {
+		next = skip_sql_dollar_quotes(p, end);
+		return next != p ? next : p + 1;
+	}
+	if (isalnum((unsigned char)*p) || *p == '_') {
+		/* identifiers may contain $, it does not start a quote there */
+		for (next = p; next < end; next++) {
+			if (!isalnum((unsigned char)*next) && *next != '_' && *next != '$')
+				break;
+		}
+		*word_end = next;
+		return next;
+	}
+	next = skip_sql_comment(p, end);
+	return next != p ? next : p + 1;
+}
+
+/* end of the statement at p: the next ';' outside of quotes and comments */
+static const char *sql_statement_end(const char *p, const char *end)
+{
+	const char *word_end;
+
+	while (p < end && *p != ';')
+		p = next_sql_token(p, end, &word_end);
+	return p;
+}
+
+/* if the statement continues with the keyword, return position after it */
+static const char *match_sql_word(const char *p, const char *end, const char *word)
+{
+	size_t len = strlen(word);
+
+	p = skip_sql_space(p, end);
+	if ((size_t)(end - p) < len || strncasecmp(p, word, len) != 0)
+		return NULL;
+	if (p + len < end && is_sql_ident_char(p[len]))
+		return NULL;
+	return p + len;
+}
+
+/* is word one of the words of the statement, outside of strings and comments */
+static bool sql_has_word(const char *p, const char *end, const char *word)
+{
+	size_t len = strlen(word);
+	const char *next, *word_end;
+
+	for (; p < end; p = next) {
+		next = next_sql_token(p, end, &word_end);
+		if (word_end && (size_t)(word_end - p) == len && strncasecmp(p, word, len) == 0)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * SET of a parameter PgBouncer restores on every server by itself does
+ * not need a pin, neither do SET LOCAL, SET TRANSACTION and SET
+ * CONSTRAINTS.
+ */
+static enum SessionEffect set_statement_effect(const char *p, const char *end)
+{
+	char name[64];
+	const char *s;
+	size_t len;
+
+	if (match_sql_word(p, end, "local") || match_sql_word(p, end, "transaction")
+	    || match_sql_word(p, end, "constraints"))
+		return SESSION_KEEP;
+	if ((s = match_sql_word(p, end, "session")) != NULL)
+		p = s;
+
+	p = skip_sql_space(p, end);
+	for (len = 0; p + len < end && is_sql_ident_char(p[len]); len++) {
+		if (len >= sizeof(name) - 1)
+			return SESSION_PIN;
+	}
+	memcpy(name, p, len);
+	name[len] = 0;
+	if (len > 0 && varcache_is_tracked(name))
+		return SESSION_CHANGE;
+	return SESSION_PIN;
+}
+
+static enum SessionEffect statement_session_effect(const char *p, const char *end)
+{
+	const char *s;
+
+	if ((s = match_sql_word(p, end, "set")) != NULL)
+		return set_statement_effect(s, end);
+	if ((s = match_sql_word(p, end, "discard")) != NULL)
+		return match_sql_word(s, end, "all") ? SESSION_CLEAR : SESSION_CHANGE;
+	if ((s = match_sql_word(p, end, "prepare")) != NULL)
+		return match_sql_word(s, end, "transaction") ? SESSION_KEEP : SESSION_PIN;
+	if (match_sql_word(p, end, "listen"))
+		return SESSION_HOLD;
+	if (match_sql_word(p, end, "load"))
+		return SESSION_PIN;
+	if (match_sql_word(p, end, "reset") || match_sql_word(p, end, "unlisten"))
+		return SESSION_CHANGE;
+	if (match_sql_word(p, end, "declare"))
+		return sql_has_word(p, end, "hold") ? SESSION_PIN : SESSION_KEEP;
+	if ((s = match_sql_word(p, end, "create")) != NULL) {
+		const char *scope = match_sql_word(s, end, "global");
+		if (!scope)
+			scope = match_sql_word(s, end, "local");
+		if (scope)
+			s = scope;
+		if (match_sql_word(s, end, "temp") || match_sql_word(s, end, "temporary"))
+			return SESSION_HOLD;
+	}
+	/* session advisory locks, not the xact variants */
+	if (sql_has_word(p, end, "pg_advisory_lock")
+	    || sql_has_word(p, end, "pg_advisory_lock_shared")
+	    || sql_has_word(p, end, "pg_try_advisory_lock")
+	    || sql_has_word(p, end, "pg_try_advisory_lock_shared"))
+		return SESSION_HOLD;
+	/* set_config(), nextval() for currval(), SELECT INTO TEMP, pg_temp */
+	if (sql_has_word(p, end, "set_config") || sql_has_word(p, end, "nextval")
+	    || sql_has_word(p, end, "temp") || sql_has_word(p, end, "temporary")
+	    || sql_has_word(p, end, "pg_temp"))
+		return SESSION_CHANGE;
+	return SESSION_KEEP;
+}
+
+/*
+ * Go over all statements in the query text.  The last one that pins or
+ * clears decides about the pin, other changes are only remembered.  Held
+ * state stays held until it is cleared.
+ */
+static enum SessionEffect query_session_effect(const char *query)
+{
+	enum SessionEffect res = SESSION_KEEP, effect;
+	const char *p = query, *end = query + strlen(query), *stmt_end;
+
+	while (p < end) {
+		stmt_end = sql_statement_end(p, end);
+		effect = statement_session_effect(p, stmt_end);
+		if (effect == SESSION_CLEAR || effect == SESSION_HOLD || res == SESSION_KEEP)
+			res = effect;
+		else if (effect == SESSION_PIN && res != SESSION_HOLD)
+			res = effect;
+		p = stmt_end < end ? stmt_end + 1 : end;
+	}
+	return res;
+}
+
+static void note_session_effect(PgSocket *server, enum SessionEffect effect)
+{
+	if (effect != SESSION_KEEP)
+		server->session_dirty = true;
+	if (effect == SESSION_HOLD)
+		server->session_held = true;
+}
+
+/*
+ * Remember what the client did to the server session, so the reset on
+ * release can be skipped, narrowed or deferred.
+ */
+static void track_session_changes(PgSocket *client, PktHdr *pkt)
+{
+	PgSocket *server = client->link;
+	struct MBuf data = pkt->data;
+	const char *name, *query;
+	enum SessionEffect effect;
+
+	if (server->session_dirty && server->session_held)
+		return;
+
+	switch (pkt->type) {
+	case 'Q':		/* Query */
+		if (!mbuf_get_string(&data, &query)) {
+			note_session_effect(server, SESSION_HOLD);
+			break;
+		}
+		note_session_effect(server, query_session_effect(query));
+		break;
+	case 'P':		/* Parse */
+		if (!mbuf_get_string(&data, &name) || !mbuf_get_string(&data, &query)) {
+			note_session_effect(server, SESSION_HOLD);
+			break;
+		}
+		effect = query_session_effect(query);
+		note_session_effect(server, effect);
+		if (effect == SESSION_KEEP && *name && !is_prepared_statements_enabled(client))
+			server->prepared_dirty = true;
+		break;
+	case 'F':		/* FunctionCall */
+		/* could be pg_advisory_lock() as well */
+		note_session_effect(server, SESSION_HOLD);
+		break;
+	}
+}
+
+/*
+ * In transaction pooling, keep the client on its server after it did
+ * something that would leak into the next client's session, until it
+ * throws the session state away with DISCARD ALL.
+ */
+static void track_session_pin(PgSocket *client, PktHdr *pkt)
+{
+	struct MBuf data = pkt->data;
+	const char *name, *query;
+	enum SessionEffect effect;
+
+	switch (pkt->type) {
+	case 'Q':		/* Query */
+		if (!mbuf_get_string(&data, &query))
+			return;
+		break;
+	case 'P':		/* Parse */
+		if (!mbuf_get_string(&data, &name) || !mbuf_get_string(&data, &query))
+			return;
+		break;
+	default:
+		return;
+	}
+
+	effect = query_session_effect(query);
+	if ((effect == SESSION_PIN || effect == SESSION_HOLD) && !client->pinned) {
+		slog_debug(client, "session state created, pinning to server");
+		client->pinned = true;
+		client->link->session_dirty = true;
+	} else if (effect == SESSION_CLEAR && client->pinned) {
+		slog_debug(client, "session state discarded, unpinning from server");
+		client->pinned = false;
+	}
+}
+
 /* decide on packets of logged-in client */
 static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 {
@@ -1307,6 +1804,8 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 		disconnect_client(client, true, "unknown pkt");
 		return false;
 	case 'X':	/* Terminate */
+		if (salvage_server(client))
+			slog_debug(client, "server is being salvaged");
 		disconnect_client(client, false, "client close request");
 		return false;
 	}
@@ -1412,6 +1911,11 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 	client->link->ready = false;
 	client->link->idle_tx = false;
 
+	if (cf_server_reset_query_skip_clean)
+		track_session_changes(client, pkt);
+	if (cf_transaction_pin_session_state && connection_pool_mode(client->link) == POOL_TX)
+		track_session_pin(client, pkt);
+
 	if (ps_action != PS_IGNORE) {
 		/*
 		 * All the following handle_xxx_packet functions below insert packets
@@ -1472,6 +1976,37 @@ static bool handle_client_work(PgSocket *client, PktHdr *pkt)
 }
 
 
+/*
+ * Raw relay for COPY FROM STDIN and replication feedback: while the
+ * server is in copy mode, CopyData from the client is forwarded with only
+ * the packet headers looked at.  CopyDone and CopyFail go through
+ * handle_client_work() so they get tracked.
+ */
+static bool relay_copy_data(PgSocket *client, struct MBuf *data)
+{
+	PgSocket *server = client->link;
+	unsigned run;
+
+	if (client->state != CL_ACTIVE || !server || !server->copy_mode)
+		return false;
+	if (client->packet_cb_state.flag != CB_NONE)
+		return false;
+	if (mbuf_avail_for_read(&client->sbuf.extra_packets) > 0)
+		return false;
+
+	run = pkt_run_len(data, "d");
+	if (run == 0)
+		return false;
+
+	slog_noise(client, "relaying %u bytes of CopyData", run);
+	client->request_time = get_cached_time();
+	client->pool->stats.client_bytes += run;
+	server->ready = false;
+	server->idle_tx = false;
+	sbuf_prepare_send(&client->sbuf, &server->sbuf, run);
+	return true;
+}
+
 /*
  * expect_startup_packet chooses returns true if we expect a startup packet and
  * false if we expect a regular packet.
@@ -1499,6 +2034,31 @@ static bool expect_startup_packet(PgSocket *client)
 }
 
 
+/*
+ * pool_mem_limit admission: a client that is about to start a new request
+ * while its pool holds too much memory is not read from until the pool
+ * drops below the limit again, see resume_mem_throttled_clients().
+ */
+static bool throttle_client(PgSocket *client)
+{
+	PgPool *pool = client->pool;
+
+	if (!pool || pool->db->admin || client->link || client->state != CL_ACTIVE)
+		return false;
+	if (!pool_over_mem_limit(pool))
+		return false;
+
+	slog_debug(client, "pool over pool_mem_limit (%zu bytes used), throttling", pool->mem_used);
+	if (!sbuf_pause(&client->sbuf)) {
+		disconnect_client(client, true, "pause failed");
+		return true;
+	}
+	client->mem_throttled = true;
+	pool->mem_throttled_count++;
+	queue_pool_maint(pool);
+	return true;
+}
+
 /* callback from SBuf */
 bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 {
@@ -1524,10 +2084,14 @@ bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 		 * Don't log error if client disconnects right away,
 		 * could be monitoring probe.
 		 */
-		if (client->state == CL_LOGIN && mbuf_avail_for_read(data) == 0)
+		if (client->state == CL_LOGIN && mbuf_avail_for_read(data) == 0) {
 			disconnect_client(client, false, NULL);
-		else
+		} else {
+			/* keep the server if it can be brought back to idle */
+			if (salvage_server(client))
+				slog_debug(client, "server is being salvaged");
 			disconnect_client(client, false, "client unexpected eof");
+		}
 		break;
 	case SBUF_EV_SEND_FAILED:
 		disconnect_server(client->link, false, "server connection closed");
@@ -1538,6 +2102,10 @@ bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 			slog_noise(client, "C: got partial header, trying to wait a bit");
 			return false;
 		}
+		if (throttle_client(client))
+			return false;
+		if (relay_copy_data(client, data))
+			return true;
 		if (!get_header(data, &pkt)) {
 			char hex[8*2 + 1];
 			disconnect_client(client, true, "bad packet header: '%s'",
@@ -1602,6 +2170,7 @@ bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 				mbuf_init_dynamic(&client->packet_cb_state.pkt.data);
 				if (!mbuf_make_room(&client->packet_cb_state.pkt.data, client->packet_cb_state.pkt.len))
 					return false;
+				charge_socket_mem(client, client->packet_cb_state.pkt.data.alloc_len);
 			}
 
 			if (!mbuf_write_raw_mbuf(&client->packet_cb_state.pkt.data, data))
@@ -1638,7 +2207,7 @@ bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 			}
 
 			client->packet_cb_state.flag = CB_NONE;
-			free_header(&client->packet_cb_state.pkt);
+			free_buffered_packet(client);
 			break;
 		default:
 			disconnect_client(client, true, "BUG: unknown packet callback flag");
@@ -1650,6 +2219,10 @@ bool client_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 		sbuf_continue(&client->sbuf);
 		res = true;
 		break;
+	case SBUF_EV_SPOOL:
+		/* only server results are spooled */
+		res = false;
+		break;
 	}
 	return res;
 }
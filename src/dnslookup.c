@@ -246,6 +246,8 @@ static void dns_signal(int f, short ev, void *arg)
 	struct List *el, *tmp;
 	struct GaiRequest *rq;
 	int e;
+
+	loop_callback(LOOP_CB_DNS);
 	list_for_each_safe(el, &gctx->gairq_list, tmp) {
 		rq = container_of(el, struct GaiRequest, node);
 		e = gai_error(&rq->gairq);
@@ -463,6 +465,7 @@ static void xares_timer_cb(evutil_socket_t sock, short flags, void *arg)
 	struct DNSContext *ctx = arg;
 	struct XaresMeta *meta = ctx->edns;
 
+	loop_callback(LOOP_CB_DNS);
 	ares_process_fd(meta->chan, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
 
 	meta->timer_active = false;
@@ -476,6 +479,7 @@ static void xares_fd_cb(evutil_socket_t sock, short flags, void *arg)
 	struct XaresMeta *meta = xfd->meta;
 	ares_socket_t r, w;
 
+	loop_callback(LOOP_CB_DNS);
 	r = (flags & EV_READ) ? xfd->sock : ARES_SOCKET_BAD;
 	w = (flags & EV_WRITE) ? xfd->sock : ARES_SOCKET_BAD;
 	ares_process_fd(meta->chan, r, w);
@@ -1210,6 +1214,7 @@ static void zone_timer(evutil_socket_t fd, short flg, void *arg)
 	struct List *el;
 	struct DNSZone *z;
 
+	loop_callback(LOOP_CB_DNS);
 	if (list_empty(&ctx->zone_list)) {
 		ctx->zone_state = 0;
 		return;
@@ -24,10 +24,28 @@
 
 #include <usual/slab.h>
 
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
+
 /* do full maintenance 3x per second */
 static struct timeval full_maint_period = {0, USEC / 3};
 static struct event full_maint_ev;
 
+/*
+ * Pools that need a look from per_loop_maint(): some client started
+ * waiting or some server changed state.  Pools stay here as long as they
+ * have waiting clients.  Memory-throttled clients bring their pool back
+ * when the pool releases memory, see pool_mem_released().
+ */
+static LIST(maint_pool_list);
+
+/*
+ * Databases with PAUSE <db> or WAIT_CLOSE in effect.  While there are any,
+ * per_loop_maint() goes through all pools.
+ */
+static int special_db_count;
+
 /* close all sockets in server list */
 static void close_server_list(struct StatList *sk_list, const char *reason)
 {
@@ -56,6 +74,14 @@ bool suspend_socket(PgSocket *sk, bool force_suspend)
 	if (sk->suspended)
 		return true;
 
+	/* already paused, RESUME lets it read and re-check the limit */
+	if (sk->mem_throttled) {
+		sk->mem_throttled = false;
+		sk->pool->mem_throttled_count--;
+		sk->suspended = true;
+		return true;
+	}
+
 	if (sbuf_is_empty(&sk->sbuf)) {
 		if (sbuf_pause(&sk->sbuf))
 			sk->suspended = true;
@@ -125,6 +151,50 @@ void resume_all(void)
 	resume_pooler();
 }
 
+enum SocketCheck {
+	SOCKET_OK,
+	SOCKET_SUSPECT,		/* let server_check_query decide */
+	SOCKET_DEAD,
+};
+
+/*
+ * Look at an unused server socket without a round trip.  The server
+ * must not have closed it or sent anything unasked, and a TCP
+ * connection must still be established with nothing unacknowledged.
+ */
+static enum SocketCheck check_server_socket(PgSocket *server)
+{
+	int fd = sbuf_socket(&server->sbuf);
+	char c;
+	ssize_t res;
+
+	if (server->sbuf.tls)
+		return SOCKET_SUSPECT;
+
+	res = recv(fd, &c, 1, MSG_PEEK);
+	if (res == 0)
+		return SOCKET_DEAD;
+	if (res > 0)
+		return SOCKET_SUSPECT;
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		return SOCKET_DEAD;
+
+#if defined(__linux__) && defined(TCP_INFO)
+	if (!pga_is_unix(&server->remote_addr)) {
+		struct tcp_info info;
+		socklen_t len = sizeof(info);
+
+		if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+			return SOCKET_SUSPECT;
+		if (info.tcpi_state != TCP_ESTABLISHED)
+			return SOCKET_DEAD;
+		if (info.tcpi_unacked > 0 || info.tcpi_retransmits > 0)
+			return SOCKET_SUSPECT;
+	}
+#endif
+	return SOCKET_OK;
+}
+
 /*
  * send test/reset query to server if needed
  */
@@ -154,6 +224,22 @@ static void launch_recheck(PgPool *pool)
 			need_check = false;
 	}
 
+	/* the query is only needed if the socket looks wrong */
+	if (need_check && cf_server_check_socket) {
+		switch (check_server_socket(server)) {
+		case SOCKET_OK:
+			slog_debug(server, "P: socket check ok");
+			server->request_time = get_cached_time();
+			need_check = false;
+			break;
+		case SOCKET_SUSPECT:
+			break;
+		case SOCKET_DEAD:
+			disconnect_server(server, false, "server socket check failed");
+			return;
+		}
+	}
+
 	if (need_check) {
 		/* send test query, wait for result */
 		slog_debug(server, "P: checking: %s", q);
@@ -176,6 +262,9 @@ static void per_loop_activate(PgPool *pool)
 	PgSocket *client;
 	int sv_tested, sv_used;
 
+	if (pool->mem_throttled_count > 0)
+		resume_mem_throttled_clients(pool);
+
 	/* if there is a cancel request waiting, open a new connection */
 	if (!statlist_empty(&pool->waiting_cancel_req_list)) {
 		launch_new_connection(pool, /* evict_if_needed= */ true);
@@ -241,6 +330,18 @@ static int per_loop_pause(PgPool *pool)
 /*
  * suspend active clients and servers
  */
+static void close_reset_pending(struct StatList *list)
+{
+	struct List *item, *tmp;
+	PgSocket *server;
+
+	statlist_for_each_safe(item, list, tmp) {
+		server = container_of(item, PgSocket, head);
+		if (server->reset_pending)
+			disconnect_server(server, true, "reset pending on suspend");
+	}
+}
+
 static int per_loop_suspend(PgPool *pool, bool force_suspend)
 {
 	int active = 0;
@@ -256,6 +357,9 @@ static int per_loop_suspend(PgPool *pool, bool force_suspend)
 		per_loop_activate(pool);
 
 	if (!active) {
+		/* the deferred reset would not be carried over by a takeover */
+		close_reset_pending(&pool->idle_server_list);
+
 		active += suspend_socket_list(&pool->active_server_list, force_suspend);
 		active += suspend_socket_list(&pool->idle_server_list, force_suspend);
 
@@ -304,6 +408,94 @@ static int per_loop_wait_close(PgPool *pool)
 	return count;
 }
 
+void queue_pool_maint(PgPool *pool)
+{
+	/* peer pools only forward cancels, the janitor handles them */
+	if (pool->db->peer_id)
+		return;
+	if (list_empty(&pool->maint_head))
+		list_append(&maint_pool_list, &pool->maint_head);
+}
+
+static void dequeue_pool_maint(PgPool *pool)
+{
+	list_del(&pool->maint_head);
+	list_init(&pool->maint_head);
+}
+
+void set_db_paused(PgDatabase *db, bool paused)
+{
+	if (db->db_paused == paused)
+		return;
+	db->db_paused = paused;
+	special_db_count += paused ? 1 : -1;
+}
+
+void set_db_wait_close(PgDatabase *db)
+{
+	if (db->db_wait_close)
+		return;
+	db->db_wait_close = true;
+	special_db_count++;
+}
+
+static void clear_db_wait_close(PgDatabase *db)
+{
+	if (!db->db_wait_close)
+		return;
+	db->db_wait_close = false;
+	special_db_count--;
+}
+
+/*
+ * All servers WAIT_CLOSE was waiting for are gone, so drop the flag
+ * to let per_loop_maint() take the fast path again.
+ */
+static void wait_close_finished(void)
+{
+	struct List *item;
+	PgPool *pool;
+
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		if (pool->db->db_wait_close) {
+			log_info("WAIT_CLOSE finished for database %s", pool->db->name);
+			clear_db_wait_close(pool->db);
+		}
+	}
+}
+
+/*
+ * Normal operation: activate only pools that were queued.
+ */
+static void per_loop_activate_queued(void)
+{
+	struct List queued;
+	struct List *item;
+	PgPool *pool;
+
+	/* pools queued while running this go to the global list again */
+	list_init(&queued);
+	while (!list_empty(&maint_pool_list)) {
+		item = list_pop(&maint_pool_list);
+		list_append(&queued, item);
+	}
+
+	while (!list_empty(&queued)) {
+		item = list_pop(&queued);
+		list_init(item);
+		pool = container_of(item, PgPool, maint_head);
+		if (pool->db->admin)
+			continue;
+
+		per_loop_activate(pool);
+
+		if (!statlist_empty(&pool->waiting_client_list)
+		    || !statlist_empty(&pool->waiting_cancel_req_list))
+			queue_pool_maint(pool);
+	}
+}
+
 /*
  * this function is called for each event loop.
  */
@@ -317,6 +509,11 @@ void per_loop_maint(void)
 	bool partial_wait = false;
 	bool force_suspend = false;
 
+	if (cf_pause_mode == P_NONE && special_db_count == 0) {
+		per_loop_activate_queued();
+		return;
+	}
+
 	if (cf_pause_mode == P_SUSPEND && cf_suspend_timeout > 0) {
 		usec_t stime = get_cached_time() - g_suspend_start;
 		if (stime >= cf_suspend_timeout)
@@ -368,132 +565,625 @@ void per_loop_maint(void)
 		break;
 	}
 
-	if (partial_wait && !waiting_count)
+	if (partial_wait && !waiting_count) {
+		wait_close_finished();
 		admin_wait_close_done();
+	}
 }
 
-/* maintaining clients in pool */
-static void pool_client_maint(PgPool *pool)
+/*
+ * Socket timeouts.
+ *
+ * Every client and server that has some timeout pending sits in a
+ * hierarchical timer wheel, keyed by the earliest moment one of its
+ * timeouts could trigger.  The deadline is recalculated on every state
+ * change.  Timestamps like request_time only move forward, so a deadline
+ * that was calculated earlier is never too late - when it expires, the
+ * socket is checked against the real timeouts and put back into the
+ * wheel if nothing happened yet.  This way the cost of enforcing
+ * timeouts depends on the number of sockets that expire, not on the
+ * number of sockets.
+ */
+
+/* timer resolution */
+#define TIMER_TICK		(10 * USEC / 1000)
+
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4
+#define WHEEL_SPAN		((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* recheck delay for sockets whose timeouts cannot be applied yet */
+#define TIMER_RECHECK		(USEC / 3)
+
+static struct List timer_wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static uint64_t timer_wheel_used[WHEEL_LEVELS];
+static uint64_t timer_wheel_tick;
+static bool timer_wheel_initialized;
+
+static struct event timer_wheel_ev;
+static bool timer_wheel_ev_ready;
+static uint64_t timer_wheel_ev_tick;
+
+static void timer_wheel_init(void)
 {
-	struct List *item, *tmp;
-	usec_t now = get_cached_time();
-	PgSocket *client;
-	usec_t age;
+	int level, slot;
 
-	/* force client_idle_timeout */
-	if (cf_client_idle_timeout > 0) {
-		statlist_for_each_safe(item, &pool->active_client_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			Assert(client->state == CL_ACTIVE);
-			if (client->link)
-				continue;
-			if (now - client->request_time > cf_client_idle_timeout)
-				disconnect_client(client, true, "client_idle_timeout");
-		}
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (slot = 0; slot < WHEEL_SIZE; slot++)
+			list_init(&timer_wheel[level][slot]);
 	}
+	timer_wheel_tick = get_cached_time() / TIMER_TICK;
+	timer_wheel_initialized = true;
+}
 
-	/* force timeouts for waiting queries */
-	if (cf_query_timeout > 0 || cf_query_wait_timeout > 0) {
-		statlist_for_each_safe(item, &pool->waiting_client_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			Assert(client->state == CL_WAITING || client->state == CL_WAITING_LOGIN);
-			if (client->query_start == 0) {
-				age = now - client->request_time;
-				/* log_warning("query_start==0"); */
-			} else {
-				age = now - client->query_start;
-			}
+static bool timer_wheel_empty(void)
+{
+	int level;
 
-			if (cf_shutdown == SHUTDOWN_WAIT_FOR_SERVERS) {
-				disconnect_client(client, true, "server shutting down");
-			} else if (cf_query_timeout > 0 && age > cf_query_timeout) {
-				disconnect_client(client, true, "query_timeout");
-			} else if (cf_query_wait_timeout > 0 && age > cf_query_wait_timeout) {
-				disconnect_client(client, true, "query_wait_timeout");
-			}
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		if (timer_wheel_used[level])
+			return false;
+	}
+	return true;
+}
+
+/* the tick when the wheel needs to be looked at next, 0 if never */
+static uint64_t timer_wheel_next_tick(void)
+{
+	uint64_t next = 0;
+	uint64_t tick;
+	int level, i;
+
+	for (i = 1; i < WHEEL_SIZE; i++) {
+		tick = timer_wheel_tick + i;
+		if (timer_wheel_used[0] & ((uint64_t)1 << (tick & WHEEL_MASK))) {
+			next = tick;
+			break;
 		}
 	}
 
-	/* apply cancel_wait_timeout for cancel connections */
-	if (cf_cancel_wait_timeout > 0) {
-		statlist_for_each_safe(item, &pool->waiting_cancel_req_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			Assert(client->state == CL_WAITING_CANCEL);
-			age = now - client->request_time;
+	/* higher levels need to be cascaded down at their next boundary */
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (!timer_wheel_used[level])
+			continue;
+		tick = ((timer_wheel_tick >> (WHEEL_BITS * level)) + 1) << (WHEEL_BITS * level);
+		if (next == 0 || tick < next)
+			next = tick;
+	}
+	return next;
+}
 
-			if (age > cf_cancel_wait_timeout)
-				disconnect_client(client, false, "cancel_wait_timeout");
-		}
+/* make sure libevent wakes us up at the given tick */
+static void schedule_timer_wheel(uint64_t tick)
+{
+	struct timeval tv;
+	usec_t now, when;
+
+	if (!timer_wheel_ev_ready || tick == 0)
+		return;
+	if (timer_wheel_ev_tick != 0 && timer_wheel_ev_tick <= tick)
+		return;
+
+	now = get_cached_time();
+	when = tick * TIMER_TICK;
+	when = (when > now) ? when - now : 0;
+	tv.tv_sec = when / USEC;
+	tv.tv_usec = when % USEC;
+	if (event_add(&timer_wheel_ev, &tv) < 0) {
+		log_warning("event_add failed: %s", strerror(errno));
+		return;
 	}
+	timer_wheel_ev_tick = tick;
+}
 
-	/* apply client_login_timeout to clients waiting for welcome pkt */
-	if (cf_client_login_timeout > 0 && !pool->welcome_msg_ready) {
-		statlist_for_each_safe(item, &pool->waiting_client_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			if (!client->wait_for_welcome)
-				continue;
-			age = now - client->connect_time;
-			if (age > cf_client_login_timeout)
-				disconnect_client(client, true, "client_login_timeout (server down)");
+static void timer_wheel_remove(PgSocket *sk)
+{
+	int level = sk->timer_slot / WHEEL_SIZE;
+	int slot = sk->timer_slot % WHEEL_SIZE;
+
+	list_del(&sk->timer_head);
+	if (list_empty(&timer_wheel[level][slot]))
+		timer_wheel_used[level] &= ~((uint64_t)1 << slot);
+	sk->timer_tick = 0;
+}
+
+static void timer_wheel_insert(PgSocket *sk, uint64_t tick)
+{
+	uint64_t delta;
+	int level, slot;
+
+	if (tick <= timer_wheel_tick)
+		tick = timer_wheel_tick + 1;
+	delta = tick - timer_wheel_tick;
+
+	/* far away deadlines get rechecked at the end of the wheel */
+	if (delta >= WHEEL_SPAN) {
+		delta = WHEEL_SPAN - 1;
+		tick = timer_wheel_tick + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1))))
+			break;
+	}
+	slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	list_append(&timer_wheel[level][slot], &sk->timer_head);
+	timer_wheel_used[level] |= (uint64_t)1 << slot;
+	sk->timer_tick = tick;
+	sk->timer_slot = level * WHEEL_SIZE + slot;
+
+	if (level == 0)
+		schedule_timer_wheel(tick);
+	else
+		schedule_timer_wheel(((timer_wheel_tick >> (WHEEL_BITS * level)) + 1) << (WHEEL_BITS * level));
+}
+
+static void earliest(usec_t *deadline, usec_t t)
+{
+	if (*deadline == 0 || t < *deadline)
+		*deadline = t;
+}
+
+/* earliest moment a client timeout could trigger, 0 if none */
+static usec_t client_timer_deadline(PgSocket *client)
+{
+	usec_t deadline = 0;
+	usec_t start;
+
+	switch (client->state) {
+	case CL_LOGIN:
+		if (cf_client_login_timeout > 0)
+			deadline = client->connect_time + cf_client_login_timeout;
+		break;
+	case CL_ACTIVE:
+		/* linked clients get rechecked when the server is released */
+		if (cf_client_idle_timeout > 0 && !client->link && !client->pool->db->admin)
+			deadline = client->request_time + cf_client_idle_timeout;
+		break;
+	case CL_WAITING:
+	case CL_WAITING_LOGIN:
+		start = client->query_start ? client->query_start : client->request_time;
+		if (cf_query_timeout > 0)
+			earliest(&deadline, start + cf_query_timeout);
+		if (cf_query_wait_timeout > 0)
+			earliest(&deadline, start + cf_query_wait_timeout);
+		if (cf_client_login_timeout > 0 && client->wait_for_welcome
+		    && !client->pool->welcome_msg_ready)
+			earliest(&deadline, client->connect_time + cf_client_login_timeout);
+		break;
+	case CL_WAITING_CANCEL:
+		if (cf_cancel_wait_timeout > 0)
+			deadline = client->request_time + cf_cancel_wait_timeout;
+		break;
+	default:
+		break;
+	}
+	return deadline;
+}
+
+/* earliest moment a server timeout could trigger, 0 if none */
+static usec_t server_timer_deadline(PgSocket *server, usec_t now)
+{
+	PgPool *pool = server->pool;
+	usec_t deadline = 0;
+	usec_t lifetime_end, gap, start;
+
+	switch (server->state) {
+	case SV_LOGIN:
+		if (cf_server_connect_timeout > 0)
+			earliest(&deadline, server->connect_time + cf_server_connect_timeout);
+		if (pool->db->peer_id && cf_cancel_wait_timeout > 0)
+			earliest(&deadline, server->connect_time + cf_cancel_wait_timeout);
+		break;
+	case SV_ACTIVE:
+		if (server->salvaging)
+			return server->salvage_start + cf_server_salvage_timeout;
+		if (server->close_needed && (server->replication || cf_server_fast_close)) {
+			/* the server may become ready without a state change */
+			if (server->replication || server->ready)
+				return now;
+			earliest(&deadline, now + TIMER_RECHECK);
+		}
+
+		/*
+		 * Timeouts that do not apply right now can only start
+		 * counting from some later request.
+		 */
+		if (cf_query_timeout > 0) {
+			start = (!server->ready && server->link) ? server->link->request_time : now;
+			/* a canceled query gets as long again to finish */
+			if (server->query_canceled)
+				start += cf_query_timeout;
+			earliest(&deadline, start + cf_query_timeout);
+		}
+		if (cf_idle_transaction_timeout > 0) {
+			start = (!server->ready && server->idle_tx) ? server->request_time : now;
+			earliest(&deadline, start + cf_idle_transaction_timeout);
 		}
+		break;
+	case SV_IDLE:
+	case SV_USED:
+	case SV_TESTED:
+		if (server->close_needed || (server->state != SV_TESTED && !server->ready))
+			return now;
+
+		if (cf_server_idle_timeout > 0) {
+			if (pool_min_pool_size(pool) == 0 || pool_connected_server_count(pool) > pool_min_pool_size(pool))
+				earliest(&deadline, server->request_time + cf_server_idle_timeout);
+			else
+				earliest(&deadline, now + cf_server_idle_timeout);
+		}
+
+		lifetime_end = server->connect_time + pool_server_lifetime(pool);
+		if (lifetime_end > now) {
+			earliest(&deadline, lifetime_end);
+		} else {
+			/* see life_over(), nothing else is checked meanwhile */
+			gap = 0;
+			if (pool_pool_size(pool) > 0)
+				gap = pool_server_lifetime(pool) / pool_pool_size(pool);
+			earliest(&deadline, pool->last_lifetime_disconnect + gap);
+			break;
+		}
+
+		if (server->state == SV_IDLE && (*cf_server_check_query || server->reset_pending))
+			earliest(&deadline, server->request_time + cf_server_check_delay);
+		break;
+	default:
+		break;
 	}
+	return deadline;
 }
 
-/* maintaining clients in peer pool */
-static void peer_pool_client_maint(PgPool *pool)
+/*
+ * Put the socket into the timer wheel according to its current state,
+ * or take it out if no timeout applies.
+ */
+void update_socket_timer(PgSocket *sk)
 {
-	struct List *item, *tmp;
 	usec_t now = get_cached_time();
-	PgSocket *client;
+	usec_t deadline;
+	uint64_t tick;
+
+	if (is_server_socket(sk))
+		deadline = server_timer_deadline(sk, now);
+	else
+		deadline = client_timer_deadline(sk);
+
+	if (deadline == 0) {
+		if (sk->timer_tick)
+			timer_wheel_remove(sk);
+		return;
+	}
+
+	if (!timer_wheel_initialized)
+		timer_wheel_init();
+	else if (timer_wheel_empty())
+		timer_wheel_tick = now / TIMER_TICK;
+
+	tick = (deadline + TIMER_TICK - 1) / TIMER_TICK;
+	if (sk->timer_tick) {
+		if (sk->timer_tick == tick)
+			return;
+		timer_wheel_remove(sk);
+	}
+	timer_wheel_insert(sk, tick);
+}
+
+/* close a socket because of a timeout, noting it in the pool's events */
+static void timeout_client(PgSocket *client, bool notify, const char *reason)
+{
+	if (client->pool)
+		record_pool_event(client->pool, PEV_TIMEOUT, client, reason);
+	disconnect_client(client, notify, "%s", reason);
+}
+
+static void timeout_server(PgSocket *server, const char *reason)
+{
+	record_pool_event(server->pool, PEV_TIMEOUT, server, reason);
+	disconnect_server(server, true, "%s", reason);
+}
+
+static void client_timer_expired(PgSocket *client, usec_t now)
+{
 	usec_t age;
 
-	if (cf_cancel_wait_timeout > 0) {
-		statlist_for_each_safe(item, &pool->waiting_cancel_req_list, tmp) {
-			client = container_of(item, PgSocket, head);
-			Assert(client->state == CL_WAITING_CANCEL);
+	switch (client->state) {
+	case CL_LOGIN:
+		age = now - client->connect_time;
+		if (cf_client_login_timeout > 0 && age > cf_client_login_timeout)
+			timeout_client(client, true, "client_login_timeout");
+		break;
+	case CL_ACTIVE:
+		if (client->link)
+			break;
+		age = now - client->request_time;
+		if (cf_client_idle_timeout <= 0 || age <= cf_client_idle_timeout)
+			break;
+		/* not idle while a spooled result is still being written out */
+		if (sbuf_spool_len(&client->sbuf) > 0)
+			timer_wheel_insert(client, (now + TIMER_RECHECK) / TIMER_TICK);
+		else
+			timeout_client(client, true, "client_idle_timeout");
+		break;
+	case CL_WAITING:
+	case CL_WAITING_LOGIN:
+		if (client->query_start == 0)
 			age = now - client->request_time;
-
-			if (age > cf_cancel_wait_timeout)
-				disconnect_client(client, false, "cancel_wait_timeout");
+		else
+			age = now - client->query_start;
+
+		if (cf_query_timeout > 0 && age > cf_query_timeout) {
+			timeout_client(client, true, "query_timeout");
+		} else if (cf_query_wait_timeout > 0 && age > cf_query_wait_timeout) {
+			timeout_client(client, true, "query_wait_timeout");
+		} else if (cf_client_login_timeout > 0 && client->wait_for_welcome
+			   && !client->pool->welcome_msg_ready
+			   && now - client->connect_time > cf_client_login_timeout) {
+			timeout_client(client, true, "client_login_timeout (server down)");
 		}
+		break;
+	case CL_WAITING_CANCEL:
+		age = now - client->request_time;
+		if (cf_cancel_wait_timeout > 0 && age > cf_cancel_wait_timeout)
+			timeout_client(client, false, "cancel_wait_timeout");
+		break;
+	default:
+		break;
 	}
 }
 
-static void check_unused_servers(PgPool *pool, struct StatList *slist, bool idle_test)
+/* idle server checks, in order of importance */
+static void check_unused_server(PgSocket *server, usec_t now)
 {
-	usec_t now = get_cached_time();
+	PgPool *pool = server->pool;
 	usec_t server_lifetime = pool_server_lifetime(pool);
-
-	struct List *item, *tmp;
 	usec_t idle, age;
-	PgSocket *server;
 
-	/* disconnect idle servers if needed */
-	statlist_for_each_safe(item, slist, tmp) {
-		server = container_of(item, PgSocket, head);
+	age = now - server->connect_time;
+	idle = now - server->request_time;
+
+	if (server->close_needed) {
+		disconnect_server(server, true, "database configuration changed");
+	} else if (server->state == SV_IDLE && !server->ready) {
+		disconnect_server(server, true, "SV_IDLE server got dirty");
+	} else if (server->state == SV_USED && !server->ready) {
+		disconnect_server(server, true, "SV_USED server got dirty");
+	} else if (cf_server_idle_timeout > 0 && idle > cf_server_idle_timeout
+		   && (pool_min_pool_size(pool) == 0 || pool_connected_server_count(pool) > pool_min_pool_size(pool))) {
+		timeout_server(server, "server idle timeout");
+	} else if (age >= server_lifetime) {
+		if (life_over(server)) {
+			timeout_server(server, "server lifetime over");
+			pool->last_lifetime_disconnect = now;
+		}
+	} else if (cf_pause_mode == P_PAUSE) {
+		disconnect_server(server, true, "pause mode");
+	} else if (server->state == SV_IDLE && server->reset_pending) {
+		if (idle > cf_server_check_delay)
+			reset_idle_server(server);
+	} else if (server->state == SV_IDLE && *cf_server_check_query) {
+		if (idle > cf_server_check_delay)
+			change_server_state(server, SV_USED);
+	}
+}
 
-		age = now - server->connect_time;
-		idle = now - server->request_time;
+static void server_timer_expired(PgSocket *server, usec_t now)
+{
+	usec_t age_client, age_server, age;
 
-		if (server->close_needed) {
+	switch (server->state) {
+	case SV_LOGIN:
+		/*
+		 * Peer pools are only for sending cancellations, so their
+		 * connections are also limited by cancel_wait_timeout.
+		 */
+		age = now - server->connect_time;
+		if (cf_server_connect_timeout > 0 && age > cf_server_connect_timeout) {
+			timeout_server(server, "connect timeout");
+		} else if (server->pool->db->peer_id && cf_cancel_wait_timeout > 0
+			   && age > cf_cancel_wait_timeout) {
+			timeout_server(server, "cancel_wait_timeout");
+		}
+		break;
+	case SV_ACTIVE:
+		if (server->salvaging) {
+			if (now - server->salvage_start >= cf_server_salvage_timeout)
+				timeout_server(server, "salvage timeout");
+			break;
+		}
+		/*
+		 * Disconnect active servers without outstanding requests if
+		 * server_fast_close is set. This only applies to session
+		 * pooling.
+		 */
+		if (cf_server_fast_close && server->ready && server->close_needed) {
+			disconnect_server(server, true, "database configuration changed");
+			break;
+		}
+		/*
+		 * Always disconnect close_needed replication servers. These
+		 * connections are expected to be very long lived (possibly
+		 * indefinitely), so waiting until the session/transaction is
+		 * over is not an option.
+		 */
+		if (server->replication && server->close_needed) {
 			disconnect_server(server, true, "database configuration changed");
-		} else if (server->state == SV_IDLE && !server->ready) {
-			disconnect_server(server, true, "SV_IDLE server got dirty");
-		} else if (server->state == SV_USED && !server->ready) {
-			disconnect_server(server, true, "SV_USED server got dirty");
-		} else if (cf_server_idle_timeout > 0 && idle > cf_server_idle_timeout
-			   && (pool_min_pool_size(pool) == 0 || pool_connected_server_count(pool) > pool_min_pool_size(pool))) {
-			disconnect_server(server, true, "server idle timeout");
-		} else if (age >= server_lifetime) {
-			if (life_over(server)) {
-				disconnect_server(server, true, "server lifetime over");
-				pool->last_lifetime_disconnect = now;
+			break;
+		}
+
+		if (server->ready || !server->link)
+			break;
+
+		/*
+		 * Note the different age calculations:
+		 * query_timeout counts from the last request
+		 * of the client (the client started the
+		 * query), idle_transaction_timeout counts
+		 * from the last request of the server (the
+		 * server sent the idle information).
+		 */
+		age_client = now - server->link->request_time;
+		age_server = now - server->request_time;
+
+		if (cf_query_timeout > 0 && age_client > cf_query_timeout) {
+			if (cf_query_timeout_cancel && !server->query_canceled) {
+				/* keep the connection, the client gets the cancel error */
+				slog_info(server, "query timeout, canceling query");
+				record_pool_event(server->pool, PEV_TIMEOUT, server, "query timeout, canceling query");
+				if (cancel_server_query(server))
+					server->query_canceled = true;
+				else
+					timeout_server(server, "query timeout");
+			} else if (!server->query_canceled || age_client > 2 * cf_query_timeout) {
+				timeout_server(server, "query timeout");
 			}
-		} else if (cf_pause_mode == P_PAUSE) {
-			disconnect_server(server, true, "pause mode");
-		} else if (idle_test && *cf_server_check_query) {
-			if (idle > cf_server_check_delay)
-				change_server_state(server, SV_USED);
+		} else if (cf_idle_transaction_timeout > 0 &&
+			   server->idle_tx &&
+			   age_server > cf_idle_transaction_timeout) {
+			timeout_server(server, "idle transaction timeout");
+		}
+		break;
+	case SV_IDLE:
+	case SV_USED:
+	case SV_TESTED:
+		check_unused_server(server, now);
+		break;
+	default:
+		break;
+	}
+}
+
+/* move entries of a higher level slot closer to the expiry end */
+static void cascade_timer_slot(int level)
+{
+	int slot = (timer_wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	struct List *head = &timer_wheel[level][slot];
+	struct List *item;
+	PgSocket *sk;
+
+	while (!list_empty(head)) {
+		item = list_pop(head);
+		sk = container_of(item, PgSocket, timer_head);
+		timer_wheel_insert(sk, sk->timer_tick);
+	}
+	timer_wheel_used[level] &= ~((uint64_t)1 << slot);
+}
+
+static void expire_timer_slot(usec_t now)
+{
+	int slot = timer_wheel_tick & WHEEL_MASK;
+	struct List *head = &timer_wheel[0][slot];
+	struct List *item;
+	PgSocket *sk;
+
+	/* new timers always go to later slots, so this terminates */
+	while (!list_empty(head)) {
+		item = list_pop(head);
+		sk = container_of(item, PgSocket, timer_head);
+		sk->timer_tick = 0;
+
+		/* avoid doing anything that may surprise other pgbouncer */
+		if (cf_pause_mode == P_SUSPEND) {
+			timer_wheel_insert(sk, (now + TIMER_RECHECK) / TIMER_TICK);
+			continue;
+		}
+
+		if (is_server_socket(sk))
+			server_timer_expired(sk, now);
+		else
+			client_timer_expired(sk, now);
+
+		/* still alive, wait for the next deadline */
+		if (!sk->timer_tick)
+			update_socket_timer(sk);
+	}
+	timer_wheel_used[0] &= ~((uint64_t)1 << slot);
+}
+
+static void run_socket_timers(evutil_socket_t sock, short flags, void *arg)
+{
+	usec_t now = get_cached_time();
+	uint64_t target = now / TIMER_TICK;
+	int level;
+
+	loop_callback(LOOP_CB_JANITOR);
+	timer_wheel_ev_tick = 0;
+
+	while (timer_wheel_tick < target) {
+		if (timer_wheel_empty()) {
+			timer_wheel_tick = target;
+			break;
+		}
+		timer_wheel_tick++;
+
+		for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((timer_wheel_tick & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) == 0)
+				cascade_timer_slot(level);
+		}
+		expire_timer_slot(now);
+	}
+
+	schedule_timer_wheel(timer_wheel_next_tick());
+}
+
+static void rearm_socket_list(struct StatList *list)
+{
+	struct List *item;
+	PgSocket *sk;
+
+	statlist_for_each(item, list) {
+		sk = container_of(item, PgSocket, head);
+		update_socket_timer(sk);
+	}
+}
+
+static void rearm_pool_timers(struct StatList *list)
+{
+	struct List *item;
+	PgPool *pool;
+
+	statlist_for_each(item, list) {
+		pool = container_of(item, PgPool, head);
+		rearm_socket_list(&pool->active_client_list);
+		rearm_socket_list(&pool->waiting_client_list);
+		rearm_socket_list(&pool->waiting_cancel_req_list);
+		rearm_socket_list(&pool->active_server_list);
+		rearm_socket_list(&pool->idle_server_list);
+		rearm_socket_list(&pool->used_server_list);
+		rearm_socket_list(&pool->tested_server_list);
+		rearm_socket_list(&pool->new_server_list);
+	}
+}
+
+/*
+ * Recalculate all deadlines, needed when the timeout settings change.
+ */
+void rearm_socket_timers(void)
+{
+	rearm_socket_list(&login_client_list);
+	rearm_pool_timers(&pool_list);
+	rearm_pool_timers(&peer_pool_list);
+}
+
+/* maintaining clients in pool */
+static void pool_client_maint(PgPool *pool)
+{
+	struct List *item, *tmp;
+	PgSocket *client;
+
+	/* timeouts are handled by socket timers, only shutdown is left */
+	if (cf_shutdown != SHUTDOWN_WAIT_FOR_SERVERS)
+		return;
+
+	if (cf_query_timeout > 0 || cf_query_wait_timeout > 0) {
+		statlist_for_each_safe(item, &pool->waiting_client_list, tmp) {
+			client = container_of(item, PgSocket, head);
+			Assert(client->state == CL_WAITING || client->state == CL_WAITING_LOGIN);
+			disconnect_client(client, true, "server shutting down");
 		}
 	}
 }
@@ -535,130 +1225,53 @@ static void check_pool_size(PgPool *pool)
 /* maintain servers in a pool */
 static void pool_server_maint(PgPool *pool)
 {
-	struct List *item, *tmp;
-	usec_t now = get_cached_time();
-	PgSocket *server;
-
-	/* find and disconnect idle servers */
-	check_unused_servers(pool, &pool->used_server_list, 0);
-	check_unused_servers(pool, &pool->tested_server_list, 0);
-	check_unused_servers(pool, &pool->idle_server_list, 1);
-
-	statlist_for_each_safe(item, &pool->active_server_list, tmp) {
-		server = container_of(item, PgSocket, head);
-		Assert(server->state == SV_ACTIVE);
-		/*
-		 * Disconnect active servers without outstanding requests if
-		 * server_fast_close is set. This only applies to session
-		 * pooling.
-		 */
-		if (cf_server_fast_close && server->ready && server->close_needed)
-			disconnect_server(server, true, "database configuration changed");
-		/*
-		 * Always disconnect close_needed replication servers. These
-		 * connections are expected to be very long lived (possibly
-		 * indefinitely), so waiting until the session/transaction is
-		 * over is not an option.
-		 */
-		if (server->replication && server->close_needed)
-			disconnect_server(server, true, "database configuration changed");
-	}
-
-	/* handle query_timeout and idle_transaction_timeout */
-	if (cf_query_timeout > 0 || cf_idle_transaction_timeout > 0) {
-		statlist_for_each_safe(item, &pool->active_server_list, tmp) {
-			usec_t age_client, age_server;
-
-			server = container_of(item, PgSocket, head);
-			Assert(server->state == SV_ACTIVE);
-			if (server->ready)
-				continue;
-
-			/*
-			 * Note the different age calculations:
-			 * query_timeout counts from the last request
-			 * of the client (the client started the
-			 * query), idle_transaction_timeout counts
-			 * from the last request of the server (the
-			 * server sent the idle information).
-			 */
-			age_client = now - server->link->request_time;
-			age_server = now - server->request_time;
-
-			if (cf_query_timeout > 0 && age_client > cf_query_timeout) {
-				disconnect_server(server, true, "query timeout");
-			} else if (cf_idle_transaction_timeout > 0 &&
-				   server->idle_tx &&
-				   age_server > cf_idle_transaction_timeout) {
-				disconnect_server(server, true, "idle transaction timeout");
-			}
-		}
-	}
-
-	/* find connections that got connect, but could not log in */
-	if (cf_server_connect_timeout > 0) {
-		statlist_for_each_safe(item, &pool->new_server_list, tmp) {
-			usec_t age;
-
-			server = container_of(item, PgSocket, head);
-			Assert(server->state == SV_LOGIN);
-
-			age = now - server->connect_time;
-			if (age > cf_server_connect_timeout)
-				disconnect_server(server, true, "connect timeout");
-		}
-	}
-
 	check_pool_size(pool);
 }
 
-/* maintain servers in a peer pool */
-static void peer_pool_server_maint(PgPool *pool)
+/*
+ * Pool with nothing in it.  Logins and cancel requests that are still in
+ * progress point at their pool without being on its lists, so those are
+ * checked too, but only once the pool has been idle long enough.
+ */
+static bool pool_is_unused(PgPool *pool, bool check_logins)
 {
-	struct List *item, *tmp;
-	usec_t now = get_cached_time();
-	PgSocket *server;
+	struct List *item;
+	PgSocket *client;
 
-	/*
-	 * find connections that got connected, but could not log in. For normal
-	 * pools we only compare against server_connect_timeout for these servers,
-	 * but since peer pools are only for sending cancellations we also compare
-	 * against cancel_wait_timeout here.
-	 */
-	if (cf_server_connect_timeout > 0 || cf_cancel_wait_timeout > 0) {
-		statlist_for_each_safe(item, &pool->new_server_list, tmp) {
-			usec_t age;
-
-			server = container_of(item, PgSocket, head);
-			Assert(server->state == SV_LOGIN);
-
-			age = now - server->connect_time;
-			if (cf_server_connect_timeout > 0 && age > cf_server_connect_timeout) {
-				disconnect_server(server, true, "connect timeout");
-			} else if (cf_cancel_wait_timeout > 0 && age > cf_cancel_wait_timeout) {
-				disconnect_server(server, true, "cancel_wait_timeout");
-			}
-		}
+	if (pool_client_count(pool) > 0 || pool_server_count(pool) > 0
+	    || !statlist_empty(&pool->waiting_cancel_req_list)
+	    || !statlist_empty(&pool->active_cancel_req_list))
+		return false;
+	if (!check_logins)
+		return true;
+
+	statlist_for_each(item, &login_client_list) {
+		client = container_of(item, PgSocket, head);
+		if (client->pool == pool)
+			return false;
 	}
+	return true;
 }
 
-
-static void cleanup_client_logins(void)
+/* free pools that have been empty for pool_idle_timeout */
+static void cleanup_idle_pool(PgPool *pool)
 {
-	struct List *item, *tmp;
-	PgSocket *client;
-	usec_t age;
 	usec_t now = get_cached_time();
 
-	if (cf_client_login_timeout <= 0)
+	if (cf_pool_idle_timeout <= 0 || database_min_pool_size(pool->db) > 0
+	    || !pool_is_unused(pool, false)) {
+		pool->idle_since = 0;
+		return;
+	}
+	if (!pool->idle_since) {
+		pool->idle_since = now;
 		return;
-
-	statlist_for_each_safe(item, &login_client_list, tmp) {
-		client = container_of(item, PgSocket, head);
-		age = now - client->connect_time;
-		if (age > cf_client_login_timeout)
-			disconnect_client(client, true, "client_login_timeout");
 	}
+	if (now - pool->idle_since <= cf_pool_idle_timeout || !pool_is_unused(pool, true))
+		return;
+
+	log_debug("freeing idle pool %s/%s", pool->db->name, pool->user_credentials->name);
+	kill_pool(pool);
 }
 
 static void cleanup_inactive_autodatabases(void)
@@ -693,6 +1306,8 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 	PgDatabase *db;
 
 	static unsigned int seq;
+
+	loop_callback(LOOP_CB_JANITOR);
 	seq++;
 
 	/*
@@ -732,12 +1347,8 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 			if (pool_client_count(pool) > 0 || pool_server_count(pool) > 0)
 				pool->db->active_stamp = seq;
 		}
-	}
 
-	statlist_for_each_safe(item, &peer_pool_list, tmp) {
-		pool = container_of(item, PgPool, head);
-		peer_pool_server_maint(pool);
-		peer_pool_client_maint(pool);
+		cleanup_idle_pool(pool);
 	}
 
 	/* find inactive autodbs */
@@ -754,8 +1365,6 @@ static void do_full_maint(evutil_socket_t sock, short flags, void *arg)
 
 	cleanup_inactive_autodatabases();
 
-	cleanup_client_logins();
-
 	if (cf_shutdown == SHUTDOWN_WAIT_FOR_SERVERS && get_active_server_count() == 0) {
 		log_info("server connections dropped, exiting");
 		cf_shutdown = SHUTDOWN_IMMEDIATE;
@@ -779,6 +1388,12 @@ void janitor_setup(void)
 	/* launch maintenance */
 	event_assign(&full_maint_ev, pgb_event_base, -1, EV_PERSIST, do_full_maint, NULL);
 	event_add(&full_maint_ev, &full_maint_period);
+
+	/* sockets may have been set up already by takeover */
+	event_assign(&timer_wheel_ev, pgb_event_base, -1, 0, run_socket_timers, NULL);
+	timer_wheel_ev_ready = true;
+	if (timer_wheel_initialized)
+		schedule_timer_wheel(timer_wheel_next_tick());
 }
 
 void kill_pool(PgPool *pool)
@@ -801,10 +1416,13 @@ void kill_pool(PgPool *pool)
 
 	pktbuf_free(pool->welcome_msg);
 
+	dequeue_pool_maint(pool);
 	list_del(&pool->map_head);
 	statlist_remove(&pool_list, &pool->head);
 	varcache_clean(&pool->orig_vars);
 	slab_free(var_list_cache, pool->orig_vars.var_list);
+	free(pool->latency);
+	free_pool_events(pool);
 	slab_free(pool_cache, pool);
 }
 
@@ -819,10 +1437,12 @@ void kill_peer_pool(PgPool *pool)
 
 	pktbuf_free(pool->welcome_msg);
 
+	dequeue_pool_maint(pool);
 	list_del(&pool->map_head);
 	statlist_remove(&peer_pool_list, &pool->head);
 	varcache_clean(&pool->orig_vars);
 	slab_free(var_list_cache, pool->orig_vars.var_list);
+	free_pool_events(pool);
 	slab_free(peer_pool_cache, pool);
 }
 
@@ -834,6 +1454,9 @@ void kill_database(PgDatabase *db)
 
 	log_warning("dropping database '%s' as it does not exist anymore or inactive auto-database", db->name);
 
+	set_db_paused(db, false);
+	clear_db_wait_close(db);
+
 	statlist_for_each_safe(item, &pool_list, tmp) {
 		pool = container_of(item, PgPool, head);
 		if (pool->db == db)
@@ -844,7 +1467,7 @@ void kill_database(PgDatabase *db)
 	free(db->host);
 
 	if (db->forced_user_credentials)
-		slab_free(user_cache, db->forced_user_credentials);
+		free_credentials(db->forced_user_credentials);
 	free(db->connect_query);
 	if (db->inactive_time) {
 		statlist_remove(&autodatabase_idle_list, &db->head);
@@ -903,4 +1526,6 @@ void config_postprocess(void)
 			continue;
 		}
 	}
+	/* timeout settings may have changed */
+	rearm_socket_timers();
 }
@@ -254,6 +254,8 @@ bool parse_database(void *base, const char *name, const char *connstr)
 	int res_pool_size = -1;
 	int max_db_connections = -1;
 	usec_t server_lifetime = 0;
+	int result_spool_size = -1;
+	int pool_mem_limit = -1;
 	int dbname_ofs;
 	int pool_mode = POOL_INHERIT;
 
@@ -338,6 +340,10 @@ bool parse_database(void *base, const char *name, const char *connstr)
 			max_db_connections = atoi(val);
 		} else if (strcmp("server_lifetime", key) == 0) {
 			server_lifetime = atoi(val) * USEC;
+		} else if (strcmp("result_spool_size", key) == 0) {
+			result_spool_size = atoi(val);
+		} else if (strcmp("pool_mem_limit", key) == 0) {
+			pool_mem_limit = atoi(val);
 		} else if (strcmp("pool_mode", key) == 0) {
 			if (!cf_set_lookup(&cv, val)) {
 				log_error("invalid pool mode: %s", val);
@@ -406,6 +412,8 @@ bool parse_database(void *base, const char *name, const char *connstr)
 	db->pool_mode = pool_mode;
 	db->max_db_connections = max_db_connections;
 	db->server_lifetime = server_lifetime;
+	db->result_spool_size = result_spool_size;
+	db->pool_mem_limit = pool_mem_limit;
 	free(db->connect_query);
 	db->connect_query = connect_query;
 
@@ -575,7 +583,7 @@ static void copy_quoted(char *dst, const char *src, int len)
 /* This function is only called when parsing the auth file, so
    all users added by this function do not have a dynamic password,
    by definition. If the password is empty, so be it. */
-static void unquote_add_authfile_user(const char *username, const char *password)
+static PgGlobalUser *unquote_add_authfile_user(const char *username, const char *password)
 {
 	char real_user[MAX_USERNAME];
 	char real_passwd[MAX_PASSWORD];
@@ -587,9 +595,82 @@ static void unquote_add_authfile_user(const char *username, const char *password
 	user = add_global_user(real_user, real_passwd);
 	if (!user) {
 		log_warning("cannot create user, no memory");
-		return;
+		return NULL;
 	}
 	user->credentials.dynamic_passwd = false;
+	return user;
+}
+
+/*
+ * Incremental auth_file reload.
+ *
+ * The lines of the last loaded auth_file are remembered as hashes, sorted,
+ * together with the user each line set.  On reload only lines whose hash
+ * is new get parsed into users, and users of lines that disappeared get
+ * their password cleared.  If the file names a user more than once the
+ * result depends on line order, so such files are always reloaded fully.
+ */
+struct AuthFileLine {
+	uint64_t hash;
+	PgGlobalUser *user;
+};
+
+/* line of the auth_file being loaded */
+struct AuthFileEntry {
+	uint64_t hash;
+	const char *user;
+	const char *password;
+	PgGlobalUser *global_user;
+	int lineno;
+	bool changed;
+};
+
+static struct AuthFileLine *authfile_lines;
+static int authfile_line_count;
+static bool authfile_full_reload = true;
+
+/* FNV-1a over username and password */
+static uint64_t authfile_line_hash(const char *user, const char *password)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)user; *p; p++)
+		h = (h ^ *p) * UINT64_C(1099511628211);
+	h = (h ^ 0) * UINT64_C(1099511628211);
+	for (p = (const unsigned char *)password; *p; p++)
+		h = (h ^ *p) * UINT64_C(1099511628211);
+	return h;
+}
+
+static int cmp_entry_hash(const void *a, const void *b)
+{
+	const struct AuthFileEntry *ea = a, *eb = b;
+	if (ea->hash != eb->hash)
+		return ea->hash < eb->hash ? -1 : 1;
+	return ea->lineno - eb->lineno;
+}
+
+static int cmp_entry_lineno(const void *a, const void *b)
+{
+	const struct AuthFileEntry *ea = a, *eb = b;
+	return ea->lineno - eb->lineno;
+}
+
+static int cmp_line_user(const void *a, const void *b)
+{
+	const struct AuthFileLine *la = a, *lb = b;
+	if (la->user == lb->user)
+		return 0;
+	return (uintptr_t)la->user < (uintptr_t)lb->user ? -1 : 1;
+}
+
+static int cmp_line_hash(const void *a, const void *b)
+{
+	const struct AuthFileLine *la = a, *lb = b;
+	if (la->hash == lb->hash)
+		return 0;
+	return la->hash < lb->hash ? -1 : 1;
 }
 
 static bool auth_loaded(const char *fn)
@@ -635,14 +716,93 @@ static void disable_users(void)
 
 	statlist_for_each(item, &user_list) {
 		PgGlobalUser *user = container_of(item, PgGlobalUser, head);
-		user->credentials.passwd[0] = 0;
+		/* clearing a secret needs no memory, cannot fail */
+		(void) set_credentials_passwd(&user->credentials, "");
+	}
+}
+
+/*
+ * Compare the new lines against the previous load: mark lines that are new
+ * and clear the password of users whose line went away.  Returns the
+ * number of removed lines.
+ */
+static int diff_auth_file(struct AuthFileEntry *entries, int count)
+{
+	int i = 0, j = 0;
+	int removed = 0;
+
+	qsort(entries, count, sizeof(*entries), cmp_entry_hash);
+	while (i < authfile_line_count || j < count) {
+		if (j >= count || (i < authfile_line_count && authfile_lines[i].hash < entries[j].hash)) {
+			if (authfile_lines[i].user)
+				(void) set_credentials_passwd(&authfile_lines[i].user->credentials, "");
+			removed++;
+			i++;
+		} else if (i >= authfile_line_count || entries[j].hash < authfile_lines[i].hash) {
+			entries[j].changed = true;
+			j++;
+		} else {
+			entries[j].global_user = authfile_lines[i].user;
+			i++;
+			j++;
+		}
+	}
+	/* apply in file order, so the last line for a user wins */
+	qsort(entries, count, sizeof(*entries), cmp_entry_lineno);
+	return removed;
+}
+
+/*
+ * Remember the loaded lines for the next reload.  Returns true if some user
+ * appears on more than one line.
+ */
+static bool save_auth_file_lines(struct AuthFileEntry *entries, int count)
+{
+	struct AuthFileLine *lines = NULL;
+	int i;
+
+	free(authfile_lines);
+	authfile_lines = NULL;
+	authfile_line_count = 0;
+	authfile_full_reload = true;
+
+	if (count > 0) {
+		lines = malloc(count * sizeof(*lines));
+		if (!lines) {
+			log_warning("no memory for auth_file index, next reload will be a full one");
+			return false;
+		}
 	}
+
+	for (i = 0; i < count; i++) {
+		lines[i].hash = entries[i].hash;
+		lines[i].user = entries[i].global_user;
+	}
+
+	authfile_full_reload = false;
+	qsort(lines, count, sizeof(*lines), cmp_line_user);
+	for (i = 1; i < count; i++) {
+		if (lines[i].user && lines[i].user == lines[i - 1].user) {
+			authfile_full_reload = true;
+			break;
+		}
+	}
+	qsort(lines, count, sizeof(*lines), cmp_line_hash);
+
+	authfile_lines = lines;
+	authfile_line_count = count;
+	return authfile_full_reload;
 }
 
 /* load list of users from auth_file */
 bool load_auth_file(const char *fn)
 {
 	char *user, *password, *buf, *p;
+	struct AuthFileEntry *entries = NULL, *tmp;
+	int count = 0, alloc = 0;
+	int changed = 0, removed = 0;
+	bool full;
+	int i;
 
 	/* No file to load? */
 	if (fn == NULL)
@@ -655,7 +815,6 @@ bool load_auth_file(const char *fn)
 	}
 
 	log_debug("loading auth_file: \"%s\"", fn);
-	disable_users();
 
 	p = buf;
 	while (*p) {
@@ -705,13 +864,73 @@ bool load_auth_file(const char *fn)
 		}
 		*p++ = 0;	/* tag password end */
 
-		/* send them away */
-		unquote_add_authfile_user(user, password);
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (!tmp) {
+				log_error("cannot load auth_file, no memory");
+				free(entries);
+				free(buf);
+				return false;
+			}
+			entries = tmp;
+		}
+		entries[count].hash = authfile_line_hash(user, password);
+		entries[count].user = user;
+		entries[count].password = password;
+		entries[count].global_user = NULL;
+		entries[count].lineno = count;
+		entries[count].changed = false;
+		count++;
 
 		/* skip rest of the line */
 		while (*p && *p != '\n') p++;
 	}
+
+	full = authfile_full_reload;
+	if (full) {
+		disable_users();
+		for (i = 0; i < count; i++)
+			entries[i].changed = true;
+	} else {
+		removed = diff_auth_file(entries, count);
+	}
+
+	/* send them away */
+	for (i = 0; i < count; i++) {
+		if (!entries[i].changed)
+			continue;
+		entries[i].global_user = unquote_add_authfile_user(entries[i].user, entries[i].password);
+		changed++;
+	}
+
+	/*
+	 * A user that just got a second line may have been given the wrong
+	 * password above, as unchanged lines were not applied.  Start over.
+	 */
+	if (save_auth_file_lines(entries, count) && !full) {
+		disable_users();
+		for (i = 0; i < count; i++)
+			entries[i].global_user = unquote_add_authfile_user(entries[i].user, entries[i].password);
+		save_auth_file_lines(entries, count);
+		full = true;
+	}
+
+	if (full)
+		log_debug("auth_file: loaded %d users", count);
+	else
+		log_debug("auth_file: %d users, %d added or changed, %d removed", count, changed, removed);
+
+	free(entries);
 	free(buf);
 
 	return true;
 }
+
+void loader_cleanup(void)
+{
+	free(authfile_lines);
+	authfile_lines = NULL;
+	authfile_line_count = 0;
+	authfile_full_reload = true;
+}
@@ -97,6 +97,8 @@ int cf_pool_mode = POOL_SESSION;
 /* sbuf config */
 int cf_sbuf_len;
 int cf_sbuf_loopcnt;
+int cf_result_spool_size;
+int cf_pool_mem_limit;
 int cf_so_reuseport;
 int cf_tcp_socket_buffer;
 int cf_tcp_defer_accept;
@@ -112,11 +114,13 @@ int cf_tcp_keepintvl;
 int cf_tcp_user_timeout;
 
 int cf_auth_type = AUTH_MD5;
+int cf_auth_workers;
 char *cf_auth_file;
 char *cf_auth_hba_file;
 char *cf_auth_ident_file;
 char *cf_auth_user;
 char *cf_auth_query;
+usec_t cf_auth_query_cache_ttl;
 char *cf_auth_dbname;
 char *cf_track_extra_parameters;
 
@@ -130,10 +134,15 @@ int cf_max_user_connections;
 
 char *cf_server_reset_query;
 int cf_server_reset_query_always;
+int cf_server_reset_query_skip_clean;
+int cf_transaction_pin_session_state;
 char *cf_server_check_query;
 usec_t cf_server_check_delay;
 int cf_server_fast_close;
 int cf_server_round_robin;
+int cf_server_check_socket;
+usec_t cf_server_salvage_timeout;
+int cf_server_salvage_max_bytes;
 int cf_disable_pqexec;
 usec_t cf_dns_max_ttl;
 usec_t cf_dns_nxdomain_ttl;
@@ -146,12 +155,15 @@ char *cf_ignore_startup_params;
 char *cf_autodb_connstr;	/* here is "" different from NULL */
 
 usec_t cf_autodb_idle_timeout;
+int cf_pool_event_history;
+usec_t cf_pool_idle_timeout;
 
 usec_t cf_server_lifetime;
 usec_t cf_server_idle_timeout;
 usec_t cf_server_connect_timeout;
 usec_t cf_server_login_retry;
 usec_t cf_query_timeout;
+int cf_query_timeout_cancel;
 usec_t cf_query_wait_timeout;
 usec_t cf_cancel_wait_timeout;
 usec_t cf_client_idle_timeout;
@@ -168,6 +180,7 @@ char *cf_admin_users;
 char *cf_stats_users;
 int cf_stats_period;
 int cf_log_stats;
+usec_t cf_loop_warn_time;
 
 int cf_log_connections;
 int cf_log_disconnections;
@@ -182,6 +195,7 @@ char *cf_client_tls_key_file;
 char *cf_client_tls_ciphers;
 char *cf_client_tls_dheparams;
 char *cf_client_tls_ecdhecurve;
+usec_t cf_client_tls_session_lifetime;
 
 int cf_server_tls_sslmode;
 char *cf_server_tls_protocols;
@@ -241,8 +255,10 @@ static const struct CfKey bouncer_params [] = {
 	CF_ABS("auth_hba_file", CF_STR, cf_auth_hba_file, 0, ""),
 	CF_ABS("auth_ident_file", CF_STR, cf_auth_ident_file, 0, NULL),
 	CF_ABS("auth_query", CF_STR, cf_auth_query, 0, "SELECT usename, passwd FROM pg_shadow WHERE usename=$1"),
+	CF_ABS("auth_query_cache_ttl", CF_TIME_USEC, cf_auth_query_cache_ttl, 0, "0"),
 	CF_ABS("auth_type", CF_LOOKUP(auth_type_map), cf_auth_type, 0, "md5"),
 	CF_ABS("auth_user", CF_STR, cf_auth_user, 0, NULL),
+	CF_ABS("auth_workers", CF_INT, cf_auth_workers, CF_NO_RELOAD, "0"),
 	CF_ABS("autodb_idle_timeout", CF_TIME_USEC, cf_autodb_idle_timeout, 0, "3600"),
 	CF_ABS("client_idle_timeout", CF_TIME_USEC, cf_client_idle_timeout, 0, "0"),
 	CF_ABS("client_login_timeout", CF_TIME_USEC, cf_client_login_timeout, 0, "60"),
@@ -253,6 +269,7 @@ static const struct CfKey bouncer_params [] = {
 	CF_ABS("client_tls_ecdhcurve", CF_STR, cf_client_tls_ecdhecurve, 0, "auto"),
 	CF_ABS("client_tls_key_file", CF_STR, cf_client_tls_key_file, 0, ""),
 	CF_ABS("client_tls_protocols", CF_STR, cf_client_tls_protocols, 0, "secure"),
+	CF_ABS("client_tls_session_lifetime", CF_TIME_USEC, cf_client_tls_session_lifetime, 0, "0"),
 	CF_ABS("client_tls_sslmode", CF_LOOKUP(sslmode_map), cf_client_tls_sslmode, 0, "disable"),
 	CF_ABS("conffile", CF_STR, cf_config_file, 0, NULL),
 	CF_ABS("default_pool_size", CF_INT, cf_default_pool_size, 0, "20"),
@@ -271,6 +288,7 @@ static const struct CfKey bouncer_params [] = {
 	CF_ABS("log_pooler_errors", CF_INT, cf_log_pooler_errors, 0, "1"),
 	CF_ABS("log_stats", CF_INT, cf_log_stats, 0, "1"),
 	CF_ABS("logfile", CF_STR, cf_logfile, 0, ""),
+	CF_ABS("loop_warn_time", CF_TIME_USEC, cf_loop_warn_time, 0, "1"),
 	CF_ABS("max_client_conn", CF_INT, cf_max_client_conn, 0, "100"),
 	CF_ABS("max_db_connections", CF_INT, cf_max_db_connections, 0, "0"),
 	CF_ABS("max_packet_size", CF_UINT, cf_max_packet_size, 0, "2147483647"),
@@ -280,16 +298,22 @@ static const struct CfKey bouncer_params [] = {
 	CF_ABS("peer_id", CF_INT, cf_peer_id, 0, "0"),
 	CF_ABS("pidfile", CF_STR, cf_pidfile, CF_NO_RELOAD, ""),
 	CF_ABS("pkt_buf", CF_INT, cf_sbuf_len, CF_NO_RELOAD, "4096"),
+	CF_ABS("pool_event_history", CF_INT, cf_pool_event_history, 0, "128"),
+	CF_ABS("pool_idle_timeout", CF_TIME_USEC, cf_pool_idle_timeout, 0, "0"),
+	CF_ABS("pool_mem_limit", CF_INT, cf_pool_mem_limit, 0, "0"),
 	CF_ABS("pool_mode", CF_LOOKUP(pool_mode_map), cf_pool_mode, 0, "session"),
 	CF_ABS("query_timeout", CF_TIME_USEC, cf_query_timeout, 0, "0"),
+	CF_ABS("query_timeout_cancel", CF_INT, cf_query_timeout_cancel, 0, "0"),
 	CF_ABS("query_wait_timeout", CF_TIME_USEC, cf_query_wait_timeout, 0, "120"),
 	CF_ABS("cancel_wait_timeout", CF_TIME_USEC, cf_cancel_wait_timeout, 0, "10"),
 	CF_ABS("reserve_pool_size", CF_INT, cf_res_pool_size, 0, "0"),
 	CF_ABS("reserve_pool_timeout", CF_TIME_USEC, cf_res_pool_timeout, 0, "5"),
 	CF_ABS("resolv_conf", CF_STR, cf_resolv_conf, CF_NO_RELOAD, ""),
+	CF_ABS("result_spool_size", CF_INT, cf_result_spool_size, 0, "0"),
 	CF_ABS("sbuf_loopcnt", CF_INT, cf_sbuf_loopcnt, 0, "5"),
 	CF_ABS("server_check_delay", CF_TIME_USEC, cf_server_check_delay, 0, "30"),
 	CF_ABS("server_check_query", CF_STR, cf_server_check_query, 0, "select 1"),
+	CF_ABS("server_check_socket", CF_INT, cf_server_check_socket, 0, "0"),
 	CF_ABS("server_connect_timeout", CF_TIME_USEC, cf_server_connect_timeout, 0, "15"),
 	CF_ABS("server_fast_close", CF_INT, cf_server_fast_close, 0, "0"),
 	CF_ABS("server_idle_timeout", CF_TIME_USEC, cf_server_idle_timeout, 0, "600"),
@@ -297,7 +321,10 @@ static const struct CfKey bouncer_params [] = {
 	CF_ABS("server_login_retry", CF_TIME_USEC, cf_server_login_retry, 0, "15"),
 	CF_ABS("server_reset_query", CF_STR, cf_server_reset_query, 0, "DISCARD ALL"),
 	CF_ABS("server_reset_query_always", CF_INT, cf_server_reset_query_always, 0, "0"),
+	CF_ABS("server_reset_query_skip_clean", CF_INT, cf_server_reset_query_skip_clean, 0, "0"),
 	CF_ABS("server_round_robin", CF_INT, cf_server_round_robin, 0, "0"),
+	CF_ABS("server_salvage_max_bytes", CF_INT, cf_server_salvage_max_bytes, 0, "1048576"),
+	CF_ABS("server_salvage_timeout", CF_TIME_USEC, cf_server_salvage_timeout, 0, "0"),
 	CF_ABS("server_tls_ca_file", CF_STR, cf_server_tls_ca_file, 0, ""),
 	CF_ABS("server_tls_cert_file", CF_STR, cf_server_tls_cert_file, 0, ""),
 	CF_ABS("server_tls_ciphers", CF_STR, cf_server_tls_ciphers, 0, "default"),
@@ -322,6 +349,7 @@ static const struct CfKey bouncer_params [] = {
 	CF_ABS("tcp_socket_buffer", CF_INT, cf_tcp_socket_buffer, 0, "0"),
 	CF_ABS("tcp_user_timeout", CF_INT, cf_tcp_user_timeout, 0, "0"),
 	CF_ABS("track_extra_parameters", CF_STR, cf_track_extra_parameters, CF_NO_RELOAD, "IntervalStyle"),
+	CF_ABS("transaction_pin_session_state", CF_INT, cf_transaction_pin_session_state, 0, "0"),
 	CF_ABS("unix_socket_dir", CF_STR, cf_unix_socket_dir, CF_NO_RELOAD, DEFAULT_UNIX_SOCKET_DIR),
 #ifndef WIN32
 	CF_ABS("unix_socket_group", CF_STR, cf_unix_socket_group, CF_NO_RELOAD, ""),
@@ -487,6 +515,7 @@ static struct event ev_sigint;
 
 static void handle_sigterm(evutil_socket_t sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_SIGNAL);
 	if (cf_shutdown) {
 		log_info("got SIGTERM while shutting down, fast exit");
 		/* pidfile cleanup happens via atexit() */
@@ -504,6 +533,7 @@ static void handle_sigterm(evutil_socket_t sock, short flags, void *arg)
 
 static void handle_sigint(evutil_socket_t sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_SIGNAL);
 	if (cf_shutdown) {
 		log_info("got SIGINT while shutting down, fast exit");
 		/* pidfile cleanup happens via atexit() */
@@ -526,9 +556,11 @@ static struct event ev_sigquit;
 static struct event ev_sigusr1;
 static struct event ev_sigusr2;
 static struct event ev_sighup;
+static struct event ev_sigwinch;
 
 static void handle_sigquit(evutil_socket_t sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_SIGNAL);
 	log_info("got SIGQUIT, fast exit");
 	/* pidfile cleanup happens via atexit() */
 	exit(0);
@@ -536,6 +568,7 @@ static void handle_sigquit(evutil_socket_t sock, short flags, void *arg)
 
 static void handle_sigusr1(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_SIGNAL);
 	if (cf_pause_mode == P_NONE) {
 		log_info("got SIGUSR1, pausing all activity");
 		cf_pause_mode = P_PAUSE;
@@ -546,6 +579,7 @@ static void handle_sigusr1(int sock, short flags, void *arg)
 
 static void handle_sigusr2(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_SIGNAL);
 	if (cf_shutdown) {
 		log_info("got SIGUSR2 while shutting down, ignoring");
 		return;
@@ -567,6 +601,7 @@ static void handle_sigusr2(int sock, short flags, void *arg)
 
 static void handle_sighup(int sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_SIGNAL);
 	log_info("got SIGHUP, re-reading config");
 	sd_notify(0, "RELOADING=1");
 	load_config();
@@ -574,6 +609,27 @@ static void handle_sighup(int sock, short flags, void *arg)
 		log_error("TLS configuration could not be reloaded, keeping old configuration");
 	sd_notify(0, "READY=1");
 }
+
+/*
+ * SIGWINCH also comes with every resize of the terminal PgBouncer runs in,
+ * often many in a row, so the events are written out at most this often.
+ */
+#define POOL_EVENTS_DUMP_INTERVAL	(10 * USEC)
+
+static void handle_sigwinch(int sock, short flags, void *arg)
+{
+	static usec_t last_dump;
+	usec_t now = get_cached_time();
+
+	loop_callback(LOOP_CB_SIGNAL);
+	if (last_dump && now - last_dump < POOL_EVENTS_DUMP_INTERVAL) {
+		log_debug("got SIGWINCH, pool events were written recently, ignoring");
+		return;
+	}
+	last_dump = now;
+	log_info("got SIGWINCH, writing pool events to log");
+	log_pool_events();
+}
 #endif
 
 static void signal_setup(void)
@@ -611,6 +667,11 @@ static void signal_setup(void)
 	err = evsignal_add(&ev_sigquit, NULL);
 	if (err < 0)
 		fatal_perror("evsignal_add");
+
+	evsignal_assign(&ev_sigwinch, pgb_event_base, SIGWINCH, handle_sigwinch, NULL);
+	err = evsignal_add(&ev_sigwinch, NULL);
+	if (err < 0)
+		fatal_perror("evsignal_add");
 #endif
 	evsignal_assign(&ev_sigterm, pgb_event_base, SIGTERM, handle_sigterm, NULL);
 	err = evsignal_add(&ev_sigterm, NULL);
@@ -823,6 +884,7 @@ static void main_loop_once(void)
 		if (errno != EINTR)
 			log_warning("event_loop failed: %s", strerror(errno));
 	}
+	loop_callback(LOOP_CB_MAINT);
 	pam_poll();
 	per_loop_maint();
 	reuse_just_freed_objects();
@@ -831,6 +893,8 @@ static void main_loop_once(void)
 
 	if (adns)
 		adns_per_loop(adns);
+
+	loop_iteration_done();
 }
 
 static void takeover_part1(void)
@@ -901,6 +965,7 @@ static void cleanup(void)
 	parsed_ident = NULL;
 
 	admin_cleanup();
+	loader_cleanup();
 	objects_cleanup();
 	sbuf_cleanup();
 
@@ -1089,6 +1154,7 @@ int main(int argc, char *argv[])
 	stats_setup();
 
 	pam_init();
+	auth_worker_setup();
 
 	if (did_takeover) {
 		takeover_finish();
@@ -71,6 +71,14 @@ struct Slab *iobuf_cache;
 struct Slab *outstanding_request_cache;
 struct Slab *var_list_cache;
 struct Slab *server_prepared_statement_cache;
+struct Slab *scram_state_cache;
+struct Slab *request_slots_cache;
+
+/*
+ * User names and secrets.  They take only as much memory as they need,
+ * and a name or secret that is used by several databases is kept once.
+ */
+static struct StrPool *credentials_strings;
 
 /*
  * libevent may still report events when event_del()
@@ -126,6 +134,27 @@ static void construct_server(void *obj)
 	statlist_init(&server->outstanding_requests, "outstanding_requests");
 }
 
+/*
+ * SCRAM state is needed only while logging in, so it is kept out of
+ * PgSocket and allocated when an exchange starts.
+ */
+bool alloc_scram_state(PgSocket *sk)
+{
+	if (sk->scram_state)
+		return true;
+	sk->scram_state = slab_alloc(scram_state_cache);
+	return sk->scram_state != NULL;
+}
+
+void release_scram_state(PgSocket *sk)
+{
+	if (!sk->scram_state)
+		return;
+	free_scram_state(sk->scram_state);
+	slab_free(scram_state_cache, sk->scram_state);
+	sk->scram_state = NULL;
+}
+
 /* compare string with PgCredentials->name, for usage with btree */
 static int credentials_node_cmp(uintptr_t userptr, struct AANode *node)
 {
@@ -137,8 +166,79 @@ static int credentials_node_cmp(uintptr_t userptr, struct AANode *node)
 /* destroy PgCredentials, for usage with btree */
 static void credentials_node_release(struct AANode *node, void *arg)
 {
-	PgCredentials *user = container_of(node, PgCredentials, tree_node);
-	slab_free(user_cache, user);
+	PgCredentials *credentials = container_of(node, PgCredentials, tree_node);
+	free_credentials(credentials);
+}
+
+static bool set_credentials_string(struct PStr **str_p, const char **value_p, const char *value, size_t maxlen)
+{
+	struct PStr *str;
+	size_t len = strnlen(value, maxlen - 1);
+
+	if (*str_p && (size_t)(*str_p)->len == len && memcmp((*str_p)->str, value, len) == 0)
+		return true;
+
+	if (len == 0) {
+		str = NULL;
+	} else {
+		if (!credentials_strings) {
+			credentials_strings = strpool_create(USUAL_ALLOC);
+			if (!credentials_strings)
+				return false;
+		}
+		str = strpool_get(credentials_strings, value, len);
+		if (!str)
+			return false;
+	}
+
+	strpool_decref(*str_p);
+	*str_p = str;
+	*value_p = str ? str->str : "";
+	return true;
+}
+
+/* longer names are cut, as with the fixed-size buffers before */
+bool set_credentials_name(PgCredentials *credentials, const char *name)
+{
+	return set_credentials_string(&credentials->name_str, &credentials->name, name, MAX_USERNAME);
+}
+
+/* NULL or "" means the secret is not known */
+bool set_credentials_passwd(PgCredentials *credentials, const char *passwd)
+{
+	return set_credentials_string(&credentials->passwd_str, &credentials->passwd, passwd ? passwd : "", MAX_PASSWORD);
+}
+
+bool set_credentials_scram_keys(PgCredentials *credentials, const uint8_t *client_key, const uint8_t *server_key)
+{
+	if (!credentials->scram_keys) {
+		credentials->scram_keys = malloc(sizeof(*credentials->scram_keys));
+		if (!credentials->scram_keys)
+			return false;
+	}
+	memcpy(credentials->scram_keys->ClientKey, client_key, sizeof(credentials->scram_keys->ClientKey));
+	memcpy(credentials->scram_keys->ServerKey, server_key, sizeof(credentials->scram_keys->ServerKey));
+	return true;
+}
+
+/* drop what the credentials own, but not the struct itself */
+void clear_credentials(PgCredentials *credentials)
+{
+	strpool_decref(credentials->name_str);
+	strpool_decref(credentials->passwd_str);
+	credentials->name_str = NULL;
+	credentials->passwd_str = NULL;
+	credentials->name = "";
+	credentials->passwd = "";
+	free(credentials->scram_keys);
+	credentials->scram_keys = NULL;
+}
+
+/* free credentials that came from credentials_cache */
+void free_credentials(PgCredentials *credentials)
+{
+	clear_credentials(credentials);
+	slab_free(credentials_cache, credentials);
 }
 
 /* initialization before config loading */
@@ -172,11 +272,112 @@ void init_caches(void)
 	iobuf_cache = slab_create("iobuf_cache", IOBUF_SIZE, 0, do_iobuf_reset, USUAL_ALLOC);
 	var_list_cache = slab_create("var_list_cache", sizeof(struct PStr *) * get_num_var_cached(), 0, NULL, USUAL_ALLOC);
 	server_prepared_statement_cache = slab_create("server_prepared_statement_cache", sizeof(PgServerPreparedStatement), 0, NULL, USUAL_ALLOC);
+	scram_state_cache = slab_create("scram_state_cache", sizeof(ScramState), 0, NULL, USUAL_ALLOC);
+	request_slots_cache = slab_create("request_slots_cache", sizeof(OutstandingRequest) * OUTSTANDING_REQUEST_SLOTS, 0, NULL, USUAL_ALLOC);
+}
+
+/*
+ * Charge the memory of a socket to a pool, or stop charging it when pool
+ * is NULL.  The sbuf buffers follow the same account; the socket's
+ * mem_account being set is what marks it as charged.
+ */
+void set_socket_mem_pool(PgSocket *sk, PgPool *pool)
+{
+	size_t *account = pool ? &pool->mem_used : NULL;
+	size_t *old_account;
+
+	if (sk->sbuf.mem_account == account)
+		return;
+	old_account = sk->sbuf.mem_account;
+	if (old_account)
+		*old_account -= sk->mem_charged;
+	sbuf_set_mem_account(&sk->sbuf, account);
+	if (account)
+		*account += sk->mem_charged;
+	if (old_account)
+		pool_mem_released(old_account);
+}
+
+/* memory held by a socket outside of its sbuf grew or shrank */
+void charge_socket_mem(PgSocket *sk, ssize_t delta)
+{
+	sk->mem_charged += delta;
+	if (sk->sbuf.mem_account) {
+		*sk->sbuf.mem_account += delta;
+		if (delta < 0)
+			pool_mem_released(sk->sbuf.mem_account);
+	}
+}
+
+/*
+ * Memory charged to a pool was given back.  Only then may throttled
+ * clients get under pool_mem_limit again, so only then is the pool
+ * looked at.
+ */
+void pool_mem_released(size_t *account)
+{
+	PgPool *pool = container_of(account, PgPool, mem_used);
+
+	if (pool->mem_throttled_count > 0)
+		queue_pool_maint(pool);
+}
+
+/* free the complete packet buffered for CB_WANT_COMPLETE_PACKET */
+void free_buffered_packet(PgSocket *client)
+{
+	PktHdr *pkt = &client->packet_cb_state.pkt;
+
+	if (pkt->data.data && !pkt->data.fixed)
+		charge_socket_mem(client, -(ssize_t)pkt->data.alloc_len);
+	free_header(pkt);
+}
+
+/* pool_mem_limit of the pool's db */
+int pool_mem_limit(PgPool *pool)
+{
+	if (pool->db->pool_mem_limit < 0)
+		return cf_pool_mem_limit;
+	return pool->db->pool_mem_limit;
+}
+
+/*
+ * Only counts while the pool has servers in use: those are what gives the
+ * memory back, without them holding clients off would just stall them.
+ */
+bool pool_over_mem_limit(PgPool *pool)
+{
+	int limit = pool_mem_limit(pool);
+
+	if (limit <= 0 || pool->mem_used <= (size_t)limit)
+		return false;
+	return !statlist_empty(&pool->active_server_list);
+}
+
+/*
+ * The pool got under its memory limit again, let the clients that were
+ * held back read their next request.
+ */
+void resume_mem_throttled_clients(PgPool *pool)
+{
+	struct List *item, *tmp;
+	PgSocket *client;
+
+	statlist_for_each_safe(item, &pool->active_client_list, tmp) {
+		if (pool->mem_throttled_count == 0 || pool_over_mem_limit(pool))
+			break;
+		client = container_of(item, PgSocket, head);
+		if (!client->mem_throttled)
+			continue;
+		client->mem_throttled = false;
+		pool->mem_throttled_count--;
+		sbuf_continue(&client->sbuf);
+	}
 }
 
 /* free all memory related to the given client */
 static void client_free(PgSocket *client)
 {
+	auth_worker_forget(client);
 	free_client_prepared_statements(client);
 	varcache_clean(&client->vars);
 	slab_free(var_list_cache, client->vars.var_list);
@@ -194,7 +395,13 @@ static void server_free(PgSocket *server)
 		statlist_remove(&server->canceling_clients, el);
 		if (request->server_ps)
 			free_server_prepared_statement(request->server_ps);
-		slab_free(outstanding_request_cache, request);
+		free_outstanding_request(server, request);
+	}
+
+	if (server->request_slots) {
+		charge_socket_mem(server, -(ssize_t)(sizeof(OutstandingRequest) * OUTSTANDING_REQUEST_SLOTS));
+		slab_free(request_slots_cache, server->request_slots);
+		server->request_slots = NULL;
 	}
 
 	free_server_prepared_statements(server);
@@ -209,6 +416,8 @@ void change_client_state(PgSocket *client, SocketState newstate)
 {
 	PgPool *pool = client->pool;
 
+	record_state_change(client, newstate);
+
 	/* remove from old location */
 	switch (client->state) {
 	case CL_FREE:
@@ -243,6 +452,9 @@ void change_client_state(PgSocket *client, SocketState newstate)
 
 	client->state = newstate;
 
+	/* timeouts depend on the state */
+	update_socket_timer(client);
+
 	/* put to new location */
 	switch (client->state) {
 	case CL_FREE:
@@ -258,6 +470,7 @@ void change_client_state(PgSocket *client, SocketState newstate)
 	case CL_WAITING_LOGIN:
 		client->wait_start = get_cached_time();
 		statlist_append(&pool->waiting_client_list, &client->head);
+		queue_pool_maint(pool);
 		break;
 	case CL_ACTIVE:
 		statlist_append(&pool->active_client_list, &client->head);
@@ -267,6 +480,7 @@ void change_client_state(PgSocket *client, SocketState newstate)
 		break;
 	case CL_WAITING_CANCEL:
 		statlist_append(&pool->waiting_cancel_req_list, &client->head);
+		queue_pool_maint(pool);
 		break;
 	default:
 		fatal("bad new client state: %d", client->state);
@@ -278,6 +492,8 @@ void change_server_state(PgSocket *server, SocketState newstate)
 {
 	PgPool *pool = server->pool;
 
+	record_state_change(server, newstate);
+
 	/* remove from old location */
 	switch (server->state) {
 	case SV_FREE:
@@ -312,6 +528,17 @@ void change_server_state(PgSocket *server, SocketState newstate)
 
 	server->state = newstate;
 
+	/* timeouts depend on the state */
+	update_socket_timer(server);
+
+	/*
+	 * A released or closed server may let waiting clients proceed.  Not
+	 * for the final free: the pool may be gone by then.
+	 */
+	if (pool && newstate != SV_ACTIVE && newstate != SV_ACTIVE_CANCEL
+	    && newstate != SV_BEING_CANCELED && newstate != SV_FREE)
+		queue_pool_maint(pool);
+
 	/* put to new location */
 	switch (server->state) {
 	case SV_FREE:
@@ -497,11 +724,15 @@ PgGlobalUser *add_global_user(const char *name, const char *passwd)
 		user = slab_alloc(user_cache);
 		if (!user)
 			return NULL;
+		if (!set_credentials_name(&user->credentials, name)) {
+			slab_free(user_cache, user);
+			return NULL;
+		}
+		user->credentials.passwd = "";
 		user->credentials.global_user = user;
 
 		list_init(&user->head);
 		list_init(&user->credentials.pool_list);
-		safe_strcpy(user->credentials.name, name, sizeof(user->credentials.name));
 		put_in_order(&user->head, &user_list, cmp_user);
 
 		aatree_insert(&user_tree, (uintptr_t)user->credentials.name, &user->credentials.tree_node);
@@ -509,9 +740,9 @@ PgGlobalUser *add_global_user(const char *name, const char *passwd)
 		user->pool_size = -1;
 	}
 
-	passwd = passwd ? passwd : "";
-	safe_strcpy(user->credentials.passwd, passwd, sizeof(user->credentials.passwd));
-	user->credentials.dynamic_passwd = strlen(passwd) == 0;
+	if (!set_credentials_passwd(&user->credentials, passwd))
+		return NULL;
+	user->credentials.dynamic_passwd = *user->credentials.passwd == 0;
 	return user;
 }
 
@@ -523,6 +754,28 @@ PgCredentials *add_global_credentials(const char *name, const char *passwd)
 	return &user->credentials;
 }
 
+/* new PgCredentials that belong to the global user of the same name */
+static PgCredentials *new_credentials(const char *name)
+{
+	PgCredentials *credentials;
+
+	credentials = slab_alloc(credentials_cache);
+	if (!credentials)
+		return NULL;
+	list_init(&credentials->pool_list);
+	credentials->passwd = "";
+	if (!set_credentials_name(credentials, name)) {
+		free_credentials(credentials);
+		return NULL;
+	}
+
+	credentials->global_user = find_global_user(name);
+	if (!credentials->global_user) {
+		credentials->global_user = add_global_user(name, NULL);
+	}
+	return credentials;
+}
+
 /*
  * Add dynamic credentials to this database. This should be used for dynamic
  * credentials, that were retrieved using the auth_query.
@@ -540,21 +793,15 @@ PgCredentials *add_dynamic_credentials(PgDatabase *db, const char *name, const c
 	credentials = node ? container_of(node, PgCredentials, tree_node) : NULL;
 
 	if (credentials == NULL) {
-		credentials = slab_alloc(credentials_cache);
+		credentials = new_credentials(name);
 		if (!credentials)
 			return NULL;
 
-		list_init(&credentials->pool_list);
-		safe_strcpy(credentials->name, name, sizeof(credentials->name));
-
 		aatree_insert(&db->user_tree, (uintptr_t)credentials->name, &credentials->tree_node);
-		credentials->global_user = find_global_user(name);
-		if (!credentials->global_user) {
-			credentials->global_user = add_global_user(name, NULL);
-		}
 	}
 
-	safe_strcpy(credentials->passwd, passwd, sizeof(credentials->passwd));
+	if (!set_credentials_passwd(credentials, passwd))
+		return NULL;
 	credentials->dynamic_passwd = true;
 
 	return credentials;
@@ -570,21 +817,14 @@ PgCredentials *add_pam_credentials(const char *name, const char *passwd)
 	credentials = node ? container_of(node, PgCredentials, tree_node) : NULL;
 
 	if (credentials == NULL) {
-		credentials = slab_alloc(credentials_cache);
+		credentials = new_credentials(name);
 		if (!credentials)
 			return NULL;
 
-		list_init(&credentials->pool_list);
-		safe_strcpy(credentials->name, name, sizeof(credentials->name));
-
 		aatree_insert(&pam_user_tree, (uintptr_t)credentials->name, &credentials->tree_node);
-		credentials->global_user = find_global_user(name);
-		if (!credentials->global_user) {
-			credentials->global_user = add_global_user(name, NULL);
-		}
 	}
-	if (passwd)
-		safe_strcpy(credentials->passwd, passwd, sizeof(credentials->passwd));
+	if (passwd && !set_credentials_passwd(credentials, passwd))
+		return NULL;
 	return credentials;
 }
 
@@ -593,18 +833,14 @@ PgCredentials *force_user_credentials(PgDatabase *db, const char *name, const ch
 {
 	PgCredentials *credentials = db->forced_user_credentials;
 	if (!credentials) {
-		credentials = slab_alloc(credentials_cache);
+		credentials = new_credentials(name);
 		if (!credentials)
 			return NULL;
-
-		list_init(&credentials->pool_list);
-		credentials->global_user = find_global_user(name);
-		if (!credentials->global_user) {
-			credentials->global_user = add_global_user(name, NULL);
-		}
+	} else if (!set_credentials_name(credentials, name)) {
+		return NULL;
 	}
-	safe_strcpy(credentials->name, name, sizeof(credentials->name));
-	safe_strcpy(credentials->passwd, passwd, sizeof(credentials->passwd));
+	if (!set_credentials_passwd(credentials, passwd))
+		return NULL;
 	db->forced_user_credentials = credentials;
 	return credentials;
 }
@@ -694,6 +930,7 @@ static PgPool *new_pool(PgDatabase *db, PgCredentials *user_credentials)
 
 	list_init(&pool->head);
 	list_init(&pool->map_head);
+	list_init(&pool->maint_head);
 	pool->orig_vars.var_list = slab_alloc(var_list_cache);
 
 	pool->user_credentials = user_credentials;
@@ -737,6 +974,7 @@ static PgPool *new_peer_pool(PgDatabase *db)
 
 	list_init(&pool->head);
 	list_init(&pool->map_head);
+	list_init(&pool->maint_head);
 	pool->orig_vars.var_list = slab_alloc(var_list_cache);
 
 	pool->db = db;
@@ -785,6 +1023,7 @@ static void pause_client(PgSocket *client)
 {
 	Assert(client->state == CL_ACTIVE || client->state == CL_LOGIN);
 	slog_debug(client, "pause_client");
+	PGB_PROBE2(pause_client, client, client->pool);
 
 	if (cf_shutdown == SHUTDOWN_WAIT_FOR_SERVERS) {
 		disconnect_client(client, true, "server shutting down");
@@ -816,12 +1055,17 @@ static void pause_cancel_request(PgSocket *client)
 /* wake client from wait */
 void activate_client(PgSocket *client)
 {
+	usec_t wait;
+
 	Assert(client->state == CL_WAITING || client->state == CL_WAITING_LOGIN);
 
 	Assert(client->wait_start > 0);
 
 	/* account for time client spent waiting for server */
-	client->pool->stats.wait_time += (get_cached_time() - client->wait_start);
+	wait = get_cached_time() - client->wait_start;
+	client->pool->stats.wait_time += wait;
+	latency_record(client->pool, LATENCY_WAIT, wait);
+	PGB_PROBE3(activate_client, client, client->pool, wait);
 
 	slog_debug(client, "activate_client");
 	change_client_state(client, CL_ACTIVE);
@@ -878,6 +1122,117 @@ bool check_fast_fail(PgSocket *client)
 	return false;
 }
 
+/*
+ * Pick the reset query for the session.  If only named prepared
+ * statements were left behind, DEALLOCATE ALL does the job of
+ * DISCARD ALL.
+ */
+static const char *session_reset_query(PgSocket *server)
+{
+	if (cf_server_reset_query_skip_clean && !server->session_dirty
+	    && strcasecmp(cf_server_reset_query, "DISCARD ALL") == 0)
+		return "DEALLOCATE ALL";
+	return cf_server_reset_query;
+}
+
+/* the reset query drops all prepared statements */
+static bool reset_query_deallocates(const char *query)
+{
+	return strcasecmp(query, "DISCARD ALL") == 0 || strcasecmp(query, "DEALLOCATE ALL") == 0;
+}
+
+/* session state was handed to the reset query */
+static void clear_session_dirt(PgSocket *server)
+{
+	server->session_dirty = false;
+	server->prepared_dirty = false;
+	server->session_held = false;
+	server->params_changed = false;
+}
+
+/* send reset query */
+static bool reset_on_release(PgSocket *server)
+{
+	const char *query = session_reset_query(server);
+	bool res;
+
+	Assert(server->state == SV_TESTED);
+
+	slog_debug(server, "resetting: %s", query);
+	SEND_generic(res, server, 'Q', "s", query);
+	if (!res)
+		disconnect_server(server, false, "reset query failed");
+	clear_session_dirt(server);
+	return res;
+}
+
+/*
+ * Send the reset query left over from the previous client.  It goes
+ * out just before the new client's first query, so there is no round
+ * trip to wait for.  The response is dropped by the server side.
+ */
+static bool send_pending_reset(PgSocket *server)
+{
+	const char *query = session_reset_query(server);
+	bool res;
+
+	slog_debug(server, "resetting ahead of next query: %s", query);
+	SEND_generic(res, server, 'Q', "s", query);
+	if (!res)
+		return false;
+
+	/* the next client must not use statements prepared before the reset */
+	if (is_prepared_statements_enabled(server))
+		free_server_prepared_statements(server);
+
+	server->reset_pending = false;
+	server->reset_inflight = true;
+	server->ready = false;
+	clear_session_dirt(server);
+	return true;
+}
+
+/*
+ * Decide what happens to the session of a released server: nothing if
+ * it was not modified, a reset sent together with the next client's
+ * queries, or a reset that has to finish before reuse.  That is the case
+ * when it may change reported parameters the next client relies on, and
+ * when the session may hold locks or LISTEN registrations other sessions
+ * would be stuck with until the server is used again.
+ */
+static SocketState reset_on_release_state(PgSocket *server)
+{
+	if (!cf_server_reset_query_skip_clean)
+		return SV_TESTED;
+
+	if (!server->session_dirty && !server->prepared_dirty) {
+		slog_debug(server, "session not modified, skipping reset query");
+		return SV_IDLE;
+	}
+
+	if (server->params_changed || server->session_held)
+		return SV_TESTED;
+	if (is_prepared_statements_enabled(server)
+	    && !reset_query_deallocates(session_reset_query(server)))
+		return SV_TESTED;
+
+	server->reset_pending = true;
+	return SV_IDLE;
+}
+
+/*
+ * An idle server whose deferred reset was not picked up by a client
+ * within server_check_delay gets it sent on its own.
+ */
+void reset_idle_server(PgSocket *server)
+{
+	Assert(server->state == SV_IDLE && server->reset_pending);
+
+	server->reset_pending = false;
+	change_server_state(server, SV_TESTED);
+	reset_on_release(server);
+}
+
 /* link if found, otherwise put into wait queue */
 bool find_server(PgSocket *client)
 {
@@ -928,6 +1283,14 @@ bool find_server(PgSocket *client)
 	}
 	Assert(!server || server->state == SV_IDLE);
 
+	/* reset goes before var changes, it would undo them */
+	if (server && server->reset_pending) {
+		if (!send_pending_reset(server)) {
+			disconnect_server(server, true, "reset query failed");
+			server = NULL;
+		}
+	}
+
 	/* send var changes */
 	if (server) {
 		res = varcache_apply(server, client, &varchange);
@@ -939,6 +1302,7 @@ bool find_server(PgSocket *client)
 
 	/* link or send to waiters list */
 	if (server) {
+		PGB_PROBE3(find_server_hit, client, pool, server);
 		slog_noise(client, "linking client to S-%p", server);
 		client->link = server;
 		server->link = client;
@@ -954,6 +1318,7 @@ bool find_server(PgSocket *client)
 			res = true;
 		}
 	} else {
+		PGB_PROBE2(find_server_miss, client, pool);
 		pause_client(client);
 		res = false;
 	}
@@ -1009,8 +1374,6 @@ bool queue_fake_response(PgSocket *client, char request_type)
  */
 bool add_outstanding_request(PgSocket *client, char type, ResponseAction action)
 {
-	OutstandingRequest *request = NULL;
-
 	PgSocket *server = client->link;
 	Assert(server);
 
@@ -1028,17 +1391,80 @@ bool add_outstanding_request(PgSocket *client, char type, ResponseAction action)
 		return queue_fake_response(client, type);
 	}
 
+	if (!add_server_outstanding_request(server, type, action))
+		return false;
+	slog_noise(client, "add_outstanding_request: added %c, still outstanding %d",
+		   type, statlist_count(&client->link->outstanding_requests));
+	return true;
+}
+
+/*
+ * Get an entry for server->outstanding_requests.  Each server gets a block
+ * of OUTSTANDING_REQUEST_SLOTS entries with its first request, which is
+ * enough for a simple query or a normal extended protocol pipeline, so
+ * those do not hit the allocator once the connection is in use.  Deeper
+ * pipelines overflow into outstanding_request_cache.
+ */
+static OutstandingRequest *alloc_outstanding_request(PgSocket *server)
+{
+	OutstandingRequest *request;
+	int i;
+
+	if (!server->request_slots) {
+		server->request_slots = slab_alloc(request_slots_cache);
+		if (server->request_slots)
+			charge_socket_mem(server, sizeof(OutstandingRequest) * OUTSTANDING_REQUEST_SLOTS);
+	}
+
+	if (server->request_slots && server->request_slots_used != (1 << OUTSTANDING_REQUEST_SLOTS) - 1) {
+		for (i = 0; i < OUTSTANDING_REQUEST_SLOTS; i++) {
+			if (!(server->request_slots_used & (1 << i)))
+				break;
+		}
+		server->request_slots_used |= 1 << i;
+		request = &server->request_slots[i];
+		memset(request, 0, sizeof(*request));
+		return request;
+	}
+
 	request = slab_alloc(outstanding_request_cache);
+	if (request)
+		charge_socket_mem(server, sizeof(*request));
+	return request;
+}
+
+/*
+ * Same for requests that pgbouncer sends to the server by itself, without
+ * a client being involved.  RA_FAKE makes no sense here.
+ */
+bool add_server_outstanding_request(PgSocket *server, char type, ResponseAction action)
+{
+	OutstandingRequest *request;
+
+	Assert(action != RA_FAKE);
+
+	request = alloc_outstanding_request(server);
 	if (request == NULL)
 		return false;
 	request->type = type;
 	request->action = action;
 	statlist_append(&server->outstanding_requests, &request->node);
-	slog_noise(client, "add_outstanding_request: added %c, still outstanding %d",
-		   type, statlist_count(&client->link->outstanding_requests));
 	return true;
 }
 
+/* give back a request that was taken off server->outstanding_requests */
+void free_outstanding_request(PgSocket *server, OutstandingRequest *request)
+{
+	OutstandingRequest *slots = server->request_slots;
+
+	if (slots && request >= slots && request < slots + OUTSTANDING_REQUEST_SLOTS) {
+		server->request_slots_used &= ~(1 << (request - slots));
+		return;
+	}
+	charge_socket_mem(server, -(ssize_t)sizeof(*request));
+	slab_free(outstanding_request_cache, request);
+}
+
 /*
  * If the next outstanding request is of one of the given types, pop it off the
  * queue. If it is of a different type, don't do anything.
@@ -1073,7 +1499,7 @@ bool pop_outstanding_request(PgSocket *server, char *types, bool *skip)
 	if (request->server_ps != NULL) {
 		free_server_prepared_statement(request->server_ps);
 	}
-	slab_free(outstanding_request_cache, request);
+	free_outstanding_request(server, request);
 	return true;
 }
 
@@ -1107,7 +1533,7 @@ bool clear_outstanding_requests_until(PgSocket *server, char *types)
 				   HASH_COUNT(server->server_prepared_statements));
 		}
 		statlist_remove(&server->outstanding_requests, item);
-		slab_free(outstanding_request_cache, request);
+		free_outstanding_request(server, request);
 
 		if (strchr(types, type))
 			break;
@@ -1116,20 +1542,6 @@ bool clear_outstanding_requests_until(PgSocket *server, char *types)
 	return true;
 }
 
-/* send reset query */
-static bool reset_on_release(PgSocket *server)
-{
-	bool res;
-
-	Assert(server->state == SV_TESTED);
-
-	slog_debug(server, "resetting: %s", cf_server_reset_query);
-	SEND_generic(res, server, 'Q', "s", cf_server_reset_query);
-	if (!res)
-		disconnect_server(server, false, "reset query failed");
-	return res;
-}
-
 bool life_over(PgSocket *server)
 {
 	PgPool *pool = server->pool;
@@ -1162,22 +1574,34 @@ bool release_server(PgSocket *server)
 	PgPool *pool = server->pool;
 	SocketState newstate = SV_IDLE;
 	struct List *cancel_item, *tmp;
+	bool pinned = false;
 
 	Assert(server->ready);
 
+	PGB_PROBE3(release_server, server, pool, server->link);
+
 	/* remove from old list */
 	switch (server->state) {
 	case SV_BEING_CANCELED:
 	case SV_ACTIVE:
+		if (server->salvaging) {
+			slog_debug(server, "release_server: salvaged after client disconnect");
+			server->salvaging = false;
+		}
 		if (server->link) {
-			server->link->link = NULL;
+			PgSocket *client = server->link;
+			pinned = client->pinned;
+			client->pinned = false;
+			client->link = NULL;
 			server->link = NULL;
+			/* client is idle again */
+			update_socket_timer(client);
 		}
 
-		if (*cf_server_reset_query && (cf_server_reset_query_always ||
+		if (*cf_server_reset_query && (cf_server_reset_query_always || pinned ||
 					       connection_pool_mode(server) == POOL_SESSION)) {
 			/* notify reset is required */
-			newstate = SV_TESTED;
+			newstate = reset_on_release_state(server);
 		} else if (cf_server_check_delay == 0 && *cf_server_check_query) {
 			/*
 			 * deprecated: before reset_query, the check_delay = 0
@@ -1313,6 +1737,8 @@ void disconnect_server(PgSocket *server, bool send_term, const char *reason, ...
 	va_end(ap);
 	reason = buf;
 
+	PGB_PROBE3(disconnect_server, server, server->pool, reason);
+
 	if (cf_log_disconnections) {
 		slog_info(server, "closing because: %s (age=%" PRIu64 "s)", reason,
 			  (now - server->connect_time) / USEC);
@@ -1373,7 +1799,8 @@ void disconnect_server(PgSocket *server, bool send_term, const char *reason, ...
 		server->dns_token = NULL;
 	}
 
-	free_scram_state(&server->scram_state);
+	release_scram_state(server);
+	set_socket_mem_pool(server, NULL);
 
 	server->pool->db->connection_count--;
 	if (server->pool->user_credentials)
@@ -1462,6 +1889,10 @@ void disconnect_client_sqlstate(PgSocket *client, bool notify, const char *sqlst
 				server->link = NULL;
 				client->link = NULL;
 				disconnect_server(server, true, "client disconnect before everything was sent to the server");
+			} else if (client->pinned && !*cf_server_reset_query) {
+				server->link = NULL;
+				client->link = NULL;
+				disconnect_server(server, true, "pinned client disconnected, no server_reset_query to clean up");
 			} else {
 				/* retval does not matter here */
 				release_server(server);
@@ -1533,9 +1964,10 @@ void disconnect_client_sqlstate(PgSocket *client, bool notify, const char *sqlst
 		send_pooler_error(client, false, sqlstate, true, reason);
 	}
 
-	free_header(&client->packet_cb_state.pkt);
-	free_scram_state(&client->scram_state);
+	free_buffered_packet(client);
+	release_scram_state(client);
 	if (client->login_user_credentials && client->login_user_credentials->mock_auth) {
+		clear_credentials(client->login_user_credentials);
 		free(client->login_user_credentials);
 		client->login_user_credentials = NULL;
 	}
@@ -1547,6 +1979,12 @@ void disconnect_client_sqlstate(PgSocket *client, bool notify, const char *sqlst
 	free(client->startup_options);
 	client->startup_options = NULL;
 
+	if (client->mem_throttled) {
+		client->mem_throttled = false;
+		client->pool->mem_throttled_count--;
+	}
+	set_socket_mem_pool(client, NULL);
+
 	change_client_state(client, CL_JUSTFREE);
 	if (!sbuf_close(&client->sbuf))
 		log_noise("sbuf_close failed, retry later");
@@ -1715,6 +2153,13 @@ PgSocket *compare_connections_by_time(PgSocket *lhs, PgSocket *rhs)
 	return lhs->request_time < rhs->request_time ? lhs : rhs;
 }
 
+/* close an idle server to make room, the victim's pool notes for whom */
+static void evict_server(PgSocket *server, const char *what)
+{
+	record_pool_event(server->pool, PEV_EVICT, server, what);
+	disconnect_server(server, true, "evicted");
+}
+
 /* evict the single most idle connection from among all pools to make room in the db */
 bool evict_connection(PgDatabase *db)
 {
@@ -1735,7 +2180,7 @@ bool evict_connection(PgDatabase *db)
 	}
 
 	if (oldest_connection) {
-		disconnect_server(oldest_connection, true, "evicted");
+		evict_server(oldest_connection, "database");
 		return true;
 	}
 	return false;
@@ -1749,7 +2194,7 @@ bool evict_pool_connection(PgPool *pool)
 	oldest_connection = compare_connections_by_time(oldest_connection, last_socket(&pool->idle_server_list));
 
 	if (oldest_connection) {
-		disconnect_server(oldest_connection, true, "evicted");
+		evict_server(oldest_connection, "pool");
 		return true;
 	}
 	return false;
@@ -1776,7 +2221,7 @@ bool evict_user_connection(PgCredentials *user_credentials)
 	}
 
 	if (oldest_connection) {
-		disconnect_server(oldest_connection, true, "evicted");
+		evict_server(oldest_connection, "user");
 		return true;
 	}
 	return false;
@@ -1917,6 +2362,7 @@ force_new:
 
 	/* initialize it */
 	server->pool = pool;
+	set_socket_mem_pool(server, pool);
 	server->login_user_credentials = server->pool->user_credentials;
 	server->connect_time = get_cached_time();
 	statlist_init(&server->canceling_clients, "canceling_clients");
@@ -1926,6 +2372,7 @@ force_new:
 	if (pool->user_credentials)
 		pool->user_credentials->global_user->connection_count++;
 
+	PGB_PROBE2(launch_new_connection, pool, server);
 	dns_connect(server);
 }
 
@@ -1959,6 +2406,7 @@ PgSocket *accept_client(int sock, bool is_unix)
 		return NULL;
 	}
 
+	PGB_PROBE2(client_accept, client, sock);
 	return client;
 }
 
@@ -2005,6 +2453,7 @@ bool finish_client_login(PgSocket *client)
 		return false;
 
 	slog_debug(client, "logged in");
+	PGB_PROBE3(client_login, client, client->db->name, client->login_user_credentials->name);
 
 	return true;
 }
@@ -2170,6 +2619,41 @@ found:
 	launch_new_connection(pool, /* evict_if_needed= */ true);
 }
 
+/*
+ * Cancel the query running on the server on behalf of pgbouncer itself.
+ * A cancel request without a connection of its own is queued the same
+ * way as one received from a client.
+ */
+bool cancel_server_query(PgSocket *server)
+{
+	PgSocket *client = server->link;
+	PgSocket *req;
+
+	req = slab_alloc(client_cache);
+	if (!req)
+		return false;
+
+	/* for logging, the addresses of the client if there still is one */
+	req->connect_time = req->request_time = get_cached_time();
+	if (client) {
+		req->remote_addr = client->remote_addr;
+		req->local_addr = client->local_addr;
+	} else {
+		req->remote_addr = server->local_addr;
+		req->local_addr = server->local_addr;
+	}
+	change_client_state(req, CL_LOGIN);
+
+	req->canceled_server = server;
+	statlist_append(&server->canceling_clients, &req->cancel_head);
+
+	req->pool = server->pool;
+	change_client_state(req, CL_WAITING_CANCEL);
+
+	launch_new_connection(server->pool, /* evict_if_needed= */ true);
+	return true;
+}
+
 bool forward_cancel_request(PgSocket *server)
 {
 	bool res;
@@ -2208,6 +2692,7 @@ bool forward_cancel_request(PgSocket *server)
 		return false;
 	}
 	slog_debug(req, "started sending cancel request");
+	PGB_PROBE3(forward_cancel_request, req, server, forwarding_to_peer);
 	change_client_state(req, CL_ACTIVE_CANCEL);
 	return true;
 }
@@ -2239,8 +2724,8 @@ bool use_client_socket(int fd, PgAddr *addr,
 			log_error("incomplete SCRAM key data");
 			return false;
 		}
-		if (sizeof(credentials->scram_ClientKey) != scram_client_key_len
-		    || sizeof(credentials->scram_ServerKey) != scram_server_key_len) {
+		if (sizeof(credentials->scram_keys->ClientKey) != scram_client_key_len
+		    || sizeof(credentials->scram_keys->ServerKey) != scram_server_key_len) {
 			log_error("incompatible SCRAM key data");
 			return false;
 		}
@@ -2259,9 +2744,9 @@ bool use_client_socket(int fd, PgAddr *addr,
 		if (!credentials)
 			return false;
 
-		memcpy(credentials->scram_ClientKey, scram_client_key, sizeof(credentials->scram_ClientKey));
-		memcpy(credentials->scram_ServerKey, scram_server_key, sizeof(credentials->scram_ServerKey));
-		credentials->has_scram_keys = true;
+		if (!set_credentials_scram_keys(credentials, (const uint8_t *)scram_client_key,
+						(const uint8_t *)scram_server_key))
+			return false;
 	}
 
 	client = accept_client(fd, pga_is_unix(addr));
@@ -2339,6 +2824,7 @@ bool use_server_socket(int fd, PgAddr *addr,
 
 	server->suspended = true;
 	server->pool = pool;
+	set_socket_mem_pool(server, pool);
 	server->login_user_credentials = credentials;
 	server->connect_time = server->request_time = get_cached_time();
 	server->query_start = 0;
@@ -2436,6 +2922,7 @@ static void for_each_server_filtered(PgPool *pool, void (*func)(PgSocket *sk), b
 static void tag_dirty(PgSocket *sk)
 {
 	sk->close_needed = true;
+	update_socket_timer(sk);
 }
 
 void tag_pool_dirty(PgPool *pool)
@@ -2620,6 +3107,9 @@ void objects_cleanup(void)
 	user_cache = NULL;
 	slab_destroy(credentials_cache);
 	credentials_cache = NULL;
+	if (credentials_strings)
+		strpool_free(credentials_strings);
+	credentials_strings = NULL;
 	slab_destroy(iobuf_cache);
 	iobuf_cache = NULL;
 	slab_destroy(outstanding_request_cache);
@@ -2628,4 +3118,8 @@ void objects_cleanup(void)
 	var_list_cache = NULL;
 	slab_destroy(server_prepared_statement_cache);
 	server_prepared_statement_cache = NULL;
+	slab_destroy(scram_state_cache);
+	scram_state_cache = NULL;
+	slab_destroy(request_slots_cache);
+	request_slots_cache = NULL;
 }
@@ -281,7 +281,10 @@ static void pam_auth_finish(struct pam_auth_request *request)
 	bool authenticated = (request->status == PAM_STATUS_SUCCESS);
 
 	if (authenticated) {
-		safe_strcpy(client->login_user_credentials->passwd, request->password, sizeof(client->login_user_credentials->passwd));
+		if (!set_credentials_passwd(client->login_user_credentials, request->password)) {
+			disconnect_client(client, true, "out of memory");
+			return;
+		}
 		sbuf_continue(&client->sbuf);
 	} else {
 		disconnect_client(client, true, "PAM authentication failed");
@@ -120,6 +120,9 @@ bool pktbuf_send_immediate(PktBuf *buf, PgSocket *sk)
 
 	if (buf->failed)
 		return false;
+	/* must not overtake result data still spooled for a client */
+	if (sbuf_spool_len(&sk->sbuf) > 0)
+		return sbuf_spool_write(&sk->sbuf, pos, amount);
 	res = sbuf_op_send(&sk->sbuf, pos, amount);
 	if (res < 0) {
 		log_debug("pktbuf_send_immediate: %s", strerror(errno));
@@ -133,6 +136,7 @@ static void pktbuf_send_func(evutil_socket_t fd, short flags, void *arg)
 	SBuf *sbuf = &buf->queued_dst->sbuf;
 	int amount, res;
 
+	loop_callback(LOOP_CB_OTHER);
 	log_debug("pktbuf_send_func(%" PRId64 ", %d, %p)", (int64_t)fd, (int)flags, buf);
 
 	if (buf->failed)
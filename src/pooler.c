@@ -299,6 +299,7 @@ void pooler_tune_accept(bool on)
 
 static void err_wait_func(evutil_socket_t sock, short flags, void *arg)
 {
+	loop_callback(LOOP_CB_ACCEPT);
 	if (cf_pause_mode != P_SUSPEND)
 		resume_pooler();
 }
@@ -342,6 +343,8 @@ static void pool_accept(evutil_socket_t sock, short flags, void *arg)
 	socklen_t len = sizeof(raddr);
 	bool is_unix = pga_is_unix(&ls->addr);
 
+	loop_callback(LOOP_CB_ACCEPT);
+
 	if (!(flags & EV_READ)) {
 		log_warning("no EV_READ in pool_accept");
 		return;
@@ -96,6 +96,12 @@ static PgClientPreparedStatement *create_client_prepared_statement(char const *n
 	return client_ps;
 }
 
+/* bytes a client's cache entry is charged to the pool with */
+static ssize_t client_prepared_statement_size(PgClientPreparedStatement *client_ps)
+{
+	return sizeof(PgClientPreparedStatement) + strlen(client_ps->stmt_name) + 1;
+}
+
 /*
  * Creates a PgServerPreparedStatement from a PgPreparedStatement. The
  * PgClientPreparedStatement can be stored inside the server its prepared
@@ -202,6 +208,7 @@ void unregister_prepared_statement(PgSocket *server, uint64_t query_id)
 	HASH_FIND_UINT64(server->server_prepared_statements, &query_id, server_ps);
 	if (server_ps) {
 		HASH_DEL(server->server_prepared_statements, server_ps);
+		charge_socket_mem(server, -(ssize_t)sizeof(*server_ps));
 		free_server_prepared_statement(server_ps);
 	}
 }
@@ -216,6 +223,7 @@ bool add_prepared_statement(PgSocket *server, PgServerPreparedStatement *server_
 		uthash_alloc_failed = false;
 		return false;
 	}
+	charge_socket_mem(server, sizeof(*server_ps));
 	return true;
 }
 
@@ -284,6 +292,7 @@ static bool register_prepared_statement(PgSocket *client, PgSocket *server, PgSe
 		 */
 		slog_noise(server, "prepared statement '%s' deleted from server cache", current->ps->stmt_name);
 		HASH_DEL(server->server_prepared_statements, current);
+		charge_socket_mem(server, -(ssize_t)sizeof(*current));
 	}
 
 	return true;
@@ -347,6 +356,7 @@ bool handle_parse_command(PgSocket *client, PktHdr *pkt)
 		uthash_alloc_failed = false;
 		goto oom;
 	}
+	charge_socket_mem(client, client_prepared_statement_size(client_ps));
 
 	if (found) {
 		/* Such query was already prepared */
@@ -672,6 +682,7 @@ bool handle_close_statement_command(PgSocket *client, PktHdr *pkt, PgClosePacket
 	if (client_ps) {
 		slog_noise(client, "handle_close_command: removed '%s' from cached prepared statements, items remaining %u", close_packet->name, HASH_COUNT(client->client_prepared_statements));
 		HASH_DEL(client->client_prepared_statements, client_ps);
+		charge_socket_mem(client, -client_prepared_statement_size(client_ps));
 		if (--client_ps->ps->use_count == 0) {
 			HASH_DEL(prepared_statements, client_ps->ps);
 			free(client_ps->ps);
@@ -702,6 +713,7 @@ void free_client_prepared_statements(PgSocket *client)
 
 	HASH_ITER(hh, client->client_prepared_statements, client_ps, tmp) {
 		HASH_DEL(client->client_prepared_statements, client_ps);
+		charge_socket_mem(client, -client_prepared_statement_size(client_ps));
 		if (--client_ps->ps->use_count == 0) {
 			HASH_DEL(prepared_statements, client_ps->ps);
 			free(client_ps->ps);
@@ -722,6 +734,7 @@ void free_server_prepared_statements(PgSocket *server)
 
 	HASH_ITER(hh, server->server_prepared_statements, current, tmp_s) {
 		HASH_DEL(server->server_prepared_statements, current);
+		charge_socket_mem(server, -(ssize_t)sizeof(*current));
 		free_server_prepared_statement(current);
 	}
 
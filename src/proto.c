@@ -136,6 +136,39 @@ bool get_header(struct MBuf *data, PktHdr *pkt)
 	return mbuf_get_bytes(&pkt->data, got, &ptr);
 }
 
+/*
+ * Number of bytes in the run of packets with one of the given types at
+ * the start of data.  This is for packets the pooler does not look into,
+ * so they can be forwarded without parsing them one by one.  The last
+ * packet in the run may be incomplete, but its header is always in the
+ * buffer.
+ */
+unsigned pkt_run_len(const struct MBuf *data, const char *types)
+{
+	const uint8_t *buf = data->data + data->read_pos;
+	unsigned avail = mbuf_avail_for_read(data);
+	unsigned pos = 0;
+	uint32_t len;
+
+	while (pos < avail && avail - pos >= NEW_HEADER_LEN) {
+		const uint8_t *hdr = buf + pos;
+
+		if (hdr[0] == 0 || strchr(types, hdr[0]) == NULL)
+			break;
+
+		/* wire length does not include type byte */
+		len = ((uint32_t)hdr[1] << 24) | ((uint32_t)hdr[2] << 16)
+		      | ((uint32_t)hdr[3] << 8) | hdr[4];
+		len++;
+
+		/* let get_header() complain about nonsense */
+		if (len < NEW_HEADER_LEN || len > (uint32_t)cf_max_packet_size)
+			break;
+		pos += len;
+	}
+	return pos;
+}
+
 
 /*
  * Send error message packet to client.
@@ -354,7 +387,8 @@ static bool login_clear_psw(PgSocket *server)
 
 static bool login_md5_psw(PgSocket *server, const uint8_t *salt)
 {
-	char txt[MD5_PASSWD_LEN + 1], *src;
+	char txt[MD5_PASSWD_LEN + 1];
+	const char *src;
 	PgCredentials *credentials = get_srv_psw(server);
 
 	slog_debug(server, "P: send md5 password");
@@ -391,7 +425,7 @@ static bool login_scram_sha_256(PgSocket *server)
 		/* ok */
 		break;
 	case PASSWORD_TYPE_SCRAM_SHA_256:
-		if (!credentials->has_scram_keys) {
+		if (!credentials->scram_keys) {
 			slog_error(server, "cannot do SCRAM authentication: password is SCRAM secret but client authentication did not provide SCRAM keys");
 			kill_pool_logins(server->pool, NULL, "server login failed: wrong password type");
 			return false;
@@ -403,12 +437,15 @@ static bool login_scram_sha_256(PgSocket *server)
 		return false;
 	}
 
-	if (server->scram_state.client_nonce) {
+	if (server->scram_state && server->scram_state->client_nonce) {
 		slog_error(server, "protocol error: duplicate AuthenticationSASL message from server");
 		return false;
 	}
 
-	client_first_message = build_client_first_message(&server->scram_state);
+	if (!alloc_scram_state(server))
+		return false;
+
+	client_first_message = build_client_first_message(server->scram_state);
 	if (!client_first_message)
 		return false;
 
@@ -432,12 +469,12 @@ static bool login_scram_sha_256_cont(PgSocket *server, unsigned datalen, const u
 	bool res;
 	char *client_final_message = NULL;
 
-	if (!server->scram_state.client_nonce) {
+	if (!server->scram_state || !server->scram_state->client_nonce) {
 		slog_error(server, "protocol error: AuthenticationSASLContinue without prior AuthenticationSASL");
 		return false;
 	}
 
-	if (server->scram_state.server_first_message) {
+	if (server->scram_state->server_first_message) {
 		slog_error(server, "SCRAM exchange protocol error: received second AuthenticationSASLContinue");
 		return false;
 	}
@@ -454,7 +491,7 @@ static bool login_scram_sha_256_cont(PgSocket *server, unsigned datalen, const u
 				       &server_nonce, &salt, &saltlen, &iterations))
 		goto failed;
 
-	client_final_message = build_client_final_message(&server->scram_state,
+	client_final_message = build_client_final_message(server->scram_state,
 							  credentials, server_nonce,
 							  salt, saltlen, iterations);
 
@@ -481,7 +518,7 @@ static bool login_scram_sha_256_final(PgSocket *server, unsigned datalen, const
 	char *input;
 	char ServerSignature[SHA256_DIGEST_LENGTH];
 
-	if (!server->scram_state.server_first_message) {
+	if (!server->scram_state || !server->scram_state->server_first_message) {
 		slog_error(server, "protocol error: AuthenticationSASLFinal without prior AuthenticationSASLContinue");
 		return false;
 	}
@@ -497,7 +534,7 @@ static bool login_scram_sha_256_final(PgSocket *server, unsigned datalen, const
 	if (!read_server_final_message(server, input, ServerSignature))
 		goto failed;
 
-	if (!verify_server_signature(&server->scram_state, credentials, ServerSignature)) {
+	if (!verify_server_signature(server->scram_state, credentials, ServerSignature)) {
 		slog_error(server, "invalid server signature");
 		kill_pool_logins(server->pool, NULL, "server login failed: invalid server signature");
 		goto failed;
@@ -586,7 +623,7 @@ bool answer_authreq(PgSocket *server, PktHdr *pkt)
 		if (!mbuf_get_bytes(&pkt->data, len, &data))
 			return false;
 		res = login_scram_sha_256_final(server, len, data);
-		free_scram_state(&server->scram_state);
+		release_scram_state(server);
 		break;
 	}
 	default:
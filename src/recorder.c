@@ -0,0 +1,225 @@
+/*
+ * PgBouncer - Lightweight connection pooler for PostgreSQL.
+ *
+ * Copyright (c) 2007-2009  Marko Kreen, Skype Technologies OÜ
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per-pool flight recorder.
+ *
+ * Recording an event is a few stores into a ring allocated with the
+ * first event, so it can stay on.  Times come from the cached loop
+ * time, events of one loop iteration share it.
+ */
+
+#include "bouncer.h"
+
+#include <usual/time.h>
+
+static const char *const state_names[] = {
+	[CL_FREE] = "free",
+	[CL_JUSTFREE] = "justfree",
+	[CL_LOGIN] = "login",
+	[CL_WAITING] = "waiting",
+	[CL_WAITING_LOGIN] = "waiting_login",
+	[CL_ACTIVE] = "active",
+	[CL_WAITING_CANCEL] = "waiting_cancel",
+	[CL_ACTIVE_CANCEL] = "active_cancel",
+	[SV_FREE] = "free",
+	[SV_JUSTFREE] = "justfree",
+	[SV_LOGIN] = "login",
+	[SV_BEING_CANCELED] = "being_canceled",
+	[SV_IDLE] = "idle",
+	[SV_ACTIVE] = "active",
+	[SV_ACTIVE_CANCEL] = "active_cancel",
+	[SV_USED] = "used",
+	[SV_TESTED] = "tested",
+};
+
+static const char *const event_names[] = {
+	[PEV_CLIENT_STATE] = "client",
+	[PEV_SERVER_STATE] = "server",
+	[PEV_EVICT] = "evict",
+	[PEV_TIMEOUT] = "timeout",
+};
+
+/* (re)allocate the ring if pool_event_history changed, drops old events */
+static bool alloc_event_log(PgPool *pool)
+{
+	struct PoolEventLog *log;
+
+	free(pool->events);
+	pool->events = NULL;
+	if (cf_pool_event_history <= 0)
+		return false;
+
+	log = malloc(offsetof(struct PoolEventLog, ev) + cf_pool_event_history * sizeof(struct PoolEvent));
+	if (!log)
+		return false;
+	log->size = cf_pool_event_history;
+	log->next = 0;
+	log->count = 0;
+	pool->events = log;
+	return true;
+}
+
+static void record(PgPool *pool, enum PoolEventType type, const PgSocket *sk,
+		   int from, int to, const char *what)
+{
+	struct PoolEventLog *log = pool->events;
+	struct PoolEvent *ev;
+
+	if (!log || log->size != (uint32_t)cf_pool_event_history) {
+		if (!log && cf_pool_event_history <= 0)
+			return;
+		if (!alloc_event_log(pool))
+			return;
+		log = pool->events;
+	}
+
+	ev = &log->ev[log->next];
+	if (++log->next == log->size)
+		log->next = 0;
+	log->count++;
+
+	ev->time = get_cached_time();
+	ev->sk = sk;
+	ev->what = what;
+	ev->type = type;
+	ev->from = from;
+	ev->to = to;
+}
+
+/*
+ * Called before the state changes.  Moves to the free lists are left
+ * out: at that point the pool may be gone already.
+ */
+void record_state_change(PgSocket *sk, SocketState newstate)
+{
+	if (!sk->pool || newstate == CL_FREE || newstate == SV_FREE)
+		return;
+	record(sk->pool, is_server_socket(sk) ? PEV_SERVER_STATE : PEV_CLIENT_STATE,
+	       sk, sk->state, newstate, NULL);
+}
+
+void record_pool_event(PgPool *pool, enum PoolEventType type, const PgSocket *sk, const char *what)
+{
+	record(pool, type, sk, 0, 0, what);
+}
+
+void free_pool_events(PgPool *pool)
+{
+	free(pool->events);
+	pool->events = NULL;
+}
+
+/* n-th event still in the ring, oldest first */
+static const struct PoolEvent *oldest_event(const struct PoolEventLog *log, uint32_t n)
+{
+	uint32_t start = log->count < log->size ? 0 : log->next;
+
+	return &log->ev[(start + n) % log->size];
+}
+
+static uint32_t event_count(const struct PoolEventLog *log)
+{
+	return log->count < log->size ? log->count : log->size;
+}
+
+static const char *event_detail(const struct PoolEvent *ev, char *buf, size_t buflen)
+{
+	switch (ev->type) {
+	case PEV_CLIENT_STATE:
+	case PEV_SERVER_STATE:
+		snprintf(buf, buflen, "%s -> %s", state_names[ev->from], state_names[ev->to]);
+		return buf;
+	default:
+		return ev->what;
+	}
+}
+
+bool admin_pool_events(PgSocket *admin, const char *dbname)
+{
+	const struct PoolEvent *ev;
+	struct List *item;
+	PgPool *pool;
+	PktBuf *buf;
+	char timebuf[64], ptrbuf[32], detail[64];
+	bool found = false;
+	uint32_t i, n;
+
+	buf = pktbuf_dynamic(1024);
+	if (!buf) {
+		admin_error(admin, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "ssssss", "database", "user", "time",
+				    "event", "ptr", "detail");
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		if (dbname && *dbname && strcmp(pool->db->name, dbname) != 0)
+			continue;
+		found = true;
+		if (!pool->events)
+			continue;
+
+		n = event_count(pool->events);
+		for (i = 0; i < n; i++) {
+			ev = oldest_event(pool->events, i);
+			format_time_ms(ev->time, timebuf, sizeof(timebuf));
+			snprintf(ptrbuf, sizeof(ptrbuf), "%p", ev->sk);
+			pktbuf_write_DataRow(buf, "ssssss", pool->db->name,
+					     pool->user_credentials->name, timebuf,
+					     event_names[ev->type], ptrbuf,
+					     event_detail(ev, detail, sizeof(detail)));
+		}
+	}
+
+	if (dbname && *dbname && !found) {
+		pktbuf_free(buf);
+		admin_error(admin, "no such database: %s", dbname);
+		return true;
+	}
+	admin_flush(admin, buf, "SHOW");
+
+	return true;
+}
+
+/* write all recorded events into the log, on SIGWINCH */
+void log_pool_events(void)
+{
+	const struct PoolEvent *ev;
+	struct List *item;
+	PgPool *pool;
+	char timebuf[64], detail[64];
+	uint32_t i, n;
+
+	statlist_for_each(item, &pool_list) {
+		pool = container_of(item, PgPool, head);
+		if (!pool->events)
+			continue;
+
+		n = event_count(pool->events);
+		for (i = 0; i < n; i++) {
+			ev = oldest_event(pool->events, i);
+			format_time_ms(ev->time, timebuf, sizeof(timebuf));
+			log_info("event %s/%s: %s %s %p %s",
+				 pool->db->name, pool->user_credentials->name, timebuf,
+				 event_names[ev->type], ev->sk,
+				 event_detail(ev, detail, sizeof(detail)));
+		}
+	}
+}
@@ -34,6 +34,17 @@
 #define USE_TLS
 #endif
 
+/* Linux kernel TLS, record encryption done by the kernel */
+#if defined(USE_TLS) && defined(HAVE_LINUX_TLS_H)
+#include <linux/tls.h>
+#ifdef TLS_TX
+#define USE_KTLS
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+#endif
+
 /* sbuf_main_loop() skip_recv values */
 #define DO_RECV         false
 #define SKIP_RECV       true
@@ -58,6 +69,19 @@ enum WaitType {
 	W_ONCE
 };
 
+/*
+ * Data that was meant for this socket but could not be written yet.  It
+ * is taken over from the sending socket so that one can go on, e.g. a
+ * server connection can be released while a slow client still reads the
+ * end of the result.  Anything sent to this socket later must go after
+ * the spooled data.
+ */
+struct SBufSpool {
+	struct MBuf data;
+	struct event ev;	/* waits until the socket is writable */
+	bool waiting;
+};
+
 #define AssertSanity(sbuf) do { \
 		Assert(iobuf_sane((sbuf)->io)); \
 } while (0)
@@ -76,11 +100,16 @@ static void sbuf_recv_cb(evutil_socket_t sock, short flags, void *arg);
 static void sbuf_send_cb(evutil_socket_t sock, short flags, void *arg);
 static void sbuf_try_resync(SBuf *sbuf, bool release);
 static bool sbuf_wait_for_data(SBuf *sbuf) _MUSTCHECK;
+static bool sbuf_wait_for_data_forced(SBuf *sbuf) _MUSTCHECK;
 static void sbuf_main_loop(SBuf *sbuf, bool skip_recv);
 static bool sbuf_call_proto(SBuf *sbuf, int event) /* _MUSTCHECK */;
 static bool sbuf_actual_recv(SBuf *sbuf, size_t len)  _MUSTCHECK;
 static bool sbuf_after_connect_check(SBuf *sbuf)  _MUSTCHECK;
 static bool handle_tls_handshake(SBuf *sbuf) _MUSTCHECK;
+static bool sbuf_send_spool(SBuf *sbuf) _MUSTCHECK;
+static void sbuf_free_spool(SBuf *sbuf);
+static void sbuf_update_mem(SBuf *sbuf);
+static void sbuf_loop_callback(SBuf *sbuf);
 
 /* regular I/O */
 static ssize_t raw_sbufio_recv(struct SBuf *sbuf, void *dst, size_t len);
@@ -321,6 +350,8 @@ bool sbuf_close(SBuf *sbuf)
 		sbuf->io = NULL;
 	}
 	mbuf_free(&sbuf->extra_packets);
+	sbuf_free_spool(sbuf);
+	sbuf_update_mem(sbuf);
 	return true;
 }
 
@@ -337,6 +368,42 @@ void sbuf_prepare_send(SBuf *sbuf, SBuf *dst, unsigned amount)
 	sbuf->dst = dst;
 }
 
+/* proto_fn tells to send more bytes the same way as the current packet */
+void sbuf_extend_send(SBuf *sbuf, unsigned amount)
+{
+	AssertActive(sbuf);
+	Assert(sbuf->pkt_action == ACT_SEND);
+	Assert(amount > 0);
+
+	sbuf->pkt_remain += amount;
+}
+
+/*
+ * The destination went away.  Drop what was still to be sent to it, skip
+ * the rest of the current packet and go back to reading.  Not to be
+ * called from inside the sbuf's own callbacks.
+ */
+bool sbuf_drop_dst(SBuf *sbuf)
+{
+	IOBuf *io = sbuf->io;
+
+	AssertActive(sbuf);
+	Assert(mbuf_avail_for_read(&sbuf->extra_packets) == 0);
+
+	if (io)
+		io->done_pos = io->parse_pos;
+	if (sbuf->pkt_action == ACT_SEND) {
+		sbuf->pkt_action = ACT_SKIP;
+		sbuf->skip_remain = sbuf->pkt_remain;
+	}
+	sbuf->dst = NULL;
+
+	/* was waiting for the destination to become writable */
+	if (sbuf->wait_type == W_SEND)
+		return sbuf_wait_for_data_forced(sbuf);
+	return true;
+}
+
 /* proto_fn tells to skip some amount of bytes */
 void sbuf_prepare_skip(SBuf *sbuf, unsigned amount)
 {
@@ -423,6 +490,7 @@ bool sbuf_queue_packet(SBuf *src, SBuf *dst, PktBuf *pkt)
 	src->dst = dst;
 	res = mbuf_write(&src->extra_packets, pkt->buf, pkt->write_pos);
 	pktbuf_free(pkt);
+	sbuf_update_mem(src);
 	return res;
 }
 
@@ -458,6 +526,7 @@ bool sbuf_queue_full_packet(SBuf *src, SBuf *dst, PktHdr *pkt)
 	Assert(pkt->data.read_pos == 0);
 	src->dst = dst;
 	res = mbuf_write(&src->extra_packets, pkt->data.data, pkt->data.write_pos);
+	sbuf_update_mem(src);
 	return res;
 }
 
@@ -559,6 +628,8 @@ static void sbuf_send_cb(evutil_socket_t sock, short flags, void *arg)
 {
 	SBuf *sbuf = arg;
 	bool res;
+
+	sbuf_loop_callback(sbuf);
 	log_noise("Socket is writable again");
 
 	/* sbuf was closed before in this loop */
@@ -610,6 +681,191 @@ static bool sbuf_queue_send(SBuf *sbuf)
 	return true;
 }
 
+static void sbuf_free_spool(SBuf *sbuf)
+{
+	struct SBufSpool *spool = sbuf->spool;
+
+	if (!spool)
+		return;
+	if (spool->waiting)
+		event_del(&spool->ev);
+	mbuf_free(&spool->data);
+	free(spool);
+	sbuf->spool = NULL;
+	sbuf_update_mem(sbuf);
+}
+
+/*
+ * Write out spooled data.  Returns true if all of it went out, false
+ * with errno set otherwise.
+ */
+static bool sbuf_send_spool(SBuf *sbuf)
+{
+	struct MBuf *data;
+	unsigned avail;
+	ssize_t res;
+
+	if (!sbuf->spool)
+		return true;
+
+	data = &sbuf->spool->data;
+	while ((avail = mbuf_avail_for_read(data)) > 0) {
+		res = sbuf_op_send(sbuf, data->data + data->read_pos, avail);
+		if (res < 0)
+			return false;
+		data->read_pos += res;
+	}
+	sbuf_free_spool(sbuf);
+	return true;
+}
+
+/*
+ * Sending only advances read_pos, so while a slow reader never lets the
+ * spool run empty the already sent head would stay allocated and every
+ * write would grow the buffer.  Move the unsent tail to the front once
+ * more than half of the buffer has been sent.
+ */
+static void sbuf_compact_spool(SBuf *sbuf)
+{
+	struct MBuf *data = &sbuf->spool->data;
+	unsigned avail = mbuf_avail_for_read(data);
+
+	if (data->read_pos <= data->alloc_len / 2)
+		return;
+	memmove(data->data, data->data + data->read_pos, avail);
+	data->read_pos = 0;
+	data->write_pos = avail;
+}
+
+static bool sbuf_wait_spool(SBuf *sbuf);
+
+/* libevent EV_WRITE: socket with spooled data is writable again */
+static void sbuf_spool_cb(evutil_socket_t sock, short flags, void *arg)
+{
+	SBuf *sbuf = arg;
+
+	sbuf_loop_callback(sbuf);
+	sbuf->spool->waiting = false;
+	if (sbuf_send_spool(sbuf))
+		return;
+	if (errno == EAGAIN && sbuf_wait_spool(sbuf))
+		return;
+
+	/* the reader went away */
+	sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
+}
+
+static bool sbuf_wait_spool(SBuf *sbuf)
+{
+	struct SBufSpool *spool = sbuf->spool;
+	int err;
+
+	event_assign(&spool->ev, pgb_event_base, sbuf->sock, EV_WRITE, sbuf_spool_cb, sbuf);
+	err = event_add(&spool->ev, NULL);
+	if (err < 0) {
+		log_warning("sbuf_wait_spool: event_add failed: %s", strerror(errno));
+		return false;
+	}
+	spool->waiting = true;
+	return true;
+}
+
+/*
+ * Destination socket is full.  If the protocol handler allows it, move
+ * the pending data over to the spool of the destination, which then
+ * writes it out by itself.
+ */
+static bool sbuf_spool_pending(SBuf *sbuf)
+{
+	IOBuf *io = sbuf->io;
+	SBuf *dst = sbuf->dst;
+	unsigned avail = iobuf_amount_pending(io);
+
+	if (!sbuf_call_proto(sbuf, SBUF_EV_SPOOL))
+		return false;
+
+	if (!dst->spool) {
+		dst->spool = calloc(1, sizeof(*dst->spool));
+		if (!dst->spool)
+			return false;
+	}
+	if (!dst->spool->waiting && !sbuf_wait_spool(dst)) {
+		if (mbuf_avail_for_read(&dst->spool->data) == 0)
+			sbuf_free_spool(dst);
+		return false;
+	}
+	sbuf_compact_spool(dst);
+	if (!mbuf_write(&dst->spool->data, io->buf + io->done_pos, avail))
+		return false;
+	sbuf_update_mem(dst);
+
+	log_noise("sbuf_spool_pending: spooled %u bytes", avail);
+	io->done_pos += avail;
+	return true;
+}
+
+/* amount of data spooled for this socket */
+unsigned sbuf_spool_len(SBuf *sbuf)
+{
+	if (!sbuf->spool)
+		return 0;
+	return mbuf_avail_for_read(&sbuf->spool->data);
+}
+
+/*
+ * Add data behind what is spooled for this socket.  Only valid while the
+ * spool is not empty, it is then waiting to write and takes the new data
+ * along.
+ */
+bool sbuf_spool_write(SBuf *sbuf, const void *data, unsigned len)
+{
+	Assert(sbuf_spool_len(sbuf) > 0);
+
+	sbuf_compact_spool(sbuf);
+	if (!mbuf_write(&sbuf->spool->data, data, len))
+		return false;
+	sbuf_update_mem(sbuf);
+	return true;
+}
+
+/*
+ * Bring the charge on mem_account in line with what the buffers of this
+ * SBuf currently hold: the IOBuf, the extra_packets queue and the spool.
+ */
+static void sbuf_update_mem(SBuf *sbuf)
+{
+	size_t used = 0;
+
+	if (sbuf->io)
+		used += IOBUF_SIZE;
+	used += sbuf->extra_packets.alloc_len;
+	if (sbuf->spool)
+		used += sizeof(*sbuf->spool) + sbuf->spool->data.alloc_len;
+
+	if (sbuf->mem_account) {
+		*sbuf->mem_account -= sbuf->mem_charged;
+		*sbuf->mem_account += used;
+		if (used < sbuf->mem_charged)
+			pool_mem_released(sbuf->mem_account);
+	}
+	sbuf->mem_charged = used;
+}
+
+/*
+ * Charge the buffers of this SBuf to another counter, moving over what
+ * was charged to the previous one.  NULL stops the accounting.
+ */
+void sbuf_set_mem_account(SBuf *sbuf, size_t *account)
+{
+	if (sbuf->mem_account == account)
+		return;
+	if (sbuf->mem_account)
+		*sbuf->mem_account -= sbuf->mem_charged;
+	sbuf->mem_account = account;
+	if (account)
+		*account += sbuf->mem_charged;
+}
+
 /*
  * flush all pending data in the iobuf. This should be called before calling
  * needed before calling sbuf_queue_packet.
@@ -650,13 +906,18 @@ try_more:
 		return false;
 	}
 
-	/* actually send it */
+	/* actually send it, after anything spooled earlier */
 	//res = iobuf_send_pending(io, sbuf->dst->sock);
-	res = sbuf_op_send(sbuf->dst, io->buf + io->done_pos, avail);
+	if (sbuf_send_spool(sbuf->dst))
+		res = sbuf_op_send(sbuf->dst, io->buf + io->done_pos, avail);
+	else
+		res = -1;
 	if (res > 0) {
 		io->done_pos += res;
 	} else if (res < 0) {
 		if (errno == EAGAIN) {
+			if (sbuf_spool_pending(sbuf))
+				goto try_more;
 			if (!sbuf_queue_send(sbuf)) {
 				/* drop if queue failed */
 				sbuf_call_proto(sbuf, SBUF_EV_SEND_FAILED);
@@ -703,9 +964,12 @@ try_more:
 		return false;
 	}
 
-	/* actually send it */
+	/* actually send it, after anything spooled earlier */
 	//res = iobuf_send_pending(io, sbuf->dst->sock);
-	res = sbuf_op_send(sbuf->dst, mbuf->data + mbuf->read_pos, avail);
+	if (sbuf_send_spool(sbuf->dst))
+		res = sbuf_op_send(sbuf->dst, mbuf->data + mbuf->read_pos, avail);
+	else
+		res = -1;
 	if (res > 0) {
 		mbuf->read_pos += res;
 	} else if (res < 0) {
@@ -739,6 +1003,7 @@ static bool sbuf_process_pending(SBuf *sbuf)
 	struct MBuf *extra_packets = &sbuf->extra_packets;
 	bool full = iobuf_amount_recv(io) <= 0;
 	int loop_number = 0;
+	unsigned processed = 0;
 	log_noise("sbuf_process_pending: start");
 
 	while (1) {
@@ -774,6 +1039,7 @@ static bool sbuf_process_pending(SBuf *sbuf)
 			 */
 			if (extra_packets->alloc_len > (unsigned) cf_sbuf_len * 4) {
 				mbuf_free(extra_packets);
+				sbuf_update_mem(sbuf);
 			} else {
 				mbuf_rewind_writer(extra_packets);
 			}
@@ -840,9 +1106,11 @@ static bool sbuf_process_pending(SBuf *sbuf)
 			break;
 		}
 		sbuf->pkt_remain -= avail;
+		processed += avail;
 	}
 
 	log_noise("sbuf_process_pending: done looping");
+	PGB_PROBE3(sbuf_process_pending, sbuf, loop_number, processed);
 	if (!sbuf_send_pending_iobuf(sbuf)) {
 		log_noise("sbuf_process_pending failed to send all pending data");
 		return false;
@@ -905,6 +1173,7 @@ static void sbuf_try_resync(SBuf *sbuf, bool release)
 	if (release && iobuf_empty(io)) {
 		slab_free(iobuf_cache, io);
 		sbuf->io = NULL;
+		sbuf_update_mem(sbuf);
 	} else {
 		iobuf_try_resync(io, SBUF_SMALL_PKT);
 	}
@@ -935,9 +1204,28 @@ static bool sbuf_actual_recv(SBuf *sbuf, size_t len)
 }
 
 /* callback for libevent EV_READ */
+/*
+ * Charge an sbuf callback to the kind of socket it serves.  A socket
+ * closed earlier in this loop may have lost its pool already.
+ */
+static void sbuf_loop_callback(SBuf *sbuf)
+{
+	PgSocket *sk = container_of(sbuf, PgSocket, sbuf);
+
+	if (!sbuf->sock)
+		loop_callback(LOOP_CB_OTHER);
+	else if (is_server_socket(sk))
+		loop_callback(LOOP_CB_SERVER);
+	else if (sk->pool && sk->pool->db->admin)
+		loop_callback(LOOP_CB_ADMIN);
+	else
+		loop_callback(LOOP_CB_CLIENT);
+}
+
 static void sbuf_recv_cb(evutil_socket_t sock, short flags, void *arg)
 {
 	SBuf *sbuf = arg;
+	sbuf_loop_callback(sbuf);
 	sbuf_main_loop(sbuf, DO_RECV);
 }
 
@@ -950,6 +1238,7 @@ static bool allocate_iobuf(SBuf *sbuf)
 			return false;
 		}
 		iobuf_reset(sbuf->io);
+		sbuf_update_mem(sbuf);
 	}
 	return true;
 }
@@ -1075,6 +1364,7 @@ static void sbuf_connect_cb(evutil_socket_t sock, short flags, void *arg)
 {
 	SBuf *sbuf = arg;
 
+	sbuf_loop_callback(sbuf);
 	Assert(sbuf->wait_type == W_CONNECT || sbuf->wait_type == W_NONE);
 	sbuf->wait_type = W_NONE;
 
@@ -1146,6 +1436,12 @@ int client_accept_sslmode;
 static struct tls_config *server_connect_conf;
 int server_connect_sslmode;
 
+#ifdef HAVE_TLS_SESSION_API
+/* session id context for client connections, stable across reloads */
+static uint8_t client_tls_session_id[TLS_MAX_SESSION_ID_LENGTH];
+static bool client_tls_session_id_set;
+#endif
+
 
 /*
  * TLS setup
@@ -1235,6 +1531,59 @@ static bool setup_tls(struct tls_config *conf, const char *pfx, int sslmode,
 	return true;
 }
 
+/*
+ * The session API is only in newer libtls versions, configure checks
+ * whether libusual has it.
+ */
+#ifdef HAVE_TLS_SESSION_API
+
+static bool setup_client_tls_sessions(struct tls_config *conf)
+{
+	int lifetime = cf_client_tls_session_lifetime / USEC;
+	int err;
+
+	if (lifetime <= 0)
+		return true;
+
+	if (!client_tls_session_id_set) {
+		get_random_bytes(client_tls_session_id, sizeof client_tls_session_id);
+		client_tls_session_id_set = true;
+	}
+
+	err = tls_config_set_session_id(conf, client_tls_session_id, sizeof client_tls_session_id);
+	if (err) {
+		log_error("could not set TLS session id: %s", tls_config_error(conf));
+		return false;
+	}
+	err = tls_config_set_session_lifetime(conf, lifetime);
+	if (err) {
+		log_error("invalid client_tls_session_lifetime: %s", tls_config_error(conf));
+		return false;
+	}
+	return true;
+}
+
+bool sbuf_tls_session_resumed(SBuf *sbuf)
+{
+	return sbuf->tls && tls_conn_session_resumed(sbuf->tls) == 1;
+}
+
+#else
+
+static bool setup_client_tls_sessions(struct tls_config *conf)
+{
+	if (cf_client_tls_session_lifetime > 0)
+		log_warning("client_tls_session_lifetime is not supported by this build, ignoring");
+	return true;
+}
+
+bool sbuf_tls_session_resumed(SBuf *sbuf)
+{
+	return false;
+}
+
+#endif
+
 bool sbuf_tls_setup(void)
 {
 	int err;
@@ -1301,6 +1650,9 @@ bool sbuf_tls_setup(void)
 			       cf_client_tls_ecdhecurve, false))
 			goto failed;
 
+		if (!setup_client_tls_sessions(new_client_accept_conf))
+			goto failed;
+
 		new_client_accept_base = tls_server();
 		if (!new_client_accept_base) {
 			log_error("server_base failed");
@@ -1352,6 +1704,26 @@ failed:
  * TLS handshake
  */
 
+/*
+ * libtls has no switch for kernel TLS, but OpenSSL enables it on its own
+ * when built with kTLS support and configured with "Options = KTLS" in
+ * openssl.cnf.  It then still goes through SSL_read() and SSL_write(),
+ * which leave the record layer to the kernel.  Only report whether the
+ * kernel took over for this socket.
+ */
+static void check_ktls(SBuf *sbuf)
+{
+#ifdef USE_KTLS
+	struct tls_crypto_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(sbuf->sock, SOL_TLS, TLS_TX, &info, &len) < 0)
+		return;
+	log_noise("kernel TLS offload enabled, version=0x%04x cipher=%d",
+		  info.version, info.cipher_type);
+#endif
+}
+
 static bool handle_tls_handshake(SBuf *sbuf)
 {
 	int err;
@@ -1364,6 +1736,7 @@ static bool handle_tls_handshake(SBuf *sbuf)
 		return sbuf_use_callback_once(sbuf, EV_WRITE, sbuf_tls_handshake_cb);
 	} else if (err == 0) {
 		sbuf->tls_state = SBUF_TLS_OK;
+		check_ktls(sbuf);
 		sbuf_call_proto(sbuf, SBUF_EV_TLS_READY);
 		return true;
 	} else {
@@ -1375,6 +1748,7 @@ static bool handle_tls_handshake(SBuf *sbuf)
 static void sbuf_tls_handshake_cb(evutil_socket_t fd, short flags, void *_sbuf)
 {
 	SBuf *sbuf = _sbuf;
+	sbuf_loop_callback(sbuf);
 	sbuf->wait_type = W_NONE;
 	if (!handle_tls_handshake(sbuf))
 		sbuf_call_proto(sbuf, SBUF_EV_RECV_FAILED);
@@ -1539,6 +1913,10 @@ bool sbuf_tls_connect(SBuf *sbuf, const char *hostname)
 {
 	return false;
 }
+bool sbuf_tls_session_resumed(SBuf *sbuf)
+{
+	return false;
+}
 
 void sbuf_cleanup(void)
 {
@@ -371,16 +371,16 @@ bool read_server_first_message(PgSocket *server, char *input,
 	char *endptr;
 	int iterations;
 
-	server->scram_state.server_first_message = strdup(input);
-	if (server->scram_state.server_first_message == NULL)
+	server->scram_state->server_first_message = strdup(input);
+	if (server->scram_state->server_first_message == NULL)
 		goto failed;
 
 	server_nonce = read_attr_value(server, &input, 'r');
 	if (server_nonce == NULL)
 		goto failed;
 
-	if (strlen(server_nonce) < strlen(server->scram_state.client_nonce) ||
-	    memcmp(server_nonce, server->scram_state.client_nonce, strlen(server->scram_state.client_nonce)) != 0) {
+	if (strlen(server_nonce) < strlen(server->scram_state->client_nonce) ||
+	    memcmp(server_nonce, server->scram_state->client_nonce, strlen(server->scram_state->client_nonce)) != 0) {
 		slog_error(server, "invalid SCRAM response (nonce mismatch)");
 		goto failed;
 	}
@@ -482,8 +482,8 @@ static bool calculate_client_proof(ScramState *scram_state,
 	uint8_t ClientSignature[SCRAM_KEY_LEN];
 	scram_HMAC_ctx ctx;
 
-	if (credentials->has_scram_keys) {
-		memcpy(ClientKey, credentials->scram_ClientKey, SCRAM_KEY_LEN);
+	if (credentials->scram_keys) {
+		memcpy(ClientKey, credentials->scram_keys->ClientKey, SCRAM_KEY_LEN);
 	} else
 	{
 		rc = pg_saslprep(credentials->passwd, &prep_password);
@@ -539,8 +539,8 @@ bool verify_server_signature(ScramState *scram_state, const PgCredentials *crede
 	uint8_t ServerKey[SCRAM_KEY_LEN];
 	scram_HMAC_ctx ctx;
 
-	if (credentials->has_scram_keys)
-		memcpy(ServerKey, credentials->scram_ServerKey, SCRAM_KEY_LEN);
+	if (credentials->scram_keys)
+		memcpy(ServerKey, credentials->scram_keys->ServerKey, SCRAM_KEY_LEN);
 	else
 		scram_ServerKey(scram_state->SaltedPassword, ServerKey);
 
@@ -681,8 +681,8 @@ bool read_client_final_message(PgSocket *client, const uint8_t *raw_input, char
 	channel_binding = read_attr_value(client, &input, 'c');
 	if (channel_binding == NULL)
 		goto failed;
-	if (!(strcmp(channel_binding, "biws") == 0 && client->scram_state.cbind_flag == 'n') &&
-	    !(strcmp(channel_binding, "eSws") == 0 && client->scram_state.cbind_flag == 'y')) {
+	if (!(strcmp(channel_binding, "biws") == 0 && client->scram_state->cbind_flag == 'n') &&
+	    !(strcmp(channel_binding, "eSws") == 0 && client->scram_state->cbind_flag == 'y')) {
 		slog_error(client, "unexpected SCRAM channel-binding attribute in client-final-message");
 		goto failed;
 	}
@@ -721,11 +721,11 @@ bool read_client_final_message(PgSocket *client, const uint8_t *raw_input, char
 		goto failed;
 	}
 
-	client->scram_state.client_final_message_without_proof = malloc(proof_start - input_start + 1);
-	if (!client->scram_state.client_final_message_without_proof)
+	client->scram_state->client_final_message_without_proof = malloc(proof_start - input_start + 1);
+	if (!client->scram_state->client_final_message_without_proof)
 		goto failed;
-	memcpy(client->scram_state.client_final_message_without_proof, raw_input, proof_start - input_start);
-	client->scram_state.client_final_message_without_proof[proof_start - input_start] = '\0';
+	memcpy(client->scram_state->client_final_message_without_proof, raw_input, proof_start - input_start);
+	client->scram_state->client_final_message_without_proof[proof_start - input_start] = '\0';
 
 	*client_final_nonce_p = client_final_nonce;
 	*proof_p = proof;
@@ -736,54 +736,89 @@ failed:
 }
 
 /*
- * For doing SCRAM with a password stored in plain text, build a SCRAM
- * secret on the fly.
+ * Compute StoredKey and ServerKey from a plain-text password.  This is the
+ * expensive part of building an ad-hoc secret, and it does not touch any
+ * shared state, so the auth workers can run it off the main thread.
  */
-static bool build_adhoc_scram_secret(const char *plain_password, ScramState *scram_state)
+bool scram_compute_adhoc_keys(const char *plain_password,
+			      const uint8_t *saltbuf, int saltlen, int iterations,
+			      uint8_t *StoredKey, uint8_t *ServerKey)
 {
 	const char *password;
-	char *prep_password;
+	char *prep_password = NULL;
 	pg_saslprep_rc rc;
-	char saltbuf[SCRAM_DEFAULT_SALT_LEN];
-	int encoded_len;
 	uint8_t salted_password[SCRAM_KEY_LEN];
 
 	rc = pg_saslprep(plain_password, &prep_password);
 	if (rc == SASLPREP_OOM)
-		goto failed;
+		return false;
 	else if (rc == SASLPREP_SUCCESS)
 		password = prep_password;
 	else
 		password = plain_password;
 
-	get_random_bytes((uint8_t *) saltbuf, sizeof(saltbuf));
+	scram_SaltedPassword(password, (const char *) saltbuf, saltlen,
+			     iterations,
+			     salted_password);
+	scram_ClientKey(salted_password, StoredKey);
+	scram_H(StoredKey, SCRAM_KEY_LEN, StoredKey);
+	scram_ServerKey(salted_password, ServerKey);
 
-	scram_state->adhoc = true;
+	free(prep_password);
+	return true;
+}
 
-	scram_state->iterations = SCRAM_DEFAULT_ITERATIONS;
+/*
+ * Install an ad-hoc secret computed by scram_compute_adhoc_keys() into the
+ * SCRAM state.
+ */
+bool scram_set_adhoc_secret(ScramState *scram_state,
+			    const uint8_t *saltbuf, int saltlen, int iterations,
+			    const uint8_t *StoredKey, const uint8_t *ServerKey)
+{
+	int encoded_len;
 
-	encoded_len = pg_b64_enc_len(sizeof(saltbuf));
+	scram_state->adhoc = true;
+	scram_state->iterations = iterations;
+
+	encoded_len = pg_b64_enc_len(saltlen);
 	scram_state->salt = malloc(encoded_len + 1);
 	if (!scram_state->salt)
-		goto failed;
-	encoded_len = pg_b64_encode(saltbuf, sizeof(saltbuf), scram_state->salt, encoded_len);
+		return false;
+	encoded_len = pg_b64_encode((const char *) saltbuf, saltlen, scram_state->salt, encoded_len);
 	if (encoded_len < 0)
-		goto failed;
+		return false;
 	scram_state->salt[encoded_len] = '\0';
 
-	/* Calculate StoredKey and ServerKey */
-	scram_SaltedPassword(password, saltbuf, sizeof(saltbuf),
-			     scram_state->iterations,
-			     salted_password);
-	scram_ClientKey(salted_password, scram_state->StoredKey);
-	scram_H(scram_state->StoredKey, SCRAM_KEY_LEN, scram_state->StoredKey);
-	scram_ServerKey(salted_password, scram_state->ServerKey);
-
-	free(prep_password);
+	memcpy(scram_state->StoredKey, StoredKey, SCRAM_KEY_LEN);
+	memcpy(scram_state->ServerKey, ServerKey, SCRAM_KEY_LEN);
 	return true;
-failed:
-	free(prep_password);
-	return false;
+}
+
+/*
+ * For doing SCRAM with a password stored in plain text, build a SCRAM
+ * secret on the fly.
+ */
+static bool build_adhoc_scram_secret(const char *plain_password, ScramState *scram_state)
+{
+	uint8_t saltbuf[SCRAM_DEFAULT_SALT_LEN];
+	uint8_t stored_key[SCRAM_KEY_LEN];
+	uint8_t server_key[SCRAM_KEY_LEN];
+
+	/* already prepared by an auth worker */
+	if (scram_state->adhoc && scram_state->salt)
+		return true;
+
+	get_random_bytes(saltbuf, sizeof(saltbuf));
+
+	if (!scram_compute_adhoc_keys(plain_password, saltbuf, sizeof(saltbuf),
+				      SCRAM_DEFAULT_ITERATIONS,
+				      stored_key, server_key))
+		return false;
+
+	return scram_set_adhoc_secret(scram_state, saltbuf, sizeof(saltbuf),
+				      SCRAM_DEFAULT_ITERATIONS,
+				      stored_key, server_key);
 }
 
 /*
@@ -66,6 +66,29 @@ failed_store:
 	return false;
 }
 
+/*
+ * A reported parameter changed that is not restored per client.  In
+ * transaction pooling the next client would see the new value, so the
+ * client stays on this server.
+ */
+static void pin_on_parameter(PgSocket *server, PktHdr *pkt)
+{
+	PgSocket *client = server->link;
+	struct MBuf data = pkt->data;
+	const char *key;
+
+	if (!cf_transaction_pin_session_state || !client || client->pinned)
+		return;
+	if (server->setting_vars || server->state == SV_TESTED || connection_pool_mode(server) != POOL_TX)
+		return;
+	if (incomplete_pkt(pkt) || !mbuf_get_string(&data, &key) || varcache_is_tracked(key))
+		return;
+
+	slog_debug(client, "untracked parameter %s changed, pinning to server", key);
+	client->pinned = true;
+	server->session_dirty = true;
+}
+
 /*
  * We cannot log in to the server at all. If we don't already have any usable
  * server connections, we disconnect all other clients in the pool that are
@@ -301,6 +324,15 @@ int database_min_pool_size(PgDatabase *db)
 		return db->min_pool_size;
 }
 
+/* result_spool_size of the pool's db */
+int pool_result_spool_size(PgPool *pool)
+{
+	if (pool->db->result_spool_size < 0)
+		return cf_result_spool_size;
+	else
+		return pool->db->result_spool_size;
+}
+
 int pool_res_pool_size(PgPool *pool)
 {
 	if (pool->db->res_pool_size < 0)
@@ -325,6 +357,32 @@ int user_max_connections(PgGlobalUser *user)
 		return user->max_user_connections;
 }
 
+/*
+ * Response to a reset query that was sent ahead of the client's first
+ * query.  None of it is forwarded and it does not change the ready state.
+ */
+static bool handle_reset_response(PgSocket *server, PktHdr *pkt)
+{
+	switch (pkt->type) {
+	case 'Z':		/* ReadyForQuery */
+		if (incomplete_pkt(pkt))
+			return false;
+		slog_noise(server, "pipelined reset query done");
+		server->reset_inflight = false;
+		break;
+	case 'S':		/* ParameterStatus */
+		if (!load_parameter(server, pkt, false))
+			return false;
+		break;
+	case 'E':		/* ErrorResponse */
+		log_server_error("reset query failed", pkt);
+		break;
+	}
+	server->pool->stats.server_bytes += pkt->len;
+	sbuf_prepare_skip(&server->sbuf, pkt->len);
+	return true;
+}
+
 /* process packets on logged in connection */
 static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 {
@@ -339,6 +397,9 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 
 	Assert(!server->pool->db->admin);
 
+	if (server->reset_inflight)
+		return handle_reset_response(server, pkt);
+
 	switch (pkt->type) {
 	default:
 		slog_error(server, "unknown pkt: '%c'", pkt_desc(pkt));
@@ -358,6 +419,7 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 				return false;
 		}
 		server->query_failed = false;
+		server->query_canceled = false;
 
 		/* set ready only if no tx */
 		if (state == 'I') {
@@ -367,12 +429,20 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 			return false;
 		} else if (state == 'T' || state == 'E') {
 			idle_tx = true;
+			server->session_dirty = true;
 		}
 		break;
 
 	case 'S':		/* ParameterStatus */
+		pin_on_parameter(server, pkt);
 		if (!load_parameter(server, pkt, false))
 			return false;
+		/* a reset would report the old value again */
+		if (server->state != SV_TESTED) {
+			server->params_changed = true;
+			if (!server->setting_vars)
+				server->session_dirty = true;
+		}
 		break;
 
 	/*
@@ -478,6 +548,7 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 
 	/* reply to LISTEN, don't change connection state */
 	case 'A':		/* NotificationResponse */
+		server->session_dirty = true;
 		idle_tx = server->idle_tx;
 		ready = server->ready;
 		async_response = true;
@@ -557,6 +628,7 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 						total = get_cached_time() - client->query_start;
 						client->query_start = 0;
 						server->pool->stats.query_time += total;
+						latency_record(server->pool, LATENCY_QUERY, total);
 						slog_debug(client, "query time: %d us", (int)total);
 					} else if (!async_response) {
 						slog_warning(client, "FIXME: query end, but query_start == 0");
@@ -571,6 +643,7 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 						total = get_cached_time() - client->xact_start;
 						client->xact_start = 0;
 						server->pool->stats.xact_time += total;
+						latency_record(server->pool, LATENCY_XACT, total);
 						slog_debug(client, "transaction time: %d us", (int)total);
 					} else if (!async_response) {
 						/* XXX This happens during takeover if the new process
@@ -601,9 +674,21 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 					disconnect_server(client->link, true, "out of memory");
 					return false;
 				}
-				slab_free(outstanding_request_cache, request);
+				free_outstanding_request(server, request);
 			}
 		}
+	} else if (server->salvaging) {
+		server->salvage_bytes += pkt->len;
+		if (server->salvage_bytes > (unsigned)cf_server_salvage_max_bytes) {
+			disconnect_server(server, true, "salvage byte limit reached");
+			return false;
+		}
+		/* everything answered, but still not idle */
+		if (pkt->type == 'Z' && !ready && statlist_empty(&server->outstanding_requests)) {
+			disconnect_server(server, true, "could not salvage server");
+			return false;
+		}
+		sbuf_prepare_skip(sbuf, pkt->len);
 	} else {
 		if (server->state != SV_TESTED) {
 			slog_warning(server,
@@ -616,6 +701,131 @@ static bool handle_server_work(PgSocket *server, PktHdr *pkt)
 	return true;
 }
 
+/*
+ * DataRow and friends are forwarded without looking at them.  If more
+ * of them follow the current one in the buffer, send the whole run in
+ * one go instead of going through handle_server_work() for each.
+ */
+static void forward_passthrough_run(PgSocket *server, PktHdr *pkt, struct MBuf *data)
+{
+	SBuf *sbuf = &server->sbuf;
+	PgSocket *client = server->link;
+	unsigned run;
+
+	if (pkt->type != 'D' && pkt->type != 'd' && pkt->type != 't')
+		return;
+
+	/* only when the packet went to the client as-is */
+	if (!client || client->state == CL_LOGIN || server->setting_vars)
+		return;
+	if (mbuf_avail_for_read(&sbuf->extra_packets) > 0)
+		return;
+
+	/* get_header() already moved data past the current packet */
+	run = pkt_run_len(data, "Ddt");
+	if (run == 0)
+		return;
+
+	slog_noise(server, "forwarding %u more bytes of pass-through packets", run);
+	server->pool->stats.server_bytes += run;
+	sbuf_extend_send(sbuf, run);
+}
+
+/*
+ * Raw relay for COPY and replication streams.  While the server streams
+ * CopyData to an active client, only the packet headers are looked at.
+ * Whatever ends the stream (CopyDone, ErrorResponse, ...) goes through
+ * handle_server_work() as usual.
+ */
+static bool relay_copy_data(PgSocket *server, struct MBuf *data)
+{
+	PgSocket *client = server->link;
+	unsigned run;
+
+	if (server->state != SV_ACTIVE || server->ready || server->setting_vars)
+		return false;
+	if (!client || client->state != CL_ACTIVE)
+		return false;
+	if (mbuf_avail_for_read(&server->sbuf.extra_packets) > 0)
+		return false;
+
+	run = pkt_run_len(data, "d");
+	if (run == 0)
+		return false;
+
+	slog_noise(server, "relaying %u bytes of CopyData", run);
+	server->request_time = get_cached_time();
+	server->idle_tx = false;
+	server->pool->stats.server_bytes += run;
+	sbuf_prepare_send(&server->sbuf, &client->sbuf, run);
+	return true;
+}
+
+/*
+ * The client went away while its server was busy.  Instead of closing
+ * the server, take it over: cancel what is running, end any pipeline
+ * with Sync and roll back the transaction.  The responses are dropped,
+ * and once the server reports idle it is released as usual.
+ *
+ * Returns false if the server cannot be salvaged, then the caller
+ * closes it as before.
+ */
+bool salvage_server(PgSocket *client)
+{
+	PgSocket *server = client->link;
+	bool running;
+	bool res;
+
+	if (cf_server_salvage_timeout <= 0 || client->state != CL_ACTIVE || !server || server->ready)
+		return false;
+	/* nothing would undo the session state of a pinned client */
+	if (client->pinned)
+		return false;
+	if (server->state != SV_ACTIVE || server->replication || server->copy_mode
+	    || server->setting_vars || server->close_needed)
+		return false;
+
+	/* the server must have got all packets from the client in full */
+	if (client->sbuf.pkt_remain > 0 || iobuf_amount_pending(client->sbuf.io) > 0
+	    || mbuf_avail_for_read(&client->sbuf.extra_packets) > 0)
+		return false;
+	if (mbuf_avail_for_read(&server->sbuf.extra_packets) > 0)
+		return false;
+
+	slog_debug(server, "salvaging server after client disconnect");
+	running = !server->idle_tx || statlist_count(&server->outstanding_requests) > 0;
+	client->link = NULL;
+	server->link = NULL;
+	server->salvaging = true;
+	server->salvage_start = get_cached_time();
+	server->salvage_bytes = 0;
+
+	if (!sbuf_drop_dst(&server->sbuf)) {
+		disconnect_server(server, false, "could not salvage server");
+		return true;
+	}
+
+	if (running && !server->query_canceled) {
+		if (cancel_server_query(server))
+			server->query_canceled = true;
+	}
+
+	SEND_generic(res, server, 'S', "");
+	if (res)
+		res = add_server_outstanding_request(server, 'S', RA_SKIP);
+	if (res)
+		SEND_generic(res, server, 'Q', "s", "ROLLBACK");
+	if (res)
+		res = add_server_outstanding_request(server, 'Q', RA_SKIP);
+	if (!res) {
+		disconnect_server(server, true, "could not salvage server");
+		return true;
+	}
+
+	update_socket_timer(server);
+	return true;
+}
+
 /* got connection, decide what to do */
 static bool handle_connect(PgSocket *server)
 {
@@ -721,6 +931,26 @@ static bool handle_sslchar(PgSocket *server, struct MBuf *data)
 	return ok;
 }
 
+/*
+ * The client does not keep up with the result.  Let the rest of it be
+ * spooled on the client side if that allows to release the server sooner.
+ */
+static bool server_may_spool(PgSocket *server)
+{
+	PgSocket *client = server->link;
+	int limit = pool_result_spool_size(server->pool);
+
+	if (limit <= 0 || !client)
+		return false;
+	if (client->state != CL_ACTIVE || client->replication)
+		return false;
+	if (server->setting_vars || connection_pool_mode(server) == POOL_SESSION)
+		return false;
+	if (sbuf_spool_len(&client->sbuf) + iobuf_amount_pending(server->sbuf.io) > (unsigned)limit)
+		return false;
+	return true;
+}
+
 /* callback from SBuf */
 bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 {
@@ -757,6 +987,11 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 			break;
 		}
 
+		if (relay_copy_data(server, data)) {
+			res = true;
+			break;
+		}
+
 		/* parse pkt header */
 		if (!get_header(data, &pkt)) {
 			disconnect_server(server, true, "bad pkt header");
@@ -776,6 +1011,8 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 		case SV_BEING_CANCELED:
 		case SV_IDLE:
 			res = handle_server_work(server, &pkt);
+			if (res)
+				forward_passthrough_run(server, &pkt, data);
 			break;
 		default:
 			fatal("server_proto: server in bad state: %d", server->state);
@@ -818,14 +1055,15 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 			break;
 		}
 
-		if (connection_pool_mode(server) != POOL_SESSION || server->state == SV_TESTED || server->resetting) {
+		if ((connection_pool_mode(server) != POOL_SESSION && !(server->link && server->link->pinned))
+		    || server->state == SV_TESTED || server->resetting || server->salvaging) {
 			server->resetting = false;
 			switch (server->state) {
 			case SV_ACTIVE:
 			case SV_ACTIVE_CANCEL:
 			case SV_TESTED:
 				/* keep link if client expects more responses */
-				if (server->link) {
+				if (server->link || server->salvaging) {
 					if (statlist_count(&server->outstanding_requests) > 0)
 						break;
 				}
@@ -844,6 +1082,9 @@ bool server_proto(SBuf *sbuf, SBufEvent evtype, struct MBuf *data)
 	case SBUF_EV_PKT_CALLBACK:
 		slog_warning(server, "SBUF_EV_PKT_CALLBACK with state=%d", server->state);
 		break;
+	case SBUF_EV_SPOOL:
+		res = server_may_spool(server);
+		break;
 	case SBUF_EV_TLS_READY:
 		Assert(server->state == SV_LOGIN);
 
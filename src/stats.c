@@ -34,6 +34,9 @@ static void reset_stats(PgStats *stat)
 	stat->ps_client_parse_count = 0;
 	stat->ps_server_parse_count = 0;
 	stat->ps_bind_count = 0;
+
+	stat->client_tls_session_hits = 0;
+	stat->client_tls_session_misses = 0;
 }
 
 static void stat_add(PgStats *total, PgStats *stat)
@@ -49,6 +52,9 @@ static void stat_add(PgStats *total, PgStats *stat)
 	total->ps_client_parse_count += stat->ps_client_parse_count;
 	total->ps_server_parse_count += stat->ps_server_parse_count;
 	total->ps_bind_count += stat->ps_bind_count;
+
+	total->client_tls_session_hits += stat->client_tls_session_hits;
+	total->client_tls_session_misses += stat->client_tls_session_misses;
 }
 
 static void calc_average(PgStats *avg, PgStats *cur, PgStats *old)
@@ -96,7 +102,7 @@ static void write_stats(PktBuf *buf, PgStats *stat, PgStats *old, char *dbname)
 {
 	PgStats avg;
 	calc_average(&avg, stat, old);
-	pktbuf_write_DataRow(buf, "sNNNNNNNNNNNNNN", dbname,
+	pktbuf_write_DataRow(buf, "sNNNNNNNNNNNNNNNN", dbname,
 			     stat->xact_count, stat->query_count,
 			     stat->client_bytes, stat->server_bytes,
 			     stat->xact_time, stat->query_time,
@@ -104,7 +110,9 @@ static void write_stats(PktBuf *buf, PgStats *stat, PgStats *old, char *dbname)
 			     avg.xact_count, avg.query_count,
 			     avg.client_bytes, avg.server_bytes,
 			     avg.xact_time, avg.query_time,
-			     avg.wait_time);
+			     avg.wait_time,
+			     stat->client_tls_session_hits,
+			     stat->client_tls_session_misses);
 }
 
 bool admin_database_stats(PgSocket *client, struct StatList *pool_list)
@@ -126,7 +134,7 @@ bool admin_database_stats(PgSocket *client, struct StatList *pool_list)
 		return true;
 	}
 
-	pktbuf_write_RowDescription(buf, "sNNNNNNNNNNNNNN", "database",
+	pktbuf_write_RowDescription(buf, "sNNNNNNNNNNNNNNNN", "database",
 				    "total_xact_count", "total_query_count",
 				    "total_received", "total_sent",
 				    "total_xact_time", "total_query_time",
@@ -134,7 +142,9 @@ bool admin_database_stats(PgSocket *client, struct StatList *pool_list)
 				    "avg_xact_count", "avg_query_count",
 				    "avg_recv", "avg_sent",
 				    "avg_xact_time", "avg_query_time",
-				    "avg_wait_time");
+				    "avg_wait_time",
+				    "total_client_tls_session_hits",
+				    "total_client_tls_session_misses");
 	statlist_for_each(item, pool_list) {
 		pool = container_of(item, PgPool, head);
 
@@ -336,20 +346,289 @@ bool show_stat_totals(PgSocket *client, struct StatList *pool_list)
 	WAVG(xact_time);
 	WAVG(query_time);
 	WAVG(wait_time);
+	pktbuf_write_DataRow(buf, "sN", "total_auth_worker_jobs", auth_worker_job_count());
+#ifdef ENABLE_ALLOC_COUNTERS
+	/* malloc-family calls so far, configure --enable-alloc-counters */
+	pktbuf_write_DataRow(buf, "sN", "total_heap_allocs", get_heap_alloc_count());
+#endif
+
+	admin_flush(client, buf, "SHOW");
+	return true;
+}
+
+static int latency_bucket(usec_t value)
+{
+	int shift = 0;
+	int idx;
+
+	if (value < LATENCY_SUB_BUCKETS)
+		return value;
+
+	while ((value >> shift) >= 2 * LATENCY_SUB_BUCKETS)
+		shift++;
+	idx = ((shift + 1) << LATENCY_SUB_BITS) + (int)((value >> shift) - LATENCY_SUB_BUCKETS);
+	if (idx >= LATENCY_BUCKETS)
+		idx = LATENCY_BUCKETS - 1;
+	return idx;
+}
+
+/* largest value that falls into bucket idx */
+static usec_t latency_bucket_limit(int idx)
+{
+	int shift;
+	usec_t lower;
+
+	if (idx < LATENCY_SUB_BUCKETS)
+		return idx;
+
+	shift = (idx >> LATENCY_SUB_BITS) - 1;
+	lower = (usec_t)(LATENCY_SUB_BUCKETS + (idx & (LATENCY_SUB_BUCKETS - 1))) << shift;
+	return lower + ((usec_t)1 << shift) - 1;
+}
+
+static void latency_hist_add(PgLatencyHist *hist, usec_t value)
+{
+	hist->buckets[latency_bucket(value)]++;
+	hist->count++;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+void latency_record(PgPool *pool, LatencyKind kind, usec_t value)
+{
+	if (!pool->latency) {
+		pool->latency = calloc(1, sizeof(*pool->latency));
+		if (!pool->latency)
+			return;
+	}
+	latency_hist_add(&pool->latency->cur[kind], value);
+}
+
+static void latency_add(PgLatencyHist *total, const PgLatencyHist *hist)
+{
+	int i;
+
+	if (!hist->count)
+		return;
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		total->buckets[i] += hist->buckets[i];
+	total->count += hist->count;
+	if (hist->max > total->max)
+		total->max = hist->max;
+}
+
+/*
+ * Upper bound of the bucket holding the pct-th percentile, clamped
+ * to the largest value seen.
+ */
+static usec_t latency_percentile(const PgLatencyHist *hist, int pct)
+{
+	uint64_t rank, seen = 0;
+	usec_t limit;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	rank = (hist->count * pct + 99) / 100;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	limit = latency_bucket_limit(i);
+	return limit < hist->max ? limit : hist->max;
+}
+
+static void write_latency(PktBuf *buf, PgPool *pool)
+{
+	static const PgLatency empty;
+	const PgLatency *lat = pool->latency ? pool->latency : &empty;
+	const PgLatencyHist *q = &lat->last[LATENCY_QUERY];
+	const PgLatencyHist *x = &lat->last[LATENCY_XACT];
+	const PgLatencyHist *w = &lat->last[LATENCY_WAIT];
+
+	pktbuf_write_DataRow(buf, "ssNNNNNNNNNNNNNNN",
+			     pool->db->name, pool->user_credentials->name,
+			     q->count, latency_percentile(q, 50), latency_percentile(q, 95),
+			     latency_percentile(q, 99), q->max,
+			     x->count, latency_percentile(x, 50), latency_percentile(x, 95),
+			     latency_percentile(x, 99), x->max,
+			     w->count, latency_percentile(w, 50), latency_percentile(w, 95),
+			     latency_percentile(w, 99), w->max);
+}
+
+bool admin_pool_latency(PgSocket *client, struct StatList *pool_list)
+{
+	PgPool *pool;
+	struct List *item;
+	PktBuf *buf;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		admin_error(client, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "ssNNNNNNNNNNNNNNN", "database", "user",
+				    "query_count", "query_p50", "query_p95",
+				    "query_p99", "query_max",
+				    "xact_count", "xact_p50", "xact_p95",
+				    "xact_p99", "xact_max",
+				    "wait_count", "wait_p50", "wait_p95",
+				    "wait_p99", "wait_max");
+	statlist_for_each(item, pool_list) {
+		pool = container_of(item, PgPool, head);
+		write_latency(buf, pool);
+	}
+	admin_flush(client, buf, "SHOW");
+
+	return true;
+}
+
+/*
+ * Event loop accounting.  Each callback marks its start with
+ * loop_callback(), the time until the next mark or the end of the
+ * iteration is charged to it.  Callbacks without a mark (libevent's
+ * own DNS code) get charged to the one that ran before them.
+ *
+ * Histograms are kept per callback type and for the iteration as a
+ * whole, and rotated each stats_period like the pool latencies.
+ */
+enum {
+	LOOP_ROW_ITERATION = LOOP_CB_KINDS,	/* busy time per iteration */
+	LOOP_ROW_EVENTS,			/* callbacks per iteration */
+	LOOP_ROWS
+};
+
+static const char *loop_row_names[LOOP_ROWS] = {
+	"client", "server", "admin", "accept", "janitor", "stats",
+	"signal", "dns", "other", "maint", "iteration", "events"
+};
+
+static PgLatencyHist loop_hist[LOOP_ROWS], loop_hist_last[LOOP_ROWS];
+static uint64_t loop_slowest[LOOP_CB_KINDS], loop_slowest_last[LOOP_CB_KINDS];
+
+/* state of the current iteration */
+static usec_t loop_wake;		/* first mark, 0 before */
+static usec_t loop_mark;		/* start of running callback */
+static enum LoopCallback loop_cb;	/* its type */
+static enum LoopCallback loop_slowest_cb;
+static usec_t loop_slowest_time;
+static unsigned loop_events;
+
+static void loop_charge(usec_t now)
+{
+	usec_t spent;
+
+	if (!loop_wake)
+		return;
+
+	spent = now - loop_mark;
+	latency_hist_add(&loop_hist[loop_cb], spent);
+	if (spent >= loop_slowest_time) {
+		loop_slowest_time = spent;
+		loop_slowest_cb = loop_cb;
+	}
+}
+
+void loop_callback(enum LoopCallback type)
+{
+	usec_t now = get_time_usec();
+
+	loop_charge(now);
+	if (!loop_wake)
+		loop_wake = now;
+	loop_mark = now;
+	loop_cb = type;
+	if (type != LOOP_CB_MAINT)
+		loop_events++;
+}
+
+void loop_iteration_done(void)
+{
+	usec_t now = get_time_usec();
+	usec_t busy;
+
+	if (!loop_wake)
+		return;
 
+	loop_charge(now);
+	busy = now - loop_wake;
+	latency_hist_add(&loop_hist[LOOP_ROW_ITERATION], busy);
+	latency_hist_add(&loop_hist[LOOP_ROW_EVENTS], loop_events);
+	loop_slowest[loop_slowest_cb]++;
+
+	if (cf_loop_warn_time > 0 && busy > cf_loop_warn_time) {
+		log_warning("event loop iteration took %" PRIu64 " ms: %u events, slowest was %s callback with %" PRIu64 " ms",
+			    busy / 1000, loop_events,
+			    loop_row_names[loop_slowest_cb], loop_slowest_time / 1000);
+	}
+
+	loop_wake = 0;
+	loop_slowest_time = 0;
+	loop_events = 0;
+}
+
+bool admin_loop_stats(PgSocket *client)
+{
+	const PgLatencyHist *h;
+	PktBuf *buf;
+	int i;
+
+	buf = pktbuf_dynamic(512);
+	if (!buf) {
+		admin_error(client, "no mem");
+		return true;
+	}
+
+	pktbuf_write_RowDescription(buf, "sNNNNNN", "name", "count", "slowest",
+				    "p50", "p95", "p99", "max");
+	for (i = 0; i < LOOP_ROWS; i++) {
+		h = &loop_hist_last[i];
+		pktbuf_write_DataRow(buf, "sNNNNNN", loop_row_names[i], h->count,
+				     i < LOOP_CB_KINDS ? loop_slowest_last[i] : (uint64_t)0,
+				     latency_percentile(h, 50), latency_percentile(h, 95),
+				     latency_percentile(h, 99), h->max);
+	}
 	admin_flush(client, buf, "SHOW");
+
 	return true;
 }
 
+#ifdef ENABLE_ALLOC_COUNTERS
+/* heap allocations since the last stats period, per query */
+static void log_alloc_stats(uint64_t queries)
+{
+	static uint64_t last_alloc_count;
+	uint64_t alloc_count = get_heap_alloc_count();
+	uint64_t allocs = alloc_count - last_alloc_count;
+
+	last_alloc_count = alloc_count;
+	log_info("stats: %" PRIu64 " heap allocations, %.2f per query",
+		 allocs, queries ? (double)allocs / queries : 0.0);
+}
+#endif
+
 static void refresh_stats(evutil_socket_t s, short flags, void *arg)
 {
 	struct List *item;
 	PgPool *pool;
 	PgStats old_total, cur_total;
 	PgStats avg;
+	PgLatencyHist lat_total[LATENCY_KINDS];
+	int i;
+
+	loop_callback(LOOP_CB_STATS);
 
 	reset_stats(&old_total);
 	reset_stats(&cur_total);
+	memset(lat_total, 0, sizeof(lat_total));
+
+	memcpy(loop_hist_last, loop_hist, sizeof(loop_hist));
+	memset(loop_hist, 0, sizeof(loop_hist));
+	memcpy(loop_slowest_last, loop_slowest, sizeof(loop_slowest));
+	memset(loop_slowest, 0, sizeof(loop_slowest));
 
 	old_stamp = new_stamp;
 	new_stamp = get_cached_time();
@@ -359,9 +638,16 @@ static void refresh_stats(evutil_socket_t s, short flags, void *arg)
 		pool->older_stats = pool->newer_stats;
 		pool->newer_stats = pool->stats;
 
+		if (pool->latency) {
+			memcpy(pool->latency->last, pool->latency->cur, sizeof(pool->latency->last));
+			memset(pool->latency->cur, 0, sizeof(pool->latency->cur));
+		}
+
 		if (cf_log_stats) {
 			stat_add(&cur_total, &pool->stats);
 			stat_add(&old_total, &pool->older_stats);
+			for (i = 0; pool->latency && i < LATENCY_KINDS; i++)
+				latency_add(&lat_total[i], &pool->latency->last[i]);
 		}
 	}
 
@@ -377,7 +663,10 @@ static void refresh_stats(evutil_socket_t s, short flags, void *arg)
 			 " out %" PRIu64 " B/s,"
 			 " xact %" PRIu64 " us,"
 			 " query %" PRIu64 " us,"
-			 " wait %" PRIu64 " us",
+			 " wait %" PRIu64 " us,"
+			 " query p50/p95/p99/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 " us,"
+			 " xact p50/p95/p99/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 " us,"
+			 " wait p50/p95/p99/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 "/%" PRIu64 " us",
 			 avg.xact_count,
 			 avg.query_count,
 			 avg.ps_client_parse_count,
@@ -385,7 +674,16 @@ static void refresh_stats(evutil_socket_t s, short flags, void *arg)
 			 avg.ps_bind_count,
 			 avg.client_bytes, avg.server_bytes,
 			 avg.xact_time, avg.query_time,
-			 avg.wait_time);
+			 avg.wait_time,
+#define PCTS(h) latency_percentile(h, 50), latency_percentile(h, 95), \
+			 latency_percentile(h, 99), (h)->max
+			 PCTS(&lat_total[LATENCY_QUERY]),
+			 PCTS(&lat_total[LATENCY_XACT]),
+			 PCTS(&lat_total[LATENCY_WAIT]));
+#undef PCTS
+#ifdef ENABLE_ALLOC_COUNTERS
+		log_alloc_stats(cur_total.query_count - old_total.query_count);
+#endif
 	}
 
 	sd_notifyf(0,
@@ -313,6 +313,7 @@ static void takeover_recv_cb(evutil_socket_t sock, short flags, void *arg)
 	ssize_t res;
 	struct MBuf data;
 
+	loop_callback(LOOP_CB_OTHER);
 	memset(&msg, 0, sizeof(msg));
 	io.iov_base = data_buf;
 	io.iov_len = sizeof(data_buf);
@@ -547,3 +547,57 @@ bool strings_equal(const char *str_left, const char *str_right)
 	return strcmp(str_left, str_right) == 0;
 }
 
+
+#ifdef ENABLE_ALLOC_COUNTERS
+/*
+ * With --enable-alloc-counters the linker sends the allocation calls of
+ * PgBouncer and libusual through these wrappers.  Libraries linked
+ * dynamically (libevent, TLS, c-ares) are not counted.  The auth worker
+ * threads allocate too, so the counter is updated atomically.
+ */
+static uint64_t heap_alloc_count;
+
+uint64_t get_heap_alloc_count(void)
+{
+	return __atomic_load_n(&heap_alloc_count, __ATOMIC_RELAXED);
+}
+
+static inline void count_heap_alloc(void)
+{
+	__atomic_fetch_add(&heap_alloc_count, 1, __ATOMIC_RELAXED);
+}
+
+void *__real_malloc(size_t len);
+void *__real_calloc(size_t nmemb, size_t len);
+void *__real_realloc(void *ptr, size_t len);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t len);
+void *__wrap_calloc(size_t nmemb, size_t len);
+void *__wrap_realloc(void *ptr, size_t len);
+char *__wrap_strdup(const char *s);
+
+void *__wrap_malloc(size_t len)
+{
+	count_heap_alloc();
+	return __real_malloc(len);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t len)
+{
+	count_heap_alloc();
+	return __real_calloc(nmemb, len);
+}
+
+void *__wrap_realloc(void *ptr, size_t len)
+{
+	count_heap_alloc();
+	return __real_realloc(ptr, len);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	count_heap_alloc();
+	return __real_strdup(s);
+}
+#endif
@@ -53,6 +53,15 @@ int get_num_var_cached(void)
 	return num_var_cached;
 }
 
+/* is the parameter kept per client and restored by varcache_apply()? */
+bool varcache_is_tracked(const char *key)
+{
+	struct var_lookup *lk = NULL;
+
+	HASH_FIND_STR(lookup_map, key, lk);
+	return lk != NULL;
+}
+
 static void init_var_lookup_from_config(const char *cf_track_extra_parameters, int *num_vars)
 {
 	char *var_name = NULL;
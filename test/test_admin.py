@@ -24,6 +24,9 @@ def test_show(bouncer):
         "stats_averages",
         "users",
         "totals",
+        "latency",
+        "loop",
+        "events",
         "mem",
         "dns_hosts",
         "dns_zones",
@@ -31,6 +31,32 @@ def test_auth_user(bouncer):
         bouncer.test(user="someuser", password="badpasswd")
 
 
+def test_auth_query_cache(bouncer):
+    bouncer.default_db = "authdb"
+    bouncer.admin("set verbose=3")
+    bouncer.admin(f"set auth_type='md5'")
+    bouncer.admin("set auth_query_cache_ttl=60")
+
+    bouncer.test(user="someuser", password="anypasswd")
+    with bouncer.log_contains(r"using cached auth_query result for user someuser"):
+        bouncer.test(user="someuser", password="anypasswd")
+
+    # a failed login drops the cached entry
+    with pytest.raises(
+        psycopg.OperationalError, match="(SASL|password) authentication failed"
+    ):
+        bouncer.test(user="someuser", password="badpasswd")
+    with bouncer.log_contains(r"doing auth_conn query", times=1):
+        bouncer.test(user="someuser", password="anypasswd")
+
+    # unknown users are cached too
+    with pytest.raises(psycopg.OperationalError, match="no such user"):
+        bouncer.test(user="nouser", password="anypasswd")
+    with bouncer.log_contains(r"doing auth_conn query", times=0):
+        with pytest.raises(psycopg.OperationalError, match="no such user"):
+            bouncer.test(user="nouser", password="anypasswd")
+
+
 @pytest.mark.md5
 def test_auth_dbname_global(bouncer):
     bouncer.admin(f"set auth_dbname='authdb'")
@@ -223,6 +249,37 @@ def test_password_client(bouncer):
         bouncer.test(user="longpass", password="X" + LONG_PASSWORD)
 
 
+def test_auth_file_reload(bouncer):
+    bouncer.admin(f"set auth_type='plain'")
+    bouncer.test(user="puser1", password="foo")
+    bouncer.test(user="puser2", password="bar")
+
+    userlist = bouncer.auth_path.read_text()
+    userlist = userlist.replace('"puser1" "foo"', '"puser1" "baz"')
+    userlist = userlist.replace('"puser2" "bar"\n', "")
+    bouncer.auth_path.write_text(userlist)
+    bouncer.admin("reload")
+
+    # changed line
+    bouncer.test(user="puser1", password="baz")
+    with pytest.raises(
+        psycopg.OperationalError, match="password authentication failed"
+    ):
+        bouncer.test(user="puser1", password="foo")
+    # removed line
+    with pytest.raises(
+        psycopg.OperationalError, match="password authentication failed"
+    ):
+        bouncer.test(user="puser2", password="bar")
+    # unchanged line
+    bouncer.test(user="muser1", password="foo")
+
+    # a second line for a user overrides the first one
+    bouncer.auth_path.write_text(userlist + '"puser1" "qux"\n')
+    bouncer.admin("reload")
+    bouncer.test(user="puser1", password="qux")
+
+
 @pytest.mark.md5
 def test_md5_client(bouncer):
     bouncer.admin(f"set auth_type='md5'")
@@ -260,6 +317,57 @@ def test_scram_both(bouncer):
     bouncer.test(dbname="p62", user="scramuser1", password="foo")
 
 
+@pytest.mark.skipif("not PG_SUPPORTS_SCRAM")
+def test_scram_state_freed_after_login(bouncer):
+    bouncer.admin(f"set auth_type='scram-sha-256'")
+
+    conns = [
+        bouncer.conn(dbname="p62", user="scramuser1", password="foo")
+        for _ in range(10)
+    ]
+    for conn in conns:
+        conn.execute("select 1")
+
+    # idle clients and servers keep no SCRAM state after login
+    mem = {row[0]: row for row in bouncer.admin("show mem")}
+    assert mem["scram_state_cache"][2] == 0
+
+    for conn in conns:
+        conn.close()
+
+
+@pytest.mark.md5
+@pytest.mark.asyncio
+@pytest.mark.skipif("WINDOWS", reason="no threads on Windows")
+async def test_auth_workers(bouncer):
+    def worker_jobs():
+        totals = {row[0]: row[1] for row in bouncer.admin("show totals")}
+        return totals["total_auth_worker_jobs"]
+
+    bouncer.admin(f"set auth_type='md5'")
+    connect_with_md5_client_users(bouncer)
+    assert worker_jobs() == 0
+
+    bouncer.write_ini(f"auth_workers = 2")
+    await bouncer.reboot()
+
+    bouncer.admin(f"set auth_type='plain'")
+    connect_with_password_client_users(bouncer)
+    connect_with_md5_client_users(bouncer)
+    connect_with_scram_client_users(bouncer)
+
+    bouncer.admin(f"set auth_type='md5'")
+    connect_with_password_client_users(bouncer)
+    connect_with_md5_client_users(bouncer)
+
+    bouncer.admin(f"set auth_type='scram-sha-256'")
+    connect_with_password_client_users(bouncer)
+    connect_with_scram_client_users(bouncer)
+
+    # the checks above went through the worker threads
+    assert worker_jobs() > 0
+
+
 @pytest.mark.skipif("WINDOWS", reason="Windows does not have SIGHUP")
 def test_auth_dbname_usage(
     bouncer,
@@ -42,6 +42,32 @@ def test_copy_stdin_error_after_copy_done_simple(bouncer):
         assert conn.pgconn.get_result() is None
 
 
+def test_copy_stdin_many_rows(bouncer):
+    bouncer.sql("TRUNCATE test_copy")
+
+    with bouncer.conn() as conn:
+        conn.pgconn.send_query(f"COPY test_copy(i) FROM STDIN".encode())
+        assert conn.pgconn.get_result().status == pq.ExecStatus.COPY_IN
+        for i in range(10000):
+            conn.pgconn.put_copy_data(f"{i}\n".encode())
+        conn.pgconn.put_copy_end()
+        assert conn.pgconn.get_result().status == pq.ExecStatus.COMMAND_OK
+        assert conn.pgconn.get_result() is None
+
+    assert bouncer.sql_value("SELECT count(*) FROM test_copy") == 10000
+
+    with bouncer.conn() as conn:
+        conn.pgconn.send_query(
+            f"COPY (SELECT i FROM test_copy ORDER BY i) TO STDOUT (FORMAT TEXT)".encode()
+        )
+        assert conn.pgconn.get_result().status == pq.ExecStatus.COPY_OUT
+        for i in range(10000):
+            assert conn.pgconn.get_copy_data(0) == (len(f"{i}\n"), f"{i}\n".encode())
+        assert conn.pgconn.get_copy_data(0) == (-1, b"")
+        assert conn.pgconn.get_result().status == pq.ExecStatus.COMMAND_OK
+        assert conn.pgconn.get_result() is None
+
+
 def test_copy_stdout_simple(bouncer):
     bouncer.sql("TRUNCATE test_copy")
     bouncer.sql("INSERT INTO test_copy VALUES (1), (2)")
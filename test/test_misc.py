@@ -1,9 +1,11 @@
 import asyncio
 import re
+import signal
 import time
 
 import psycopg
 import pytest
+from psycopg.rows import dict_row
 
 from .utils import HAVE_IPV6_LOCALHOST, PG_MAJOR_VERSION, PKT_BUF_SIZE, WINDOWS
 
@@ -95,6 +97,26 @@ async def test_wait_close(bouncer):
     await wait_close_task
 
 
+@pytest.mark.asyncio
+async def test_wait_close_clears_flag(bouncer):
+    with bouncer.log_contains(r"WAIT_CLOSE finished for database p3", times=1):
+        with bouncer.cur(dbname="p3") as cur:
+            cur.execute("select 1")
+            await bouncer.aadmin("reconnect p3")
+            wait_close_task = bouncer.aadmin("wait_close p3")
+        await wait_close_task
+
+    # the flag is gone, so a later WAIT_CLOSE is tracked from scratch
+    with bouncer.log_contains(r"WAIT_CLOSE finished for database p3", times=1):
+        with bouncer.cur(dbname="p3") as cur:
+            cur.execute("select 1")
+            await bouncer.aadmin("reconnect p3")
+            wait_close_task = bouncer.aadmin("wait_close p3")
+            done, pending = await asyncio.wait([wait_close_task], timeout=1)
+            assert done == set()
+        await wait_close_task
+
+
 def test_auto_database(bouncer):
     with bouncer.ini_path.open() as f:
         original = f.read()
@@ -354,3 +376,396 @@ def test_sigusr2_during_shutdown(bouncer):
             with bouncer.log_contains(r"got SIGUSR2 while shutting down, ignoring"):
                 bouncer.sigusr2()
                 time.sleep(1)
+
+
+def test_many_data_rows(bouncer):
+    def sent_bytes():
+        stats = bouncer.admin("show stats", row_factory=dict_row)
+        return sum(s["total_sent"] for s in stats if s["database"] == "p0")
+
+    before = sent_bytes()
+    rows = bouncer.sql(
+        "select i, repeat('x', i % 50) from generate_series(1, 100000) i"
+    )
+    assert len(rows) == 100000
+    assert rows[-1] == (100000, "")
+    assert rows[48] == (49, "x" * 49)
+
+    # every DataRow is counted: type, length, column count and two columns
+    assert sent_bytes() - before > 100000 * (1 + 4 + 2 + 4 + 1 + 4)
+
+
+def test_passthrough_run_alignment(bouncer):
+    bouncer.admin("set verbose=3")
+    bouncer.admin("set pool_mode = transaction")
+    bouncer.admin("set default_pool_size = 1")
+    bouncer.admin("set query_wait_timeout = 5")
+
+    # The row text is 'D' followed by bytes that read as a big length.
+    # Rows of different length make sure that a scan starting at the
+    # wrong offset lands on it.
+    query = (
+        "select left(repeat(chr(68) || repeat(chr(127), 4), 40), 100 + i % 7)"
+        " from generate_series(1, 2000) i"
+    )
+    with bouncer.log_contains(r"forwarding \d{4,} more bytes of pass-through packets"):
+        rows = bouncer.sql(query, dbname="p0")
+    assert len(rows) == 2000
+    assert rows[0][0] == ("D" + "\x7f" * 4) * 20 + "D"
+
+    # ReadyForQuery was seen, so the only server went back to the pool
+    assert bouncer.sql_value("select 1", dbname="p0") == 1
+
+
+def test_result_spool(bouncer):
+    bouncer.admin("set result_spool_size = 16000000")
+    bouncer.admin("set default_pool_size = 1")
+    bouncer.admin("set pool_mode = transaction")
+    bouncer.admin("set query_wait_timeout = 5")
+    bouncer.admin("set client_idle_timeout = 1")
+
+    with bouncer.conn(dbname="p1") as slow:
+        # about 5MB, far more than the socket buffers hold
+        slow.pgconn.send_query(
+            b"select repeat('x', 1000) from generate_series(1, 5000)"
+        )
+
+        # the only server connection must not stay with the slow reader
+        assert bouncer.sql_value("select 1", dbname="p1") == 1
+
+        # a client that has not read its spooled result yet is not idle
+        time.sleep(2)
+        res = slow.pgconn.get_result()
+        assert res.ntuples == 5000
+        assert res.get_value(4999, 0) == b"x" * 1000
+        while slow.pgconn.get_result() is not None:
+            pass
+
+
+def test_result_spool_slow_reader(bouncer):
+    bouncer.admin("set result_spool_size = 1000000")
+    bouncer.admin("set pool_mode = transaction")
+
+    def mem_used():
+        pools = bouncer.admin("show pools", row_factory=dict_row)
+        return sum(p["mem_used"] for p in pools if p["database"] == "p1")
+
+    with bouncer.conn(dbname="p1") as slow:
+        # about 10MB, ten times the spool limit
+        slow.pgconn.send_query(
+            b"select repeat('x', 1000) from generate_series(1, 10000)"
+        )
+        slow.pgconn.nonblocking = 1
+
+        # read a little at a time so the spool never runs empty
+        peak = 0
+        while slow.pgconn.is_busy():
+            time.sleep(0.01)
+            slow.pgconn.consume_input()
+            peak = max(peak, mem_used())
+
+        res = slow.pgconn.get_result()
+        assert res.ntuples == 10000
+        assert res.get_value(9999, 0) == b"x" * 1000
+        while slow.pgconn.get_result() is not None:
+            pass
+
+    # the data that went out is not kept around
+    assert peak < 3 * 1000000
+
+
+def test_reset_query_skip_clean(bouncer):
+    bouncer.admin("set pool_mode = session")
+    bouncer.admin("set default_pool_size = 1")
+    bouncer.admin("set server_reset_query_skip_clean = 1")
+
+    def last_query(pid):
+        return bouncer.sql_value(
+            "select query from pg_stat_activity where pid = %s", [pid], dbname="p0"
+        )
+
+    # nothing changed in the session: no reset
+    pid = bouncer.sql_value("select pg_backend_pid()", dbname="p1")
+    assert last_query(pid) == "select pg_backend_pid()"
+
+    # only whole words count, "attempts" is not "temp"
+    query = "select pg_backend_pid() as attempts"
+    assert bouncer.sql_value(query, dbname="p1") == pid
+    assert last_query(pid) == query
+
+    # changed setting: the reset is not waited for on release ...
+    with bouncer.cur(dbname="p1") as cur:
+        cur.execute("set work_mem = '1234kB'")
+        assert cur.execute("select pg_backend_pid()").fetchone()[0] == pid
+    assert last_query(pid) == "select pg_backend_pid()"
+
+    # ... but runs before the next client's query
+    with bouncer.cur(dbname="p1") as cur:
+        assert cur.execute("select pg_backend_pid()").fetchone()[0] == pid
+        assert cur.execute("show work_mem").fetchone()[0] != "1234kB"
+
+    # temp tables and session locks are reset right away
+    with bouncer.cur(dbname="p1") as cur:
+        cur.execute("create temp table skip_clean_tmp (a int)")
+        cur.execute("select pg_advisory_lock(4243)")
+    time.sleep(0.5)
+    assert last_query(pid) == "DISCARD ALL"
+    assert (
+        bouncer.sql_value(
+            "select count(*) from pg_locks where locktype = 'advisory'", dbname="p0"
+        )
+        == 0
+    )
+
+    # a deferred reset no client picks up goes out after server_check_delay
+    bouncer.admin("set server_check_delay = 1")
+    with bouncer.cur(dbname="p1") as cur:
+        cur.execute("set work_mem = '1234kB'")
+    assert last_query(pid) == "set work_mem = '1234kB'"
+    time.sleep(3)
+    assert last_query(pid) == "DISCARD ALL"
+
+
+def test_server_salvage(bouncer):
+    bouncer.admin("set server_salvage_timeout = 5")
+    bouncer.admin("set pool_mode = transaction")
+    bouncer.admin("set default_pool_size = 1")
+
+    # client goes away inside a transaction
+    conn = bouncer.conn(dbname="p1")
+    conn.execute("begin")
+    pid = conn.execute("select pg_backend_pid()").fetchone()[0]
+    with bouncer.log_contains(r"client disconnect while server was not ready", times=0):
+        conn.close()
+        assert bouncer.sql_value("select pg_backend_pid()", dbname="p1") == pid
+
+    # client goes away while a query runs
+    conn = bouncer.conn(dbname="p1")
+    conn.pgconn.send_query(b"select pg_sleep(30)")
+    time.sleep(0.5)
+    conn.close()
+    start = time.time()
+    with bouncer.cur(dbname="p1") as cur:
+        assert cur.execute("select pg_backend_pid()").fetchone()[0] == pid
+        assert cur.execute("select now() = statement_timestamp()").fetchone()[0]
+    assert time.time() - start < 5
+
+
+def test_transaction_pin_session_state(bouncer):
+    bouncer.admin("set pool_mode = transaction")
+    bouncer.admin("set default_pool_size = 2")
+    bouncer.admin("set transaction_pin_session_state = 1")
+
+    def pinned():
+        pools = bouncer.admin("show pools", row_factory=dict_row)
+        return sum(p["cl_pinned"] for p in pools if p["database"] == "p1")
+
+    with bouncer.cur(dbname="p1") as cur1, bouncer.cur(dbname="p1") as cur2:
+        # tracked parameters are restored per client, no pin needed
+        cur1.execute("set application_name = 'pin_test'")
+        assert pinned() == 0
+
+        cur1.execute("set work_mem = '1234kB'")
+        assert pinned() == 1
+        pid = cur1.execute("select pg_backend_pid()").fetchone()[0]
+
+        # the other client does not get the pinned server
+        for _ in range(3):
+            assert cur2.execute("select pg_backend_pid()").fetchone()[0] != pid
+            assert cur2.execute("show work_mem").fetchone()[0] != "1234kB"
+
+        assert cur1.execute("show work_mem").fetchone()[0] == "1234kB"
+
+        # DISCARD ALL in strings and comments is not a statement
+        cur1.execute(
+            "select 'x; discard all', $q$;discard all$q$;"
+            " /* ; discard all */ select 1 -- ; discard all"
+        )
+        assert pinned() == 1
+
+        cur1.execute("discard all")
+        assert pinned() == 0
+
+    # pinned client disconnecting gets its session reset
+    with bouncer.cur(dbname="p1") as cur:
+        cur.execute("select pg_advisory_lock(4242)")
+        assert pinned() == 1
+    time.sleep(0.5)
+    assert pinned() == 0
+    with bouncer.cur(dbname="p1") as cur:
+        assert cur.execute("select pg_try_advisory_lock(4242)").fetchone()[0]
+
+
+@pytest.mark.asyncio
+async def test_pool_mem_limit(bouncer):
+    bouncer.admin("set pool_mode = transaction")
+    bouncer.admin("set pool_mem_limit = 1")
+
+    def pool_row():
+        pools = bouncer.admin("show pools", row_factory=dict_row)
+        return next(p for p in pools if p["database"] == "p1")
+
+    bouncer.default_db = "p1"
+    with bouncer.transaction() as cur1:
+        conn2 = await bouncer.aconn()
+        cur2 = conn2.cursor()
+
+        cur1.execute("select 1")
+        assert pool_row()["mem_used"] > 1
+
+        # the open transaction keeps the pool over the limit, so the
+        # second client is not read from
+        task = asyncio.ensure_future(cur2.execute("select 2"))
+        done, pending = await asyncio.wait([task], timeout=1)
+        assert done == set()
+        assert pool_row()["cl_mem_throttled"] == 1
+        cur1.execute("select 1")
+
+    # once the server is released the client goes ahead
+    await task
+    assert (await cur2.fetchone())[0] == 2
+    assert pool_row()["cl_mem_throttled"] == 0
+    await conn2.close()
+
+
+def test_query_path_allocations(bouncer):
+    bouncer.admin("set pool_mode = transaction")
+
+    def mem(name):
+        rows = bouncer.admin("show mem", row_factory=dict_row)
+        return next((r["used"] for r in rows if r["name"] == name), None)
+
+    def heap_allocs():
+        rows = bouncer.admin("show totals", row_factory=dict_row)
+        return next(
+            (r["value"] for r in rows if r["name"] == "total_heap_allocs"), None
+        )
+
+    with bouncer.cur(dbname="p1") as cur:
+        # outstanding requests come from the server's preallocated slots
+        cur.execute("select 1")
+        assert mem("request_slots_cache") >= 1
+        assert mem("outstanding_request_cache") == 0
+
+        if heap_allocs() is None:
+            pytest.skip("built without --enable-alloc-counters")
+
+        for _ in range(10):
+            cur.execute("select 1")
+        before = heap_allocs()
+        baseline = heap_allocs() - before
+
+        before = heap_allocs()
+        for _ in range(100):
+            cur.execute("select 1")
+        after = heap_allocs()
+
+    # only the SHOW TOTALS itself allocates, not the queries in between
+    assert after - before < baseline + 10
+
+
+def test_pool_idle_timeout(bouncer):
+    bouncer.admin("set server_idle_timeout = 1")
+    bouncer.admin("set pool_idle_timeout = 1")
+
+    def p1_pools():
+        pools = bouncer.admin("show pools", row_factory=dict_row)
+        return [p for p in pools if p["database"] == "p1"]
+
+    bouncer.test(dbname="p1")
+    assert len(p1_pools()) == 1
+
+    # the server gets closed first, the empty pool goes a bit later
+    time.sleep(4)
+    assert p1_pools() == []
+
+    # and is created again when needed
+    bouncer.test(dbname="p1")
+    assert len(p1_pools()) == 1
+
+
+@pytest.mark.asyncio
+async def test_show_latency(bouncer):
+    bouncer.write_ini(f"stats_period = 1")
+    await bouncer.reboot()
+
+    def p1_latency():
+        rows = bouncer.admin("show latency", row_factory=dict_row)
+        return [r for r in rows if r["database"] == "p1"][0]
+
+    with bouncer.log_contains(r"query p50/p95/p99/max \d+/\d+/\d+/\d+ us"):
+        with bouncer.cur(dbname="p1") as cur:
+            cur.execute("select pg_sleep(0.2)")
+
+        # wait for the stats period holding the query to complete
+        for _ in range(30):
+            row = p1_latency()
+            if row["query_count"] > 0:
+                break
+            time.sleep(0.1)
+
+    assert row["query_count"] == 1
+    assert row["query_max"] >= 200000
+    # a single sample: every percentile is clamped to it
+    assert row["query_p50"] == row["query_p99"] == row["query_max"]
+    assert row["xact_count"] == 1
+
+
+@pytest.mark.asyncio
+async def test_show_loop(bouncer):
+    bouncer.write_ini(f"stats_period = 1")
+    await bouncer.reboot()
+
+    def loop_rows():
+        rows = bouncer.admin("show loop", row_factory=dict_row)
+        return {r["name"]: r for r in rows}
+
+    with bouncer.cur() as cur:
+        for _ in range(10):
+            cur.execute("select 1")
+
+    for _ in range(30):
+        rows = loop_rows()
+        if rows["client"]["count"] > 0:
+            break
+        time.sleep(0.1)
+
+    assert rows["client"]["count"] > 0
+    assert rows["server"]["count"] > 0
+    assert rows["iteration"]["count"] > 0
+    assert rows["events"]["max"] >= 1
+    assert rows["iteration"]["p50"] <= rows["iteration"]["max"]
+
+    # every iteration is over a 1us threshold
+    bouncer.admin("set loop_warn_time = 0.000001")
+    with bouncer.log_contains(r"event loop iteration took \d+ ms: \d+ events, slowest was \w+ callback"):
+        bouncer.test()
+
+
+@pytest.mark.skipif("WINDOWS", reason="Windows does not have SIGWINCH")
+def test_show_events(bouncer):
+    bouncer.admin("set client_idle_timeout = 1")
+
+    with bouncer.cur(dbname="p1") as cur:
+        cur.execute("select 1")
+        time.sleep(2)
+
+    rows = bouncer.admin("show events p1", row_factory=dict_row)
+    events = [(r["event"], r["detail"]) for r in rows]
+    assert all(r["database"] == "p1" for r in rows)
+    assert ("server", "free -> login") in events
+    assert ("server", "idle -> active") in events
+    assert ("timeout", "client_idle_timeout") in events
+
+    with pytest.raises(psycopg.OperationalError, match="no such database"):
+        bouncer.admin("show events nosuchdb")
+
+    with bouncer.log_contains(r"event p1/\w+: .* timeout 0x[0-9a-f]+ client_idle_timeout"):
+        bouncer.send_signal(signal.SIGWINCH)
+        time.sleep(0.5)
+
+    # a burst of signals, as from resizing a terminal, is not written again
+    with bouncer.log_contains(r"got SIGWINCH, writing pool events", times=0):
+        for _ in range(5):
+            bouncer.send_signal(signal.SIGWINCH)
+        time.sleep(0.5)
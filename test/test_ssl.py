@@ -1,9 +1,21 @@
+import socket
+import ssl
+import struct
 import subprocess
 
 import psycopg
 import pytest
-
-from .utils import MACOS, PG_MAJOR_VERSION, TEST_DIR, TLS_SUPPORT, WINDOWS, Bouncer
+from psycopg.rows import dict_row
+
+from .utils import (
+    LINUX,
+    MACOS,
+    PG_MAJOR_VERSION,
+    TEST_DIR,
+    TLS_SUPPORT,
+    WINDOWS,
+    Bouncer,
+)
 
 if not TLS_SUPPORT:
     pytest.skip(allow_module_level=True)
@@ -162,6 +174,99 @@ def test_client_ssl(bouncer, cert_dir):
     bouncer.psql_test(host="localhost", sslmode="require")
 
 
+def tls_login(bouncer, context, session=None):
+    """Log in to p0 over TLS with a raw socket, so that the TLS session can
+    be reused for the next connection"""
+    sock = socket.create_connection((bouncer.host, bouncer.port))
+    sock.sendall(struct.pack("!ii", 8, 80877103))
+    assert sock.recv(1) == b"S"
+    conn = context.wrap_socket(sock, server_hostname="localhost", session=session)
+    params = b"user\0bouncer\0database\0p0\0\0"
+    conn.sendall(struct.pack("!ii", 8 + len(params), 196608) + params)
+    # TLS 1.3 session tickets arrive together with the first reply
+    reply = b""
+    while b"Z\0\0\0\x05I" not in reply:
+        data = conn.recv(4096)
+        assert data
+        reply += data
+    return conn
+
+
+def test_client_ssl_session_resumption(bouncer, cert_dir):
+    root = cert_dir / "TestCA1" / "ca.crt"
+    key = cert_dir / "TestCA1" / "sites" / "01-localhost.key"
+    cert = cert_dir / "TestCA1" / "sites" / "01-localhost.crt"
+    bouncer.admin(f"set client_tls_key_file = '{key}'")
+    bouncer.admin(f"set client_tls_cert_file = '{cert}'")
+    bouncer.admin(f"set client_tls_ca_file = '{root}'")
+    bouncer.admin(f"set client_tls_sslmode = require")
+    bouncer.admin("set client_tls_session_lifetime = 300")
+    if "client_tls_session_lifetime is not supported" in bouncer.log_path.read_text():
+        pytest.skip("libusual without the libtls session API")
+
+    context = ssl.create_default_context(cafile=str(root))
+    first = tls_login(bouncer, context)
+    assert not first.session_reused
+    session = first.session
+    first.close()
+
+    second = tls_login(bouncer, context, session=session)
+    assert second.session_reused
+    second.close()
+
+    with bouncer.admin_runner.cur(row_factory=dict_row) as cur:
+        cur.execute("show stats")
+        stats = {row["database"]: row for row in cur.fetchall()}
+    assert stats["p0"]["total_client_tls_session_hits"] == 1
+    assert stats["p0"]["total_client_tls_session_misses"] == 1
+
+
+@pytest.mark.skipif(not LINUX, reason="kernel TLS is Linux only")
+@pytest.mark.asyncio
+async def test_client_ssl_ktls(pg, tmp_path, cert_dir, monkeypatch):
+    openssl_conf = tmp_path / "openssl.cnf"
+    openssl_conf.write_text(
+        "openssl_conf = init\n"
+        "[init]\n"
+        "ssl_conf = ssl\n"
+        "[ssl]\n"
+        "system_default = ktls\n"
+        "[ktls]\n"
+        "Options = KTLS\n"
+    )
+    monkeypatch.setenv("OPENSSL_CONF", str(openssl_conf))
+    bouncer = Bouncer(
+        pg, tmp_path / "bouncer", base_ini_path=TEST_DIR / "ssl" / "test.ini"
+    )
+    await bouncer.start()
+    try:
+        root = cert_dir / "TestCA1" / "ca.crt"
+        key = cert_dir / "TestCA1" / "sites" / "01-localhost.key"
+        cert = cert_dir / "TestCA1" / "sites" / "01-localhost.crt"
+        bouncer.admin(f"set client_tls_key_file = '{key}'")
+        bouncer.admin(f"set client_tls_cert_file = '{cert}'")
+        bouncer.admin(f"set client_tls_ca_file = '{root}'")
+        bouncer.admin("set client_tls_sslmode = require")
+        bouncer.admin("set verbose = 2")
+
+        bouncer.test(sslmode="require")
+        if "kernel TLS offload enabled" not in bouncer.log_path.read_text():
+            pytest.skip("OpenSSL or kernel without kTLS support")
+
+        # enough data in both directions for many full TLS records
+        payload = "x" * 100000
+        with bouncer.cur(sslmode="require") as cur:
+            for i in range(20):
+                cur.execute(
+                    "select %s::text || i from generate_series(1, 10) i",
+                    (payload,),
+                )
+                rows = cur.fetchall()
+                assert rows == [(payload + str(i),) for i in range(1, 11)]
+    finally:
+        await bouncer.cleanup()
+
+
 def test_client_ssl_set_enable_disable(bouncer, cert_dir):
     root = cert_dir / "TestCA1" / "ca.crt"
     key = cert_dir / "TestCA1" / "sites" / "01-localhost.key"
@@ -47,6 +47,20 @@ def test_query_timeout(bouncer):
             bouncer.sleep(5)
 
 
+def test_query_timeout_cancel(bouncer):
+    bouncer.admin(f"set query_timeout=1")
+    bouncer.admin(f"set query_timeout_cancel=1")
+
+    with bouncer.cur() as cur:
+        pid = cur.execute("select pg_backend_pid()").fetchone()[0]
+        with bouncer.log_contains(r"query timeout, canceling query"):
+            with pytest.raises(psycopg.errors.QueryCanceled):
+                cur.execute("select pg_sleep(5)")
+
+        # both the client and the server connection survive
+        assert cur.execute("select pg_backend_pid()").fetchone()[0] == pid
+
+
 def test_idle_transaction_timeout(bouncer):
     bouncer.admin(f"set pool_mode=transaction")
     bouncer.admin(f"set idle_transaction_timeout=2")
@@ -81,6 +95,21 @@ def test_client_idle_timeout(bouncer):
                 cur.execute("select 1")
 
 
+def test_client_idle_timeout_precision(bouncer):
+    # timeouts do not wait for the periodic maintenance run
+    bouncer.admin(f"set client_idle_timeout=0.1")
+
+    with bouncer.cur() as cur:
+        cur.execute("select 1")
+        with bouncer.log_contains(r"client_idle_timeout"):
+            time.sleep(0.3)
+            with pytest.raises(
+                psycopg.OperationalError,
+                match=r"server closed the connection unexpectedly|Software caused connection abort",
+            ):
+                cur.execute("select 1")
+
+
 @pytest.mark.asyncio
 async def test_server_login_retry(pg, bouncer):
     bouncer.admin(f"set query_timeout=10")
@@ -164,6 +193,18 @@ async def test_server_check_delay(pg, bouncer):
     await query_task
 
 
+def test_server_check_socket(bouncer):
+    bouncer.admin("set server_check_delay=1")
+    bouncer.admin("set server_check_socket=1")
+    bouncer.admin("set verbose=2")
+
+    bouncer.test()
+    time.sleep(2)
+    with bouncer.log_contains(r"P: socket check ok"):
+        with bouncer.log_contains(r"P: checking: select 1", times=0):
+            bouncer.test()
+
+
 @pytest.mark.skipif("not USE_SUDO")
 def test_cancel_wait_timeout(pg, bouncer):
     bouncer.admin("set cancel_wait_timeout=1")